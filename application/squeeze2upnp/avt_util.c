@@ -15,6 +15,7 @@
 #include "squeeze2upnp.h"
 #include "cross_log.h"
 #include "avt_util.h"
+#include "soap_util.h"
 
 /*
 WARNING
@@ -26,27 +27,94 @@ static log_level 	*loglevel = &upnp_loglevel;
 
 static char *CreateDIDL(char *URI, char *ProtInfo, struct metadata_s *MetaData, struct sMRConfig *Config);
 
+/*----------------------------------------------------------------------------*/
+static bool IsAction(tAction *Action, const char *Name)
+{
+	return Action->Name && !strcasecmp(Action->Name, Name);
+}
+
+/*----------------------------------------------------------------------------*/
+bool AVTSafeAction(const char *Name)
+{
+	// while these are waited, polling can go on
+	return Name && (!strcasecmp(Name, "SetNextAVTransportURI") || !strcasecmp(Name, "SetPlayMode"));
+}
+
+/*----------------------------------------------------------------------------*/
+static void CoalesceActions(struct sMR *Device, const char *Name)
+{
+	tAction **Actions = NULL, *Action;
+	int i, n = 0, Media = -1;
+
+	if (!Name) return;
+
+	// queue can only be walked by emptying it
+	while ((Action = queue_extract(&Device->ActionQueue)) != NULL) {
+		Actions = realloc(Actions, (n + 1) * sizeof(tAction*));
+		if (IsAction(Action, "SetAVTransportURI")) Media = n;
+		Actions[n++] = Action;
+	}
+
+	for (i = 0; i < n; i++) {
+		bool Drop = false;
+
+		Action = Actions[i];
+
+		if (!strcasecmp(Name, "SetAVTransportURI")) {
+			// new media supersedes everything that was meant for the previous one
+			Drop = IsAction(Action, "SetAVTransportURI") || IsAction(Action, "SetNextAVTransportURI") ||
+				   IsAction(Action, "Seek") || IsAction(Action, "Play") || IsAction(Action, "Pause");
+		} else if (!strcasecmp(Name, "SetNextAVTransportURI") || !strcasecmp(Name, "SetPlayMode")) {
+			Drop = IsAction(Action, Name);
+		} else if (!strcasecmp(Name, "Seek")) {
+			Drop = i > Media && IsAction(Action, "Seek");
+		} else if (i == n - 1 && !strcasecmp(Name, "Play")) {
+			Drop = IsAction(Action, "Play") || IsAction(Action, "Pause");
+		} else if (i == n - 1 && !strcasecmp(Name, "Pause")) {
+			// a Play that starts a new media must go through
+			Drop = IsAction(Action, "Pause") || (IsAction(Action, "Play") && Media == -1);
+		}
+
+		if (Drop) {
+			LOG_INFO("[%p]: %s superseded by %s", Device, Action->Name, Name);
+			ixmlDocument_free(Action->ActionNode);
+			free(Action);
+		} else {
+			queue_insert(&Device->ActionQueue, Action);
+		}
+	}
+
+	NFREE(Actions);
+}
+
 /*----------------------------------------------------------------------------*/
 bool SubmitTransportAction(struct sMR *Device, IXML_Document *ActionNode)
 {
 	struct sService *Service = &Device->Service[AVT_SRV_IDX];
+	const char *Name = XMLGetLocalName(ActionNode, 1);
 	int rc = 0;
 
 	if (!Device->WaitCookie) {
 		Device->WaitCookie = Device->seqN++;
-		rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
+		Device->WaitSafe = AVTSafeAction(Name);
+		rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
 								 NULL, ActionNode, ActionHandler, Device->WaitCookie);
 
 		if (rc != UPNP_E_SUCCESS) {
-			LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+			LOG_ERROR("[%p]: Error in SOAPSendActionAsync -- %d", Device, rc);
 		}
 
 		ixmlDocument_free(ActionNode);
 	}
 	else {
 		tAction *Action = malloc(sizeof(tAction));
+
+		CoalesceActions(Device, Name);
+
 		Action->Device = Device;
 		Action->ActionNode = ActionNode;
+		Action->Name = Name;
+		Action->Safe = AVTSafeAction(Name);
 		queue_insert(&Device->ActionQueue, Action);
 	}
 
@@ -60,6 +128,7 @@ void AVTActionFlush(cross_queue_t *Queue)
 	tAction *Action;
 
 	while ((Action = queue_extract(Queue)) != NULL) {
+		ixmlDocument_free(Action->ActionNode);
 		free(Action);
 	}
 }
@@ -119,10 +188,10 @@ int AVTCallAction(struct sMR *Device, char *Action, void *Cookie)
 	if ((ActionNode = UpnpMakeAction(Action, Service->Type, 0, NULL)) == NULL) return false;
 	UpnpAddToAction(&ActionNode, Action, Service->Type, "InstanceID", "0");
 
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
+	rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
 							 ActionNode, ActionHandler, Cookie);
 
-	if (rc != UPNP_E_SUCCESS) LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+	if (rc != UPNP_E_SUCCESS) LOG_ERROR("[%p]: Error in SOAPSendActionAsync -- %d", Device, rc);
 	ixmlDocument_free(ActionNode);
 
 	return rc;
@@ -208,13 +277,14 @@ bool AVTStop(struct sMR *Device)
 	AVTActionFlush(&Device->ActionQueue);
 
 	Device->WaitCookie = Device->seqN++;
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
+	Device->WaitSafe = false;
+	rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
 							 NULL, ActionNode, ActionHandler, Device->WaitCookie);
 
 	ixmlDocument_free(ActionNode);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SOAPSendActionAsync -- %d", Device, rc);
 	}
 
 	return (rc == 0);
@@ -237,10 +307,10 @@ int CtrlSetVolume(struct sMR *Device, uint8_t Volume, void *Cookie)
 	sprintf(params, "%d", (int) Volume);
 	UpnpAddToAction(&ActionNode, "SetVolume", Service->Type, "DesiredVolume", params);
 
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
+	rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
 								 ActionNode, ActionHandler, Cookie);
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SOAPSendActionAsync -- %d", Device, rc);
 	}
 
 	if (ActionNode) ixmlDocument_free(ActionNode);
@@ -262,13 +332,13 @@ int CtrlSetMute(struct sMR *Device, bool Mute, void *Cookie)
 	UpnpAddToAction(&ActionNode, "SetMute", Service->Type, "Channel", "Master");
 	UpnpAddToAction(&ActionNode, "SetMute", Service->Type, "DesiredMute", Mute ? "1" : "0");
 
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
+	rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
 							 ActionNode, ActionHandler, Cookie);
 
 	if (ActionNode) ixmlDocument_free(ActionNode);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("[%p]: Error in UpnpSendActionAsync -- %d", Device, rc);
+		LOG_ERROR("[%p]: Error in SOAPSendActionAsync -- %d", Device, rc);
 	}
 
 	return rc;
@@ -337,16 +407,16 @@ int CtrlGetVolume(struct sMR *Device)
 
 
 /*----------------------------------------------------------------------------*/
-char *GetProtocolInfo(struct sMR *Device)
+char *GetProtocolInfo(const char *ControlURL, const char *ServiceType)
 {
 	IXML_Document *ActionNode, *Response = NULL;
-	struct sService *Service = &Device->Service[CNX_MGR_IDX];
 	char *ProtocolInfo = NULL;
 
-	LOG_DEBUG("[%p]: uPNP GetProtocolInfo", Device);
-	ActionNode =  UpnpMakeAction("GetProtocolInfo", Service->Type, 0, NULL);
+	// no device yet, this is called before registration
+	LOG_DEBUG("uPNP GetProtocolInfo %s", ControlURL);
+	ActionNode =  UpnpMakeAction("GetProtocolInfo", ServiceType, 0, NULL);
 
-	UpnpSendAction(glControlPointHandle, Service->ControlURL, Service->Type, NULL,
+	UpnpSendAction(glControlPointHandle, ControlURL, ServiceType, NULL,
 							 ActionNode, &Response);
 
 	if (ActionNode) ixmlDocument_free(ActionNode);
@@ -354,7 +424,7 @@ char *GetProtocolInfo(struct sMR *Device)
 	if (Response) {
 		ProtocolInfo = XMLGetFirstDocumentItem(Response, "Sink", false);
 		ixmlDocument_free(Response);
-		LOG_DEBUG("[%p]: ProtocolInfo %s", Device, ProtocolInfo);
+		LOG_DEBUG("ProtocolInfo %s", ProtocolInfo);
 	}
 
 	return ProtocolInfo;
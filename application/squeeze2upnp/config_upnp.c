@@ -63,6 +63,9 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, root, false, "upnp_log",level2debug(upnp_loglevel));
 	XMLUpdateNode(doc, root, false, "util_log",level2debug(util_loglevel));
 	XMLUpdateNode(doc, root, false, "log_limit", "%d", (int32_t) glLogLimit);
+	XMLUpdateNode(doc, root, false, "max_bandwidth", "%u", glMaxBandwidth);
+	XMLUpdateNode(doc, root, false, "stream_reactors", "%u", glStreamReactors);
+	XMLUpdateNode(doc, root, false, "max_renderers", "%u", glMaxRenderers);
 
 	XMLUpdateNode(doc, common, false, "streambuf_size", "%d", (uint32_t) glDeviceParam.streambuf_size);
 	XMLUpdateNode(doc, common, false, "output_size", "%d", (uint32_t) glDeviceParam.outputbuf_size);
@@ -82,11 +85,13 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, common, false, "send_icy", "%d", (int) glMRConfig.SendIcy);
 	XMLUpdateNode(doc, common, false, "volume_on_play", "%d", (int) glMRConfig.VolumeOnPlay);
 	XMLUpdateNode(doc, common, false, "volume_feedback", "%d", (int) glMRConfig.VolumeFeedback);
+	XMLUpdateNode(doc, common, false, "volume_interval", "%d", glMRConfig.VolumeInterval);
 	XMLUpdateNode(doc, common, false, "send_metadata", "%d", (int) glMRConfig.SendMetaData);
 	XMLUpdateNode(doc, common, false, "send_coverart", "%d", (int) glMRConfig.SendCoverArt);
 	XMLUpdateNode(doc, common, false, "max_volume", "%d", glMRConfig.MaxVolume);
 	XMLUpdateNode(doc, common, false, "accept_nexturi", "%d", (int) glMRConfig.AcceptNextURI);
 	XMLUpdateNode(doc, common, false, "next_delay", "%d", (int)glDeviceParam.next_delay);
+	XMLUpdateNode(doc, common, false, "next_lead", "%d", (int)glDeviceParam.next_lead);
 	XMLUpdateNode(doc, common, false, "auto_play", "%d", (int) glMRConfig.AutoPlay);
 	XMLUpdateNode(doc, common, false, "server", glDeviceParam.server);
 	XMLUpdateNode(doc, common, false, "coverart", glDeviceParam.coverart);
@@ -94,7 +99,7 @@ void SaveConfig(char *name, void *ref, bool full) {
 	XMLUpdateNode(doc, common, false, "resample_options", glDeviceParam.resample_options);
 #endif
 
-	for (int i = 0; i < MAX_RENDERERS; i++) {
+	for (int i = 0; i < glMaxRenderers; i++) {
 		IXML_Node *dev_node;
 
 		if (!glMRDevices[i].Running) continue;
@@ -108,6 +113,7 @@ void SaveConfig(char *name, void *ref, bool full) {
 			XMLUpdateNode(doc, dev_node, true, "friendly_name", p->friendlyName);
 			XMLUpdateNode(doc, dev_node, true, "name", p->sq_config.name);
 			if (*p->sq_config.set_server) XMLUpdateNode(doc, dev_node, true, "server", p->sq_config.set_server);
+			if (p->sq_config.learned_buffer) XMLUpdateNode(doc, dev_node, true, "learned_buffer", "%u", p->sq_config.learned_buffer);
 		}
 		// new device, add nodes
 		else {
@@ -119,6 +125,7 @@ void SaveConfig(char *name, void *ref, bool full) {
 			XMLAddNode(doc, dev_node, "mac", "%02x:%02x:%02x:%02x:%02x:%02x", p->sq_config.mac[0],
 						p->sq_config.mac[1], p->sq_config.mac[2], p->sq_config.mac[3], p->sq_config.mac[4], p->sq_config.mac[5]);
 			XMLAddNode(doc, dev_node, "enabled", "%d", (int) p->Config.Enabled);
+			if (p->sq_config.learned_buffer) XMLAddNode(doc, dev_node, "learned_buffer", "%u", p->sq_config.learned_buffer);
 		}
 	}
 
@@ -148,6 +155,47 @@ void SaveConfig(char *name, void *ref, bool full) {
 	ixmlDocument_free(doc);
 }
 
+/*----------------------------------------------------------------------------*/
+static void XMLAddTextNode(IXML_Document *doc, IXML_Node *parent, char *name, char *value) {
+	IXML_Element *elm = ixmlDocument_createElement(doc, name);
+
+	// XMLAddNode formats in a limited buffer while these can be large
+	ixmlNode_appendChild((IXML_Node*) elm, ixmlDocument_createTextNode(doc, value ? value : ""));
+	ixmlNode_appendChild(parent, (IXML_Node*) elm);
+}
+
+/*----------------------------------------------------------------------------*/
+void SaveCache(char *name) {
+	IXML_Document *doc = ixmlDocument_createDocument();
+	IXML_Node *root = XMLAddNode(doc, NULL, "renderers", NULL);
+
+	for (int i = 0; i < glMaxRenderers; i++) {
+		struct sMR *p = glMRDevices + i;
+		IXML_Node *dev_node;
+
+		// Sonos slaves are simply re-discovered
+		if (!p->Running || p->Master || !p->Description) continue;
+
+		dev_node = XMLAddNode(doc, root, "device", NULL);
+		XMLAddNode(doc, dev_node, "udn", p->UDN);
+		XMLAddNode(doc, dev_node, "location", p->DescDocURL);
+		XMLAddNode(doc, dev_node, "next_uri", "%d", (int) p->HasNextURI);
+		XMLAddNode(doc, dev_node, "info_ex", "%d", (int) p->HasInfoEx);
+		XMLAddTextNode(doc, dev_node, "sink", p->Sink);
+		XMLAddTextNode(doc, dev_node, "description", p->Description);
+	}
+
+	FILE* file = fopen(name, "wb");
+	if (file) {
+		char *s = ixmlDocumenttoString(doc);
+		fwrite(s, 1, strlen(s), file);
+		fclose(file);
+		free(s);
+	}
+
+	ixmlDocument_free(doc);
+}
+
 /*----------------------------------------------------------------------------*/
 static void LoadConfigItem(tMRConfig *Conf, sq_dev_param_t *sq_conf, char *name, char *val) {
 	if (!val) return;
@@ -171,15 +219,18 @@ static void LoadConfigItem(tMRConfig *Conf, sq_dev_param_t *sq_conf, char *name,
 	if (!strcmp(name, "live_pause")) Conf->LivePause = atol(val);
 	if (!strcmp(name, "volume_on_play")) Conf->VolumeOnPlay = atol(val);
 	if (!strcmp(name, "volume_feedback")) Conf->VolumeFeedback = atol(val);
+	if (!strcmp(name, "volume_interval")) Conf->VolumeInterval = atol(val);
 	if (!strcmp(name, "max_volume")) Conf->MaxVolume = atol(val);
 	if (!strcmp(name, "auto_play")) Conf->AutoPlay = atol(val);
 	if (!strcmp(name, "accept_nexturi")) Conf->AcceptNextURI = atol(val);
 	if (!strcmp(name, "next_delay")) sq_conf->next_delay = atol(val);
+	if (!strcmp(name, "next_lead")) sq_conf->next_lead = atol(val);
 	if (!strcmp(name, "send_metadata")) Conf->SendMetaData = atol(val);
 	if (!strcmp(name, "send_coverart")) Conf->SendCoverArt = atol(val);
 	if (!strcmp(name, "name")) strcpy(sq_conf->name, val);
 	if (!strcmp(name, "server")) strcpy(sq_conf->server, val);
 	if (!strcmp(name, "coverart")) strcpy(sq_conf->coverart, val);
+	if (!strcmp(name, "learned_buffer")) sq_conf->learned_buffer = atol(val);
 	if (!strcmp(name, "mac"))  {
 		unsigned mac[6];
 		int i;
@@ -208,6 +259,9 @@ static void LoadGlobalItem(char *name, char *val)
 	if (!strcmp(name, "upnp_log")) upnp_loglevel = debug2level(val);
 	if (!strcmp(name, "util_log")) util_loglevel = debug2level(val);
 	if (!strcmp(name, "log_limit")) glLogLimit = atol(val);
+	if (!strcmp(name, "max_bandwidth")) glMaxBandwidth = atol(val);
+	if (!strcmp(name, "stream_reactors")) glStreamReactors = atol(val);
+	if (!strcmp(name, "max_renderers") && atol(val) > 0) glMaxRenderers = atol(val);
 }
 
 /*----------------------------------------------------------------------------*/
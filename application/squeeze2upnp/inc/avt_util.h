@@ -17,6 +17,8 @@ struct sMR;
 typedef struct sAction {
 	struct sMR *Device;
 	void   *ActionNode;
+	const char *Name;					// points into ActionNode
+	bool	Safe;						// does not change transport state
 	union {
 		uint8_t Volume;
 	} Param;
@@ -31,10 +33,11 @@ bool 	AVTSeek(struct sMR *Device, unsigned Interval);
 bool 	AVTBasic(struct sMR *Device, char *Action);
 bool 	AVTStop(struct sMR *Device);
 void	AVTActionFlush(cross_queue_t *Queue);
+bool	AVTSafeAction(const char *Name);
 int 	CtrlSetVolume(struct sMR *Device, uint8_t Volume, void *Cookie);
 int 	CtrlSetMute(struct sMR *Device, bool Mute, void *Cookie);
 int 	CtrlGetVolume(struct sMR *Device);
 int 	CtrlGetGroupVolume(struct sMR *Device);
-char*	GetProtocolInfo(struct sMR *Device);
+char*	GetProtocolInfo(const char *ControlURL, const char *ServiceType);
 
 
@@ -16,6 +16,7 @@
 #include "ixml.h" /* for IXML_Document, IXML_Element */
 
 void			SaveConfig(char *name, void *ref, bool full);
+void			SaveCache(char *name);
 void		 	*LoadConfig(char *name, tMRConfig *Conf, sq_dev_param_t *sq_conf);
 void	 		*FindMRConfig(void *ref, char *UDN);
 void 			*LoadMRConfig(void *ref, char *UDN, tMRConfig *Conf, sq_dev_param_t *sq_conf);
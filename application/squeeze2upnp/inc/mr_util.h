@@ -11,17 +11,29 @@
 
 #include "squeeze2upnp.h"
 
+enum { KEY_UDN, KEY_CURL, KEY_SID, KEY_LOCATION };
+
 void 		FlushMRDevices(void);
 void 		DelMRDevice(struct sMR *p);
 struct sMR *GetMaster(struct sMR *Device, char **Name);
+char 		*GetZoneGroupState(const char *ControlURL, const char *ServiceType);
+struct sMR *ParseMaster(struct sMR *Device, const char *ZoneGroupState, char **Name);
 int 		CalcGroupVolume(struct sMR *Master);
 bool		CheckAndLock(struct sMR *Device);
 double		GetLocalGroupVolume(struct sMR *Member, int *count);
 
+void		InitMRIndex(void);
+void		EndMRIndex(void);
+void		IndexMRDevice(struct sMR *Device);
+void		UnindexMRDevice(struct sMR *Device);
+void		IndexMRKey(int Kind, const char *Key, struct sMR *Device);
+void		UnindexMRKey(int Kind, const char *Key, struct sMR *Device);
+
 struct sMR*  SID2Device(const UpnpString *SID);
 struct sMR*  CURL2Device(const UpnpString *CtrlURL);
 struct sMR*  PURL2Device(const UpnpString *URL);
 struct sMR*  UDN2Device(const char *SID);
+struct sMR*  Location2Device(const char *Location);
 
 struct sService* EventURL2Service(const UpnpString *URL, struct sService *s);
 
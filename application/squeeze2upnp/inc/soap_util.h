@@ -0,0 +1,17 @@
+/*
+ *  UPnP SOAP keep-alive client
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ * see LICENSE
+ *
+ */
+
+#pragma once
+
+#include "upnp.h"
+
+void 	SOAPInit(void);
+void 	SOAPEnd(void);
+int 	SOAPSendActionAsync(UpnpClient_Handle Handle, const char *ActionURL, const char *ServiceType,
+							const char *DevUDN, IXML_Document *Action, Upnp_FunPtr Callback, const void *Cookie);
@@ -36,7 +36,6 @@
 /* typedefs */
 /*----------------------------------------------------------------------------*/
 
-#define MAX_RENDERERS	32
 #define MAGIC			0xAABBCCDD
 #define RESOURCE_LENGTH	250
 
@@ -63,6 +62,7 @@ typedef struct sMRConfig
 	int			RemoveTimeout;
 	int 		VolumeOnPlay;		// change only volume when playing has started or disable volume commands
 	bool		VolumeFeedback;
+	int			VolumeInterval;		// minimum time between volume commands (ms)
 	int			AcceptNextURI;
 	bool		SendMetaData;
 	bool		SendCoverArt;
@@ -88,40 +88,60 @@ struct sMR {
 	char			*NextProtoInfo;					// gapped next protocolInfo
 	metadata_t		NextMetaData;					// gapped next metadata
 	char			*ExpectedURI;					// to detect track change
+	cross_queue_t	TrackQueue;						// tracks to be sent once player has moved to next
+	int				TrackQueued;
 	int32_t			Duration;       			 	// for players that don't report end of track (Bose)
 	uint32_t 		ElapsedLast, ElapsedOffset;     // for players that reset counter on icy changes
+	uint32_t		RelTime, RelStamp;				// last polled position and when it was received
 	bool			ShortTrack;    					// current or next track is short
 	int16_t			ShortTrackWait;					// stop timeout when short track is last track
 	sq_action_t		sqState;
 	uint8_t			*seqN;
 	void			*WaitCookie, *StartCookie;
+	bool			WaitSafe;						// waited action does not change transport state
 	cross_queue_t	ActionQueue;
 	unsigned		TrackPoll, StatePoll;
+	uint32_t		PollBoost;						// dense polling until then (after transport change)
+	bool			EventTrusted;					// transport state events received and consistent
 	int				InfoExPoll;
 	int	 			SqueezeHandle;
 	struct sService Service[NB_SRV];
 	struct sAction	*Actions;
 	struct sMR		*Master;
 	pthread_mutex_t Mutex;
-	pthread_t 		Thread;
+	uint32_t		PollDue, PollLast;				// next and last poll by the scheduler
+	int				PollSlot;						// timer wheel slot, -1 when not scheduled
+	struct sMR		*PollNext;
+	struct sMessage	* volatile Inbox;				// posted by callbacks, processed by scheduler
 	double			Volume;
 	bool			Muted;
 	uint32_t		VolumeStampRx, VolumeStampTx;	// timestamps to filter volume loopbacks
+	uint32_t		VolumeSent;						// last volume command
+	bool			VolumePending;					// latest volume waits for rate-limit
 	int				ErrorCount;                     // UPnP protocol error count, negative means fatal error
 	uint32_t		LastSeen;						// presence timeout for player which went dark
+	uint32_t		DescExpires;					// description is re-read on keep-alive after that
+	bool			GroupUpdate;					// Sonos group announce, topology must be re-read
 	char			*Sink;
+	char			*Description;					// description document, kept for the warm start cache
+	bool			HasNextURI, HasInfoEx;			// AVTransport optional actions
+	bool			Cached;							// warm started and not yet seen by SSDP
 };
 
 extern UpnpClient_Handle   	glControlPointHandle;
 extern char					glCustomDiscovery[];
 extern char 				glBinding[];
 extern int32_t				glLogLimit;
+extern uint32_t				glMaxBandwidth;
+extern uint32_t				glStreamReactors;
+extern uint32_t				glMaxRenderers;
 extern tMRConfig			glMRConfig;
 extern sq_dev_param_t		glDeviceParam;
-extern struct sMR			glMRDevices[MAX_RENDERERS];
+extern struct sMR			*glMRDevices;
 extern pthread_mutex_t 		glMRMutex;
 
 int MasterHandler(Upnp_EventType EventType, const void* Event, void* Cookie);
 int ActionHandler(Upnp_EventType EventType, const void* Event, void* Cookie);
+void ReleaseMRDevice(struct sMR *Device);
 
 #endif
@@ -23,6 +23,20 @@
 extern log_level	util_loglevel;
 static log_level 	*loglevel = &util_loglevel;
 
+#define INDEX_SIZE	256
+
+struct sIndexEntry {
+	struct sIndexEntry *Next;
+	int			Kind;
+	struct sMR 	*Device;
+	char		Key[];
+};
+
+static struct {
+	pthread_mutex_t		Mutex;
+	struct sIndexEntry	*Buckets[INDEX_SIZE];
+} glIndex;
+
 static IXML_Node*	_getAttributeNode(IXML_Node *node, char *SearchAttr);
 int 				_voidHandler(Upnp_EventType EventType, const void *_Event, void *Cookie) { return 0; }
 
@@ -33,42 +47,67 @@ int CalcGroupVolume(struct sMR *Device) {
 
 	if (!*Device->Service[GRP_REND_SRV_IDX].ControlURL) return -1;
 
-	for (i = 0; i < MAX_RENDERERS; i++) {
+	/*
+	This runs on the scheduler, so no blocking query for a member's volume. It
+	is known from the first RenderingControl event after subscription, until
+	then that member is just left out
+	*/
+	for (i = 0; i < glMaxRenderers; i++) {
 		struct sMR *p = glMRDevices + i;
-		if (p->Running && (p == Device || p->Master == Device)) {
-			if (p->Volume == -1) p->Volume = CtrlGetVolume(p);
+		if (p->Running && (p == Device || p->Master == Device) && p->Volume != -1) {
 			GroupVolume += p->Volume;
 			n++;
 		}
 	}
 
-	return GroupVolume / n;
+	return n ? GroupVolume / n : 0;
 }
 
 /*----------------------------------------------------------------------------*/
 struct sMR *GetMaster(struct sMR *Device, char **Name)
 {
-	IXML_Document *ActionNode = NULL, *Response;
-	char *Body;
-	struct sMR *Master = NULL;
 	struct sService *Service = &Device->Service[TOPOLOGY_IDX];
-	bool done = false;
+	struct sMR *Master;
+	char *State;
 
 	if (!*Service->ControlURL) return NULL;
 
+	State = GetZoneGroupState(Service->ControlURL, Service->Type);
+	Master = ParseMaster(Device, State, Name);
+	NFREE(State);
+
+	return Master;
+}
+
+/*----------------------------------------------------------------------------*/
+char *GetZoneGroupState(const char *ControlURL, const char *ServiceType)
+{
+	IXML_Document *ActionNode, *Response = NULL;
+	char *State;
 
-	ActionNode = UpnpMakeAction("GetZoneGroupState", Service->Type, 0, NULL);
+	ActionNode = UpnpMakeAction("GetZoneGroupState", ServiceType, 0, NULL);
 
-	UpnpSendAction(glControlPointHandle, Service->ControlURL, Service->Type,
+	UpnpSendAction(glControlPointHandle, ControlURL, ServiceType,
 								 NULL, ActionNode, &Response);
 
 	if (ActionNode) ixmlDocument_free(ActionNode);
 
-	Body = XMLGetFirstDocumentItem(Response, "ZoneGroupState", true);
+	State = XMLGetFirstDocumentItem(Response, "ZoneGroupState", true);
 	if (Response) ixmlDocument_free(Response);
 
-	Response = ixmlParseBuffer(Body);
-	NFREE(Body);
+	return State;
+}
+
+/*----------------------------------------------------------------------------*/
+struct sMR *ParseMaster(struct sMR *Device, const char *ZoneGroupState, char **Name)
+{
+	IXML_Document *Response;
+	struct sMR *Master = NULL;
+	bool done = false;
+
+	if (!ZoneGroupState) return NULL;
+
+	Response = ixmlParseBuffer(ZoneGroupState);
 
 	if (Response) {
 		char myUUID[RESOURCE_LENGTH] = "";
@@ -98,7 +137,7 @@ struct sMR *GetMaster(struct sMR *Device, char **Name)
 				}
 
 				// look for our master (if we are not)
-				for (k = 0; !done && k < MAX_RENDERERS; k++) {
+				for (k = 0; !done && k < glMaxRenderers; k++) {
 					if (glMRDevices[k].Running && strcasestr(glMRDevices[k].UDN, (char*) Coordinator)) {
 						Master = glMRDevices + k;
 						LOG_DEBUG("Found Master %s %s", myUUID, Master->UDN);
@@ -128,7 +167,7 @@ void FlushMRDevices(void)
 {
 	int i;
 
-	for (i = 0; i < MAX_RENDERERS; i++) {
+	for (i = 0; i < glMaxRenderers; i++) {
 		struct sMR *p = &glMRDevices[i];
 		pthread_mutex_lock(&p->Mutex);
 		if (p->Running) {
@@ -155,42 +194,152 @@ void DelMRDevice(struct sMR *p)
 	}
 
 	p->Running = false;
+	UnindexMRDevice(p);
 
-	// kick-up all sleepers
-	crossthreads_wake();
+	// leave the poll scheduler and release resources
+	ReleaseMRDevice(p);
 
 	pthread_mutex_unlock(&p->Mutex);
-	pthread_join(p->Thread, NULL);
 }
 
 /*----------------------------------------------------------------------------*/
-struct sMR* CURL2Device(const UpnpString *CtrlURL)
+/*
+Devices are found by UDN, control URL, SID and description URL on every
+UPnP callback, so these keys are hashed instead of scanning all devices. An
+entry only exists while its device is running and the index has its own
+mutex which is never held while taking a device's one
+*/
+static uint32_t _HashKey(int Kind, const char *Key)
 {
-	for (int i = 0; i < MAX_RENDERERS; i++) {
-		if (!glMRDevices[i].Running) continue;
-		for (int j = 0; j < NB_SRV; j++) {
-			if (!strcmp(glMRDevices[i].Service[j].ControlURL, UpnpString_get_String(CtrlURL))) {
-				return &glMRDevices[i];
-			}
+	uint32_t Hash = 5381 + Kind;
+	while (*Key) Hash = Hash * 33 + (uint8_t) *Key++;
+	return Hash % INDEX_SIZE;
+}
+
+/*----------------------------------------------------------------------------*/
+void InitMRIndex(void)
+{
+	memset(&glIndex, 0, sizeof(glIndex));
+	pthread_mutex_init(&glIndex.Mutex, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void EndMRIndex(void)
+{
+	for (int i = 0; i < INDEX_SIZE; i++) {
+		while (glIndex.Buckets[i]) {
+			struct sIndexEntry *Entry = glIndex.Buckets[i];
+			glIndex.Buckets[i] = Entry->Next;
+			free(Entry);
 		}
 	}
 
-	return NULL;
+	pthread_mutex_destroy(&glIndex.Mutex);
 }
 
 /*----------------------------------------------------------------------------*/
-struct sMR* SID2Device(const UpnpString *SID)
+void IndexMRKey(int Kind, const char *Key, struct sMR *Device)
 {
-	for (int i = 0; i < MAX_RENDERERS; i++) {
-		if (!glMRDevices[i].Running) continue;
-		for (int j = 0; j < NB_SRV; j++) {
-			if (!strcmp(glMRDevices[i].Service[j].SID, UpnpString_get_String(SID))) {
-				return &glMRDevices[i];
-			}
+	struct sIndexEntry *Entry;
+	uint32_t Hash;
+
+	if (!Key || !*Key) return;
+
+	Hash = _HashKey(Kind, Key);
+	Entry = malloc(sizeof(struct sIndexEntry) + strlen(Key) + 1);
+	Entry->Kind = Kind;
+	Entry->Device = Device;
+	strcpy(Entry->Key, Key);
+
+	pthread_mutex_lock(&glIndex.Mutex);
+	Entry->Next = glIndex.Buckets[Hash];
+	glIndex.Buckets[Hash] = Entry;
+	pthread_mutex_unlock(&glIndex.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void UnindexMRKey(int Kind, const char *Key, struct sMR *Device)
+{
+	struct sIndexEntry **p;
+
+	if (!Key || !*Key) return;
+
+	pthread_mutex_lock(&glIndex.Mutex);
+
+	for (p = &glIndex.Buckets[_HashKey(Kind, Key)]; *p; p = &(*p)->Next) {
+		struct sIndexEntry *Entry = *p;
+		if (Entry->Kind == Kind && Entry->Device == Device && !strcmp(Entry->Key, Key)) {
+			*p = Entry->Next;
+			free(Entry);
+			break;
 		}
 	}
 
-	return NULL;
+	pthread_mutex_unlock(&glIndex.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+void IndexMRDevice(struct sMR *Device)
+{
+	IndexMRKey(KEY_UDN, Device->UDN, Device);
+	IndexMRKey(KEY_LOCATION, Device->DescDocURL, Device);
+	for (int i = 0; i < NB_SRV; i++) {
+		IndexMRKey(KEY_CURL, Device->Service[i].ControlURL, Device);
+		IndexMRKey(KEY_SID, Device->Service[i].SID, Device);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+void UnindexMRDevice(struct sMR *Device)
+{
+	pthread_mutex_lock(&glIndex.Mutex);
+
+	for (int i = 0; i < INDEX_SIZE; i++) {
+		struct sIndexEntry **p = &glIndex.Buckets[i];
+		while (*p) {
+			struct sIndexEntry *Entry = *p;
+			if (Entry->Device == Device) {
+				*p = Entry->Next;
+				free(Entry);
+			} else p = &Entry->Next;
+		}
+	}
+
+	pthread_mutex_unlock(&glIndex.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static struct sMR* _FindMRKey(int Kind, const char *Key)
+{
+	struct sIndexEntry *Entry;
+	struct sMR *Device = NULL;
+
+	if (!Key) return NULL;
+
+	pthread_mutex_lock(&glIndex.Mutex);
+
+	for (Entry = glIndex.Buckets[_HashKey(Kind, Key)]; Entry; Entry = Entry->Next) {
+		if (Entry->Kind == Kind && !strcmp(Entry->Key, Key)) {
+			Device = Entry->Device;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&glIndex.Mutex);
+
+	return Device;
+}
+
+/*----------------------------------------------------------------------------*/
+struct sMR* CURL2Device(const UpnpString *CtrlURL)
+{
+	return _FindMRKey(KEY_CURL, UpnpString_get_String(CtrlURL));
+}
+
+/*----------------------------------------------------------------------------*/
+struct sMR* SID2Device(const UpnpString *SID)
+{
+	return _FindMRKey(KEY_SID, UpnpString_get_String(SID));
 }
 
 /*----------------------------------------------------------------------------*/
@@ -207,14 +356,13 @@ struct sService *EventURL2Service(const UpnpString *URL, struct sService *s)
 /*----------------------------------------------------------------------------*/
 struct sMR* UDN2Device(const char *UDN)
 {
-	for (int i = 0; i < MAX_RENDERERS; i++) {
-		if (!glMRDevices[i].Running) continue;
-		if (!strcmp(glMRDevices[i].UDN, UDN)) {
-			return &glMRDevices[i];
-		}
-	}
+	return _FindMRKey(KEY_UDN, UDN);
+}
 
-	return NULL;
+/*----------------------------------------------------------------------------*/
+struct sMR* Location2Device(const char *Location)
+{
+	return _FindMRKey(KEY_LOCATION, Location);
 }
 
 /*----------------------------------------------------------------------------*/
@@ -425,9 +573,16 @@ char *XMLGetChangeItem(IXML_Document *doc, char *Tag, char *SearchAttr, char *Se
 
 	for (i = 0; i < ixmlNodeList_length(List); i++) {
 		IXML_Node *node = ixmlNodeList_item(List, i);
-		IXML_Node *attr = _getAttributeNode(node, SearchAttr);
+		IXML_Node *attr;
+
+		// no search attribute, just take first tag (e.g. TransportState)
+		if (!SearchAttr) {
+			if ((attr = _getAttributeNode(node, RetAttr)) == NULL) continue;
+			ret = strdup(ixmlNode_getNodeValue(attr));
+			break;
+		}
 
-		if (!attr) continue;
+		if ((attr = _getAttributeNode(node, SearchAttr)) == NULL) continue;
 
 		if (!strcasecmp(ixmlNode_getNodeValue(attr), SearchVal)) {
 			if ((node = ixmlNode_getNextSibling(attr)) == NULL)
@@ -0,0 +1,724 @@
+/*
+ *  UPnP SOAP keep-alive client
+ *
+ *	(c) Philippe, philippe_44@outlook.com
+ *
+ * see LICENSE
+ *
+ */
+
+/*
+ libupnp opens a new TCP connection for every action it sends. Here, each
+ control URL has one persistent HTTP/1.1 connection on which actions are sent
+ one after the other, in submission order. Renderers sharing an ip:port (e.g.
+ virtual ones) are thus not serialized behind each other. The caller writes
+ its request right away when the connection is idle, then a single thread
+ opens connections, reads responses, sends queued requests, expires them after
+ SOAP_TIMEOUT and closes connections idle for SOAP_IDLE. Completion callbacks
+ are called from that thread with the same event libupnp would provide, so
+ ActionHandler does not know the difference. A setter (volume, mute) that is
+ still waiting to be sent is replaced by a newer one. Endpoints that refuse
+ persistent connections, or URLs that can't be handled here, are sent to
+ libupnp.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "ixmlextra.h"
+#include "squeeze2upnp.h"
+#include "mr_util.h"
+#include "cross_net.h"
+#include "cross_log.h"
+#include "soap_util.h"
+
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL 0
+#endif
+
+#define SOAP_TIMEOUT			(10*1000)
+#define SOAP_CONNECT_TIMEOUT	(5*1000)
+#define SOAP_IDLE				(20*1000)
+#define SOAP_POLL				(50)
+#define SOAP_PACKET				(4096)
+#define SOAP_MAX_PACKET			(256*1024)
+
+#define SOAP_HEAD	"<?xml version=\"1.0\"?>\r\n" \
+					"<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" " \
+					"s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\r\n<s:Body>"
+#define SOAP_TAIL	"</s:Body>\r\n</s:Envelope>\r\n"
+
+typedef struct sSOAPRequest {
+	char			*Packet, *URL, *Name;
+	size_t			Len, Sent;
+	uint32_t		Deadline;
+	bool			Retried;
+	Upnp_FunPtr		Callback;
+	const void		*Cookie;
+	int				ErrCode;
+	IXML_Document	*Result;
+	struct sSOAPRequest *Next;
+} tSOAPRequest;
+
+typedef struct sSOAPEndpoint {
+	char			*URL;					// control URL, the key
+	struct in_addr	Host;
+	uint16_t		Port;
+	int				Sock;
+	bool			Connecting;
+	bool			Reused;					// connection has already served a response
+	bool			Fallback;				// no persistent connection, use libupnp
+	uint32_t		Last;
+	char			*Buf;
+	size_t			Len, Size;
+	tSOAPRequest	*Queue;					// head is the one in flight
+	struct sSOAPEndpoint *Next;
+} tSOAPEndpoint;
+
+static struct {
+	pthread_mutex_t	Mutex;
+	pthread_t		Thread;
+	bool			Running;
+	tSOAPEndpoint	*Endpoints;
+	tSOAPRequest	*Done;					// completed, callback not yet called
+} glSOAP;
+
+extern log_level	upnp_loglevel;
+static log_level 	*loglevel = &upnp_loglevel;
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPParseURL(const char *URL, struct in_addr *Host, uint16_t *Port, const char **Path)
+{
+	char Name[64];
+	unsigned Value = 80;
+	int n = 0;
+
+	// only plain http with a numeric host, everything else goes to libupnp
+	if (strncasecmp(URL, "http://", 7) || sscanf(URL + 7, "%63[^:/]%n", Name, &n) != 1) return false;
+	if ((Host->s_addr = inet_addr(Name)) == INADDR_NONE) return false;
+
+	URL += 7 + n;
+	if (*URL == ':') Value = strtoul(URL + 1, (char**) &URL, 10);
+
+	*Port = Value;
+	*Path = *URL ? URL : "/";
+
+	return (*Path)[0] == '/';
+}
+
+/*----------------------------------------------------------------------------*/
+static char *_SOAPPacket(struct in_addr Host, uint16_t Port, const char *Path, const char *ServiceType,
+						 const char *Name, IXML_Document *Action, size_t *Len)
+{
+	DOMString Body;
+	char *Packet = NULL;
+	int n;
+
+	if ((Body = ixmlPrintNode((IXML_Node*) Action)) == NULL) return NULL;
+
+	n = asprintf(&Packet, "POST %s HTTP/1.1\r\n"
+				 "HOST: %s:%hu\r\n"
+				 "CONTENT-LENGTH: %zu\r\n"
+				 "CONTENT-TYPE: text/xml; charset=\"utf-8\"\r\n"
+				 "SOAPACTION: \"%s#%s\"\r\n"
+				 "CONNECTION: keep-alive\r\n\r\n"
+				 SOAP_HEAD "%s" SOAP_TAIL,
+				 Path, inet_ntoa(Host), Port, strlen(SOAP_HEAD) + strlen(Body) + strlen(SOAP_TAIL),
+				 ServiceType, Name, Body);
+
+	ixmlFreeDOMString(Body);
+
+	if (n < 0) return NULL;
+
+	*Len = n;
+	return Packet;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPFree(tSOAPRequest *Request)
+{
+	if (Request->Result) ixmlDocument_free(Request->Result);
+	free(Request->Packet);
+	free(Request->URL);
+	free(Request->Name);
+	free(Request);
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPSetter(const char *Name)
+{
+	// only the last value of these matters
+	return !strcasecmp(Name, "SetVolume") || !strcasecmp(Name, "SetMute") || !strcasecmp(Name, "SetGroupVolume");
+}
+
+/*----------------------------------------------------------------------------*/
+static tSOAPEndpoint *_SOAPEndpoint(const char *URL, struct in_addr Host, uint16_t Port)
+{
+	tSOAPEndpoint *Endpoint;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	for (Endpoint = glSOAP.Endpoints; Endpoint; Endpoint = Endpoint->Next) {
+		if (!strcmp(Endpoint->URL, URL)) return Endpoint;
+	}
+
+	Endpoint = calloc(1, sizeof(tSOAPEndpoint));
+	Endpoint->URL = strdup(URL);
+	Endpoint->Host = Host;
+	Endpoint->Port = Port;
+	Endpoint->Sock = -1;
+	Endpoint->Next = glSOAP.Endpoints;
+	glSOAP.Endpoints = Endpoint;
+
+	return Endpoint;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPDone(tSOAPEndpoint *Endpoint, int ErrCode, IXML_Document *Result)
+{
+	tSOAPRequest *Request = Endpoint->Queue, **p = &glSOAP.Done;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	Endpoint->Queue = Request->Next;
+	Request->ErrCode = ErrCode;
+	Request->Result = Result;
+	Request->Next = NULL;
+
+	// keep completion order
+	while (*p) p = &(*p)->Next;
+	*p = Request;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPClose(tSOAPEndpoint *Endpoint)
+{
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	if (Endpoint->Sock != -1) {
+		LOG_DEBUG("closing SOAP connection %s:%hu", inet_ntoa(Endpoint->Host), Endpoint->Port);
+		closesocket(Endpoint->Sock);
+		Endpoint->Sock = -1;
+	}
+
+	Endpoint->Len = 0;
+	Endpoint->Reused = false;
+	Endpoint->Connecting = false;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPUnreachable(tSOAPEndpoint *Endpoint, int ErrCode)
+{
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	LOG_WARN("unable to open SOAP connection %s:%hu (%d)", inet_ntoa(Endpoint->Host), Endpoint->Port, ErrCode);
+	_SOAPClose(Endpoint);
+	while (Endpoint->Queue) _SOAPDone(Endpoint, ErrCode, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPBroken(tSOAPEndpoint *Endpoint)
+{
+	tSOAPRequest *Request = Endpoint->Queue;
+	bool Retry = Request && Endpoint->Reused && !Endpoint->Len && !Request->Retried;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	_SOAPClose(Endpoint);
+
+	// nothing in flight, next request will re-open
+	if (!Request || !Request->Sent) return;
+
+	// a kept connection might have been closed by renderer meanwhile
+	if (Retry) {
+		LOG_DEBUG("SOAP connection %s:%hu was closed, re-sending", inet_ntoa(Endpoint->Host), Endpoint->Port);
+		Request->Retried = true;
+		Request->Sent = 0;
+	} else {
+		_SOAPDone(Endpoint, UPNP_E_SOCKET_READ, NULL);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPSend(tSOAPEndpoint *Endpoint)
+{
+	tSOAPRequest *Request = Endpoint->Queue;
+	int n;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	if (!Request || Endpoint->Sock == -1 || Endpoint->Connecting || Request->Sent == Request->Len) return true;
+
+	if (!Request->Sent) Request->Deadline = gettime_ms() + SOAP_TIMEOUT;
+
+	n = send(Endpoint->Sock, Request->Packet + Request->Sent, Request->Len - Request->Sent, MSG_NOSIGNAL);
+	if (n < 0) return last_error() == ERROR_WOULDBLOCK;
+
+	Request->Sent += n;
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPHeader(char *Head, char *End, char *Name, char *Value, size_t Size)
+{
+	size_t Len = strlen(Name);
+	char *p;
+
+	for (p = strstr(Head, "\r\n"); p && p < End; p = strstr(p, "\r\n")) {
+		size_t n;
+
+		p += 2;
+		if (strncasecmp(p, Name, Len) || p[Len] != ':') continue;
+
+		for (p += Len + 1; *p == ' ' || *p == '\t'; p++);
+		for (n = 0; n < Size - 1 && p[n] && p[n] != '\r'; n++) Value[n] = p[n];
+		Value[n] = '\0';
+
+		return true;
+	}
+
+	return false;
+}
+
+/*----------------------------------------------------------------------------*/
+/* walk chunks, return end of message or NULL if incomplete. When Out is set, */
+/* data is moved to it (in place decoding, never overtakes the source)		 */
+static char *_SOAPChunks(char *p, char *End, char **Out)
+{
+	while (true) {
+		char *Line = strstr(p, "\r\n");
+		size_t Size;
+
+		if (!Line || Line + 2 > End) return NULL;
+
+		Size = strtoul(p, NULL, 16);
+		p = Line + 2;
+
+		// last chunk, skip trailers up to empty line
+		if (!Size) {
+			while (strncmp(p, "\r\n", 2)) {
+				if ((Line = strstr(p, "\r\n")) == NULL) return NULL;
+				p = Line + 2;
+			}
+			return p + 2;
+		}
+
+		if (p + Size + 2 > End) return NULL;
+
+		if (Out) {
+			memmove(*Out, p, Size);
+			*Out += Size;
+		}
+
+		p += Size + 2;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static IXML_Document *_SOAPResult(IXML_Document *Doc)
+{
+	IXML_NodeList *List = ixmlDocument_getElementsByTagNameNS(Doc, "*", "Body");
+	IXML_Node *Node = List ? ixmlNodeList_item(List, 0) : NULL;
+	IXML_Document *Result = NULL;
+
+	if (List) ixmlNodeList_free(List);
+
+	// the response is the first element in the body
+	for (Node = Node ? ixmlNode_getFirstChild(Node) : NULL; Node && ixmlNode_getNodeType(Node) != eELEMENT_NODE;
+		 Node = ixmlNode_getNextSibling(Node));
+
+	if (Node) {
+		DOMString s = ixmlPrintNode(Node);
+		Result = ixmlParseBuffer(s);
+		ixmlFreeDOMString(s);
+	}
+
+	return Result;
+}
+
+/*----------------------------------------------------------------------------*/
+/* process a full response if any, return 1 when done, 0 when incomplete and */
+/* -1 when the response is not understood									 */
+static int _SOAPResponse(tSOAPEndpoint *Endpoint, bool Closed)
+{
+	char Value[32], *Body, *End, *Next;
+	IXML_Document *Doc, *Result = NULL;
+	int Status, ErrCode;
+	bool KeepAlive;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	if ((Body = strstr(Endpoint->Buf, "\r\n\r\n")) == NULL) return Closed ? -1 : 0;
+	if (sscanf(Endpoint->Buf, "HTTP/%*u.%*u %d", &Status) != 1) return -1;
+
+	Body += 4;
+	End = Endpoint->Buf + Endpoint->Len;
+	KeepAlive = strncasecmp(Endpoint->Buf, "HTTP/1.0", 8);
+
+	if (_SOAPHeader(Endpoint->Buf, Body, "Connection", Value, sizeof(Value))) {
+		if (!strcasecmp(Value, "close")) KeepAlive = false;
+		else if (!strcasecmp(Value, "keep-alive")) KeepAlive = true;
+	}
+
+	if (_SOAPHeader(Endpoint->Buf, Body, "Content-Length", Value, sizeof(Value))) {
+		Next = Body + atol(Value);
+		if (Next > End) return Closed ? -1 : 0;
+		End = Next;
+	} else if (_SOAPHeader(Endpoint->Buf, Body, "Transfer-Encoding", Value, sizeof(Value)) && strcasestr(Value, "chunked")) {
+		if ((Next = _SOAPChunks(Body, End, NULL)) == NULL) return Closed ? -1 : 0;
+		End = Body;
+		_SOAPChunks(Body, Next, &End);
+	} else {
+		// body ends with the connection
+		if (!Closed) return 0;
+		Next = End;
+		KeepAlive = false;
+	}
+
+	// there is only one response in flight
+	if (!Endpoint->Queue || !Endpoint->Queue->Sent) {
+		LOG_WARN("unsolicited SOAP response from %s:%hu", inet_ntoa(Endpoint->Host), Endpoint->Port);
+		return -1;
+	}
+
+	// parse what is needed then drop the response from buffer
+	Value[0] = *End;
+	*End = '\0';
+	Doc = ixmlParseBuffer(Body);
+	*End = Value[0];
+
+	Endpoint->Len -= Next - Endpoint->Buf;
+	memmove(Endpoint->Buf, Next, Endpoint->Len + 1);
+
+	if (Status == 200 && Doc && (Result = _SOAPResult(Doc)) != NULL) {
+		ErrCode = UPNP_E_SUCCESS;
+	} else {
+		// a SOAP fault carries the UPnP error code
+		char *Error = Doc ? XMLGetFirstDocumentItem(Doc, "errorCode", true) : NULL;
+		ErrCode = Error ? atoi(Error) : UPNP_E_BAD_RESPONSE;
+		LOG_DEBUG("SOAP error %d (status %d) from %s:%hu", ErrCode, Status, inet_ntoa(Endpoint->Host), Endpoint->Port);
+		NFREE(Error);
+	}
+
+	if (Doc) ixmlDocument_free(Doc);
+	_SOAPDone(Endpoint, ErrCode, Result);
+
+	Endpoint->Reused = true;
+
+	if (!KeepAlive) {
+		if (!Endpoint->Fallback) LOG_INFO("no persistent connection with %s:%hu, using libupnp", inet_ntoa(Endpoint->Host), Endpoint->Port);
+		Endpoint->Fallback = true;
+		_SOAPClose(Endpoint);
+	}
+
+	return 1;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPReceive(tSOAPEndpoint *Endpoint)
+{
+	int n;
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	if (Endpoint->Size - Endpoint->Len < SOAP_PACKET) {
+		if (Endpoint->Size >= SOAP_MAX_PACKET) {
+			LOG_WARN("SOAP response too long (%zu) from %s:%hu", Endpoint->Len, inet_ntoa(Endpoint->Host), Endpoint->Port);
+			return false;
+		}
+		Endpoint->Size += SOAP_PACKET;
+		Endpoint->Buf = realloc(Endpoint->Buf, Endpoint->Size + 1);
+	}
+
+	n = recv(Endpoint->Sock, Endpoint->Buf + Endpoint->Len, Endpoint->Size - Endpoint->Len, 0);
+
+	if (n < 0) return last_error() == ERROR_WOULDBLOCK;
+
+	// closed by renderer, that might be the end of a response
+	if (n == 0) {
+		if (Endpoint->Len) _SOAPResponse(Endpoint, true);
+		return false;
+	}
+
+	Endpoint->Len += n;
+	Endpoint->Buf[Endpoint->Len] = '\0';
+	Endpoint->Last = gettime_ms();
+
+	return _SOAPResponse(Endpoint, false) >= 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static int _SOAPConnect(struct in_addr Host, uint16_t Port)
+{
+	struct sockaddr_in addr;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sock < 0) return -1;
+
+	set_nonblock(sock);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = Host;
+	addr.sin_port = htons(Port);
+
+	// connection is completed by SOAP thread once writable, don't wait for it here
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0 &&
+		last_error() != EINPROGRESS && last_error() != ERROR_WOULDBLOCK) {
+		closesocket(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/*----------------------------------------------------------------------------*/
+static bool _SOAPConnected(tSOAPEndpoint *Endpoint)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	getsockopt(Endpoint->Sock, SOL_SOCKET, SO_ERROR, (void*) &error, &len);
+	if (error) return false;
+
+	LOG_DEBUG("opened SOAP connection %s:%hu", inet_ntoa(Endpoint->Host), Endpoint->Port);
+	Endpoint->Connecting = false;
+	Endpoint->Last = gettime_ms();
+
+	return true;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SOAPComplete(void)
+{
+	/*
+	ASSUMING SOAP'S MUTEX LOCKED
+	*/
+
+	// callbacks lock devices, so they run without our mutex
+	while (glSOAP.Done) {
+		tSOAPRequest *Request = glSOAP.Done;
+		UpnpActionComplete *Event = UpnpActionComplete_new();
+
+		glSOAP.Done = Request->Next;
+		pthread_mutex_unlock(&glSOAP.Mutex);
+
+		UpnpActionComplete_set_ErrCode(Event, Request->ErrCode);
+		UpnpActionComplete_strcpy_CtrlUrl(Event, Request->URL);
+		UpnpActionComplete_set_ActionResult(Event, Request->Result);
+		Request->Callback(UPNP_CONTROL_ACTION_COMPLETE, Event, (void*) Request->Cookie);
+
+		UpnpActionComplete_delete(Event);
+		_SOAPFree(Request);
+
+		pthread_mutex_lock(&glSOAP.Mutex);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+static void *SOAPThread(void *args)
+{
+	pthread_mutex_lock(&glSOAP.Mutex);
+
+	while (glSOAP.Running) {
+		struct timeval Timeout = { 0, SOAP_POLL * 1000 };
+		uint32_t now = gettime_ms();
+		tSOAPEndpoint *Endpoint;
+		fd_set rfds, wfds;
+		int maxfd = -1;
+
+		FD_ZERO(&rfds);
+		FD_ZERO(&wfds);
+
+		for (Endpoint = glSOAP.Endpoints; Endpoint; Endpoint = Endpoint->Next) {
+			tSOAPRequest *Request = Endpoint->Queue;
+
+			// open connection on demand, only this thread changes socket
+			if (Endpoint->Sock == -1 && Request) {
+				if ((Endpoint->Sock = _SOAPConnect(Endpoint->Host, Endpoint->Port)) == -1) {
+					_SOAPUnreachable(Endpoint, UPNP_E_SOCKET_CONNECT);
+					continue;
+				}
+
+				Endpoint->Connecting = true;
+				Endpoint->Last = now;
+			}
+
+			if (Endpoint->Sock == -1) continue;
+
+			// other endpoints are not held while this one is connecting
+			if (Endpoint->Connecting) {
+				// slow is not gone (e.g. renderer in power-save), don't make it fatal
+				if (now - Endpoint->Last > SOAP_CONNECT_TIMEOUT) {
+					_SOAPUnreachable(Endpoint, UPNP_E_TIMEDOUT);
+					continue;
+				}
+
+				FD_SET(Endpoint->Sock, &wfds);
+				if (Endpoint->Sock > maxfd) maxfd = Endpoint->Sock;
+				continue;
+			}
+
+			if (Request && Request->Sent && (int) (now - Request->Deadline) > 0) {
+				LOG_WARN("SOAP request timeout with %s:%hu", inet_ntoa(Endpoint->Host), Endpoint->Port);
+				_SOAPDone(Endpoint, UPNP_E_TIMEDOUT, NULL);
+				_SOAPClose(Endpoint);
+				continue;
+			}
+
+			if (!Request && now - Endpoint->Last > SOAP_IDLE) {
+				_SOAPClose(Endpoint);
+				continue;
+			}
+
+			if (!_SOAPSend(Endpoint)) {
+				_SOAPBroken(Endpoint);
+				continue;
+			}
+
+			FD_SET(Endpoint->Sock, &rfds);
+			if (Endpoint->Queue && Endpoint->Queue->Sent < Endpoint->Queue->Len) FD_SET(Endpoint->Sock, &wfds);
+			if (Endpoint->Sock > maxfd) maxfd = Endpoint->Sock;
+		}
+
+		_SOAPComplete();
+		pthread_mutex_unlock(&glSOAP.Mutex);
+
+		if (maxfd >= 0) select(maxfd + 1, &rfds, &wfds, NULL, &Timeout);
+		else usleep(SOAP_POLL * 1000);
+
+		pthread_mutex_lock(&glSOAP.Mutex);
+
+		for (Endpoint = glSOAP.Endpoints; Endpoint; Endpoint = Endpoint->Next) {
+			if (Endpoint->Sock == -1 || Endpoint->Sock > maxfd) continue;
+
+			// requests are sent on next pass
+			if (Endpoint->Connecting) {
+				if (FD_ISSET(Endpoint->Sock, &wfds) && !_SOAPConnected(Endpoint)) _SOAPUnreachable(Endpoint, UPNP_E_SOCKET_CONNECT);
+				continue;
+			}
+
+			if (FD_ISSET(Endpoint->Sock, &rfds) && !_SOAPReceive(Endpoint)) _SOAPBroken(Endpoint);
+		}
+
+		_SOAPComplete();
+	}
+
+	pthread_mutex_unlock(&glSOAP.Mutex);
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+void SOAPInit(void)
+{
+	pthread_mutex_init(&glSOAP.Mutex, 0);
+	glSOAP.Running = true;
+	pthread_create(&glSOAP.Thread, NULL, &SOAPThread, NULL);
+}
+
+/*----------------------------------------------------------------------------*/
+void SOAPEnd(void)
+{
+	pthread_mutex_lock(&glSOAP.Mutex);
+	glSOAP.Running = false;
+	pthread_mutex_unlock(&glSOAP.Mutex);
+
+	pthread_join(glSOAP.Thread, NULL);
+
+	// devices are gone, so pending requests are dropped silently
+	while (glSOAP.Endpoints) {
+		tSOAPEndpoint *Endpoint = glSOAP.Endpoints;
+
+		glSOAP.Endpoints = Endpoint->Next;
+		while (Endpoint->Queue) _SOAPDone(Endpoint, UPNP_E_SOCKET_ERROR, NULL);
+		_SOAPClose(Endpoint);
+		NFREE(Endpoint->Buf);
+		free(Endpoint->URL);
+		free(Endpoint);
+	}
+
+	while (glSOAP.Done) {
+		tSOAPRequest *Request = glSOAP.Done;
+		glSOAP.Done = Request->Next;
+		_SOAPFree(Request);
+	}
+
+	pthread_mutex_destroy(&glSOAP.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+int SOAPSendActionAsync(UpnpClient_Handle Handle, const char *ActionURL, const char *ServiceType,
+						const char *DevUDN, IXML_Document *Action, Upnp_FunPtr Callback, const void *Cookie)
+{
+	const char *Name = XMLGetLocalName(Action, 1);
+	struct in_addr Host;
+	uint16_t Port;
+	const char *Path;
+
+	if (Name && _SOAPParseURL(ActionURL, &Host, &Port, &Path)) {
+		tSOAPEndpoint *Endpoint;
+		tSOAPRequest *Request = NULL;
+
+		pthread_mutex_lock(&glSOAP.Mutex);
+
+		Endpoint = glSOAP.Running ? _SOAPEndpoint(ActionURL, Host, Port) : NULL;
+
+		if (Endpoint && !Endpoint->Fallback && (Request = calloc(1, sizeof(tSOAPRequest))) != NULL) {
+			Request->Packet = _SOAPPacket(Host, Port, Path, ServiceType, Name, Action, &Request->Len);
+			if (Request->Packet) {
+				tSOAPRequest **p = &Endpoint->Queue;
+
+				Request->URL = strdup(ActionURL);
+				Request->Name = strdup(Name);
+				Request->Callback = Callback;
+				Request->Cookie = Cookie;
+
+				// a setter replaces the same one not sent yet (nobody waits for it)
+				while (*p && !(_SOAPSetter(Name) && !(*p)->Sent && !strcmp((*p)->URL, ActionURL) &&
+					   !strcasecmp((*p)->Name, Name))) p = &(*p)->Next;
+
+				if (*p) {
+					LOG_DEBUG("%s superseded for %s", Name, ActionURL);
+					Request->Next = (*p)->Next;
+					_SOAPFree(*p);
+				}
+
+				*p = Request;
+
+				// connection is idle, send now (thread handles what's left)
+				if (Endpoint->Queue == Request) _SOAPSend(Endpoint);
+			} else {
+				_SOAPFree(Request);
+				Request = NULL;
+			}
+		}
+
+		pthread_mutex_unlock(&glSOAP.Mutex);
+
+		if (Request) return UPNP_E_SUCCESS;
+	}
+
+	return UpnpSendActionAsync(Handle, ActionURL, ServiceType, DevUDN, Action, Callback, Cookie);
+}
@@ -8,6 +8,7 @@
  */
 
 #include <math.h>
+#include <time.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -16,6 +17,13 @@
 
 #if WIN
 #include <process.h>
+#define ATOMIC_CAS(p, o, n)	(InterlockedCompareExchangePointer((PVOID volatile*) (p), (n), (o)) == (o))
+#define ATOMIC_XCHG(p, n)	InterlockedExchangePointer((PVOID volatile*) (p), (n))
+#define ATOMIC_XCHG_INT(p, n)	InterlockedExchange((LONG volatile*) (p), (n))
+#else
+#define ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define ATOMIC_XCHG(p, n)	__sync_lock_test_and_set((p), (n))
+#define ATOMIC_XCHG_INT(p, n)	__sync_lock_test_and_set((p), (n))
 #endif
 
 #include "squeezedefs.h"
@@ -30,6 +38,7 @@
 #include "upnptools.h"
 #include "ixmlextra.h"
 #include "avt_util.h"
+#include "soap_util.h"
 #include "mr_util.h"
 #include "mimetypes.h"
 #include "config_upnp.h"
@@ -47,13 +56,23 @@
 
 #define DISCOVERY_TIME 		30
 #define PRESENCE_TIMEOUT	(DISCOVERY_TIME * 6)
+#define DESC_MAX_AGE		1800
+#define FETCH_WORKERS		4
+#define FETCH_PENDING		32
 
 #define TRACK_POLL  	(1000)
 #define STATE_POLL  	(500)
 #define INFOEX_POLL 	(60*1000)
 #define MIN_POLL 		(min(TRACK_POLL, STATE_POLL))
+#define TRACK_POLL_SPARSE	(5000)
+#define STATE_POLL_EVENT	(5000)
+#define TRACK_END_WINDOW	(10*1000)
+#define POLL_BOOST			(5000)
 #define MAX_ACTION_ERRORS (5)
 
+#define WHEEL_TICK		(50)
+#define WHEEL_SIZE		(256)
+
 #define SHORT_TRACK		(10*1000)
 
 #define MODEL_NAME_STRING	"UPnPBridge"
@@ -64,8 +83,11 @@ enum { NEXT_FORCE = -1, NEXT_GAPPED = 0, NEXT_GAPLESS = 1 };
 /* globals initialized */
 /*----------------------------------------------------------------------------*/
 int32_t				glLogLimit = -1;
+uint32_t			glMaxBandwidth = 0;				// kbps, 0 = unlimited
+uint32_t			glStreamReactors = 0;			// 0 = one stream thread per player
+uint32_t			glMaxRenderers = 32;			// size of renderers & players tables
 char				glBinding[128] = "?";
-struct sMR			glMRDevices[MAX_RENDERERS];
+struct sMR			*glMRDevices;
 pthread_mutex_t 	glMRMutex;
 UpnpClient_Handle 	glControlPointHandle;
 char				glCustomDiscovery[STR_LEN * 8];
@@ -87,6 +109,7 @@ tMRConfig			glMRConfig = {
 							PRESENCE_TIMEOUT, // Removal timeout
 							1,         		// VolumeOnPlay
 							true,			// VolumeFeedback
+							250,			// VolumeInterval
 							NEXT_GAPLESS,	// AcceptNextURI
 							true,			// SendMetaData
 							true,			// SendCoverArt
@@ -116,6 +139,7 @@ sq_dev_param_t glDeviceParam = {
 					"aac,ogg,ops,ogf,flc,alc,wav,aif,pcm,mp3",		// codecs
 					"thru",					// mode
 					30,						// next_delay
+					0,						// next_lead
 					"raw,wav,aif",			// raw_audio_format
 					"?",                    // server
 					96000,			        // sample_rate
@@ -129,6 +153,7 @@ sq_dev_param_t glDeviceParam = {
 					false,      			// roon_mode
 					"",						// store_prefix
 					"",						// coveart resolution
+					0,						// learned_buffer
 					// parameters not from read from config file
 #if !WIN
 					{
@@ -145,10 +170,27 @@ sq_dev_param_t glDeviceParam = {
 /* local typedefs															  */
 /*----------------------------------------------------------------------------*/
 typedef struct sUpdate {
-	enum { DISCOVERY, BYE_BYE, SEARCH_TIMEOUT } Type;
+	enum { DISCOVERY, BYE_BYE, SEARCH_TIMEOUT, REGISTER } Type;
 	char *Data;
+	int MaxAge;
+	IXML_Document *DescDoc;			// REGISTER only, with AVTransport capabilities
+	bool NextURI, InfoEx;
+	char *Sink, *ZoneState;			// REGISTER only, from SOAP (NULL = unknown)
 } tUpdate;
 
+typedef struct sMessage {
+	struct sMessage *Next;
+	enum { MSG_EVENT, MSG_ACTION } Type;
+	void *Cookie;
+	int ErrCode;
+	IXML_Document *Doc;				// changed variables or action result
+} tMessage;
+
+typedef struct sQueuedTrack {
+	char		*URI, *ExpectedURI, *ProtoInfo;
+	metadata_t	MetaData;
+} tQueuedTrack;
+
 /*----------------------------------------------------------------------------*/
 /* consts or pseudo-const*/
 /*----------------------------------------------------------------------------*/
@@ -180,16 +222,36 @@ static bool				glInteractive = true;
 static pthread_mutex_t 	glUpdateMutex;
 
 static pthread_cond_t  	glUpdateCond;
-static pthread_t 		glMainThread, glUpdateThread;
+static pthread_t 		glMainThread, glUpdateThread, glPollThread;
+static struct {
+	pthread_mutex_t	Mutex;
+	pthread_cond_t	Cond;					// scheduler sleeps on it
+	struct sMR		*Slots[WHEEL_SIZE];		// devices hashed by poll deadline
+	uint32_t		Wake;					// when scheduler wakes up
+	uint32_t		Tick;					// next tick to be swept
+	bool			Inbox;					// messages have been posted
+} glWheel;
 static cross_queue_t	glUpdateQueue;
+static struct {
+	pthread_mutex_t	Mutex;
+	pthread_cond_t	Cond;
+	pthread_t		Thread[FETCH_WORKERS];
+	struct {
+		char	*Location;						// queued or in-flight until registered
+		int		MaxAge;
+		bool	Busy;
+	} Pending[FETCH_PENDING];
+} glFetch;
 static char				*glLogFile;
 
 static char				*glPidFile = NULL;
 static bool				glAutoSaveConfigFile = false;
+static volatile int32_t	glConfigDirty = 0;		// saved later by MainThread (atomic)
 static bool				glGracefullShutdown = true;
 static bool				glDiscovery;
 static void				*glConfigID = NULL;
 static char				glConfigName[STR_LEN] = "./config.xml";
+static char				glCacheName[STR_LEN];
 static char				*glExcluded = "Squeezebox";
 static char				glModelName[STR_LEN] = MODEL_NAME_STRING;
 
@@ -204,7 +266,7 @@ static char usage[] =
 		   "  -I \t\t\tauto save config at every network scan\n"
 		   "  -f <logfile>\t\tWrite debug to logfile\n"
 		   "  -p <pid file>\t\twrite PID in file\n"
-		   "  -o [thru|pcm|flc[:<q>]|mp3[:<r>]][,r:[-]<rate>][,s:<8:16:24>][,flow]\tTranscode mode\n"
+		   "  -o [thru|pcm|flc[:<q>]|mp3[:<r>]][,r:[-]<rate>][,s:<8:16:24>][,flow][,adapt]\tTranscode mode\n"
 		   "  -d <log>=<level>\tSet logging level, logs: all|slimproto|slimmain|stream|decode|output|web|main|util|upnp, level: error|warn|info|debug|sdebug\n"
 		   "  -M <modelname>\tSet the squeezelite player model name sent to the server (default: " MODEL_NAME_STRING ")\n"
 #if LINUX || FREEBSD || SUNOS
@@ -279,17 +341,28 @@ static char license[] =
 /*----------------------------------------------------------------------------*/
 /* prototypes */
 /*----------------------------------------------------------------------------*/
-static void 	*MRThread(void *args);
+static void 	*PollThread(void *args);
 static 	void*	UpdateThread(void *args);
-static bool 	AddMRDevice(struct sMR *Device, char * UDN, IXML_Document *DescDoc,	const char *location);
+static bool 	AddMRDevice(struct sMR *Device, char * UDN, IXML_Document *DescDoc,	const char *location, bool NextURI, bool InfoEx, char *Sink, char *ZoneState);
 static bool		isExcluded(char *Model);
 static void 	NextTrack(struct sMR *Device);
 static void		DeltaOptions(char* ref, char* src);
+static void		PostMRMessage(struct sMR *Device, tMessage *Message);
+static void		FreeQueuedTrack(void *_Item);
 
 // functions with _ prefix means that the device mutex is expected to be locked
 static bool 	_ProcessQueue(struct sMR *Device);
 static void 	_SyncNotifState(char *State, struct sMR* Device);
 static void 	_ProcessVolume(char *Volume, struct sMR* Device);
+static void 	_NextQueuedTrack(struct sMR *Device);
+static void 	_FlushQueuedTracks(struct sMR *Device);
+static void		_ProcessInbox(struct sMR *Device);
+static void		_ProcessEvent(struct sMR *Device, IXML_Document *VarDoc);
+static void		_ProcessAction(struct sMR *Device, void *Cookie, IXML_Document *Result, int ErrCode);
+static void 	_SchedulePoll(struct sMR *Device, uint32_t Delay);
+static void 	_BoostPoll(struct sMR *Device);
+static void 	_AdvancePoll(struct sMR *Device, uint32_t Delay);
+static void 	_SendVolume(struct sMR *Device);
 
 
 /*----------------------------------------------------------------------------*/
@@ -314,7 +387,8 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 		LOG_DEBUG("[%p]: device set on/off %d", caller, Device->on);
 	}
 
-	if (!Device->on && action != SQ_SETNAME && action != SQ_SETSERVER && Device->sqState != SQ_PLAY) {
+	if (!Device->on && action != SQ_SETNAME && action != SQ_SETSERVER && action != SQ_SETBUFFER &&
+		Device->sqState != SQ_PLAY) {
 		LOG_DEBUG("[%p]: device off or not controlled by LMS", caller);
 		pthread_mutex_unlock(&Device->Mutex);
 		va_end(args);
@@ -327,15 +401,9 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 
 		case SQ_SET_TRACK: {
 			struct track_param *p = va_arg(args, struct track_param*);
-			char *ProtoInfo, *uri;
+			char *ProtoInfo, *uri, *ExpectedURI = NULL;
 			char format = mimetype_to_format(p->mimetype);
 
-			// when this is received the next track has been processed
-			NFREE(Device->NextURI);
-			NFREE(Device->ExpectedURI);
-			NFREE(Device->NextProtoInfo);
-			Device->ElapsedLast = Device->ElapsedOffset = 0;
-			metadata_free(&Device->NextMetaData);
 			if (!Device->Config.SendCoverArt) NFREE(p->metadata.artwork);
 
 			LOG_INFO("[%p]:\n\tartist:%s\n\talbum:%s\n\ttitle:%s\n\tgenre:%s\n\t"
@@ -352,11 +420,36 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 			if ((!p->metadata.duration || p->metadata.repeating != -1) && (*Device->Service[TOPOLOGY_IDX].ControlURL) &&
 				(format == 'm' || format == 'a')) {
 				(void) !asprintf(&uri, "x-rincon-mp3radio://%s", p->uri);
-				if (format == 'a') (void)! asprintf(&Device->ExpectedURI, "aac://%s", p->uri);
+				if (format == 'a') (void)! asprintf(&ExpectedURI, "aac://%s", p->uri);
 				LOG_INFO("[%p]: Sonos live stream", Device);
 			} else uri = strdup(p->uri);
 
-			if (!Device->ExpectedURI) Device->ExpectedURI = strdup(uri);
+			if (!ExpectedURI) ExpectedURI = strdup(uri);
+
+			// player has not yet moved to next track, so this one has to wait
+			if (p->offset > 1 && (Device->ExpectedURI || Device->NextURI || Device->TrackQueued)) {
+				tQueuedTrack *Track = malloc(sizeof(tQueuedTrack));
+
+				Track->URI = uri;
+				Track->ExpectedURI = ExpectedURI;
+				Track->ProtoInfo = ProtoInfo;
+				// this is a structure copy, pointers within remains valid
+				Track->MetaData = p->metadata;
+				queue_insert(&Device->TrackQueue, Track);
+				Device->TrackQueued++;
+
+				LOG_INFO("[%p]: queued URI (%d) %s", Device, Device->TrackQueued, uri);
+				break;
+			}
+
+			// when this is received the next track has been processed
+			NFREE(Device->NextURI);
+			NFREE(Device->ExpectedURI);
+			NFREE(Device->NextProtoInfo);
+			Device->ElapsedLast = Device->ElapsedOffset = 0;
+			metadata_free(&Device->NextMetaData);
+			_FlushQueuedTracks(Device);
+			Device->ExpectedURI = ExpectedURI;
 
 			 if (p->offset) {
 				if (Device->State == STOPPED) {
@@ -416,7 +509,7 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 			Device->sqState = SQ_PLAY;
 
 			// we need to wakeup that player from long sleep
-			crossthreads_wake();
+			_SchedulePoll(Device, 0);
 
 			// send volume to master + slaves
 			if (Device->Config.VolumeOnPlay == 1 && Device->Volume != -1) {
@@ -426,9 +519,12 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 				Device->VolumeStampTx = gettime_ms();
 
 				// update all devices (master & slaves) and set Master's volume if we don't have any
-				for (i = 0; i < MAX_RENDERERS; i++) {
+				for (i = 0; i < glMaxRenderers; i++) {
 					struct sMR *p = glMRDevices + i;
+					if (!p->Running || (p->Master != Device && p != Device)) continue;
+					if (p != Device) pthread_mutex_lock(&p->Mutex);
 					if (p->Running && (p->Master == Device || p == Device)) CtrlSetVolume(p, p->Volume != -1 ? p->Volume : Device->Volume, p->seqN++);
+					if (p != Device) pthread_mutex_unlock(&p->Mutex);
 				}
 			}
 
@@ -440,6 +536,7 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 			NFREE(Device->NextProtoInfo);
 			NFREE(Device->ExpectedURI);
 			metadata_free(&Device->NextMetaData);
+			_FlushQueuedTracks(Device);
 			Device->sqState = action;
 			Device->ShortTrack = false;
 			Device->ShortTrackWait = 0;
@@ -486,35 +583,44 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 			// update context, and set volume only if authorized
 			if (GroupVolume < 0) {
 				Device->Volume = (Volume * Device->Config.MaxVolume) / 100;
-				if (Device->VolumeStampTx == now) CtrlSetVolume(Device, Device->Volume, Device->seqN++);
+				if (Device->VolumeStampTx == now) _SendVolume(Device);
 			} else {
 				double Ratio = GroupVolume ? (double) Volume / GroupVolume : 0;
 
 				// for standalone master, GroupVolume equals Device->Volume
-				for (int i = 0; i < MAX_RENDERERS; i++) {
+				for (int i = 0; i < glMaxRenderers; i++) {
 					struct sMR *p = glMRDevices + i;
 					if (!p->Running || (p != Device && p->Master != Device)) continue;
 
-					// must set a volume for slave if we have not acquired it already
-					if (p->Volume && p->Volume != -1 && GroupVolume) p->Volume = min(p->Volume * Ratio, p->Config.MaxVolume);
-					else p->Volume = (Volume * p->Config.MaxVolume) / 100;
+					// slave's volume state is also used by scheduler (always master then slave)
+					if (p != Device) pthread_mutex_lock(&p->Mutex);
+
+					if (p->Running && (p == Device || p->Master == Device)) {
+						// must set a volume for slave if we have not acquired it already
+						if (p->Volume && p->Volume != -1 && GroupVolume) p->Volume = min(p->Volume * Ratio, p->Config.MaxVolume);
+						else p->Volume = (Volume * p->Config.MaxVolume) / 100;
+
+						if (Device->VolumeStampTx == now) _SendVolume(p);
+					}
 
-					if (Device->VolumeStampTx == now) CtrlSetVolume(p, p->Volume, p->seqN++);
+					if (p != Device) pthread_mutex_unlock(&p->Mutex);
 				}
 			}
 			break;
 		}
 		case SQ_SETNAME:
 			strcpy(Device->sq_config.name, va_arg(args, char*));
-			if (glAutoSaveConfigFile) {
-				pthread_mutex_lock(&glUpdateMutex);
-				SaveConfig(glConfigName, glConfigID, false);
-				pthread_mutex_unlock(&glUpdateMutex);
-			}
+			// can't take update mutex with device's locked, let MainThread save
+			if (glAutoSaveConfigFile) ATOMIC_XCHG_INT(&glConfigDirty, 1);
 			break;
 		case SQ_SETSERVER:
 			strcpy(Device->sq_config.set_server, inet_ntoa(*va_arg(args, struct in_addr*)));
 			break;
+		case SQ_SETBUFFER:
+			Device->sq_config.learned_buffer = va_arg(args, uint32_t);
+			LOG_INFO("[%p]: learned player buffer %u ms", Device, Device->sq_config.learned_buffer);
+			if (glAutoSaveConfigFile) ATOMIC_XCHG_INT(&glConfigDirty, 1);
+			break;
 		default:
 			break;
 	}
@@ -526,91 +632,314 @@ bool sq_callback(void *caller, sq_action_t action, ...)
 
 
 /*----------------------------------------------------------------------------*/
-static void *MRThread(void *args)
+static uint32_t _PollDevice(struct sMR *p)
 {
-	int elapsed, wakeTimer = MIN_POLL;
-	unsigned last;
-	struct sMR *p = (struct sMR*) args;
+	uint32_t now = gettime_ms(), wakeTimer, TrackInterval = TRACK_POLL, StateInterval = STATE_POLL;
+	int elapsed = now - p->PollLast;
 
-	last = gettime_ms();
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
 
-	for (; p->Running; crossthreads_sleep(wakeTimer)) {
-		elapsed = gettime_ms() - last;
-		pthread_mutex_lock(&p->Mutex);
+	p->PollLast = now;
 
-		if (p->ShortTrack) wakeTimer = MIN_POLL / 2;
-		else wakeTimer = (p->sqState != SQ_STOP && p->on) ? MIN_POLL : MIN_POLL * 10;
+	/*
+	Poll densely only when something is expected to happen: short track, just
+	after a transport change or near the end of the track (projected from last
+	position). Otherwise position is polled sparsely and, when the renderer's
+	events are reliable, transport state as well
+	*/
+	if (!p->ShortTrack && p->State == PLAYING && (int) (p->PollBoost - now) <= 0 &&
+		p->Duration >= 0 && p->RelStamp && (!p->Duration ||
+		(int) (p->Duration - p->RelTime - (now - p->RelStamp)) > TRACK_END_WINDOW)) {
+		TrackInterval = TRACK_POLL_SPARSE;
+		if (p->EventTrusted) StateInterval = STATE_POLL_EVENT;
+	}
 
-		LOG_SDEBUG("[%p]: UPnP thread timer %d %d", p, elapsed, wakeTimer);
+	if (p->ShortTrack) wakeTimer = MIN_POLL / 2;
+	else if (p->sqState != SQ_STOP && p->on) wakeTimer = min(TrackInterval, StateInterval);
+	else wakeTimer = MIN_POLL * 10;
 
-		p->StatePoll += elapsed;
-		p->TrackPoll += elapsed;
+	// rate-limited volume, send latest value once allowed
+	if (p->VolumePending) {
+		int Wait = p->VolumeSent + p->Config.VolumeInterval - now;
+		if (Wait <= 0) _SendVolume(p);
+		else wakeTimer = min(wakeTimer, (uint32_t) Wait);
+	}
 
-		if (p->InfoExPoll != -1) p->InfoExPoll += elapsed;
+	LOG_SDEBUG("[%p]: UPnP poll timer %d %d", p, elapsed, wakeTimer);
 
-		// do nothing if we are a slave
-		if (p->Master) goto sleep;
+	p->StatePoll += elapsed;
+	p->TrackPoll += elapsed;
 
-		// was just waiting for a short track to end
-		if (p->ShortTrackWait > 0 && ((p->ShortTrackWait -= elapsed) < 0)) {
-			LOG_WARN("[%p]: stopping on short track timeout", p);
-			p->ShortTrack = false;
-			sq_notify(p->SqueezeHandle, SQ_STOP, p->ShortTrack);
-		}
+	if (p->InfoExPoll != -1) p->InfoExPoll += elapsed;
 
-		// hack to deal with players that do not report end of track
-		if (p->Duration < 0 && ((p->Duration += elapsed) >= 0)) {
-			if (p->NextProtoInfo) {
-				LOG_INFO("[%p] overtime next track", p);
-				NextTrack(p);
-			} else {
-				LOG_INFO("[%p] overtime last track", p);
-				p->Duration= 0;
-				AVTBasic(p, "Stop");
-			}
-		}
+	// do nothing if we are a slave
+	if (p->Master) return wakeTimer;
 
-		/*
-		should not request any status update if we are stopped, off or waiting
-		for an action to be performed
-		*/
-		// exception is to poll extended informations if any for battery
-		if (p->on && !p->WaitCookie && p->InfoExPoll >= INFOEX_POLL) {
-			p->InfoExPoll = 0;
-			AVTCallAction(p, "GetInfoEx", p->seqN++);
+	// was just waiting for a short track to end
+	if (p->ShortTrackWait > 0 && ((p->ShortTrackWait -= elapsed) < 0)) {
+		LOG_WARN("[%p]: stopping on short track timeout", p);
+		p->ShortTrack = false;
+		sq_notify(p->SqueezeHandle, SQ_STOP, p->ShortTrack);
+	}
+
+	// hack to deal with players that do not report end of track
+	if (p->Duration < 0 && ((p->Duration += elapsed) >= 0)) {
+		if (p->NextProtoInfo) {
+			LOG_INFO("[%p] overtime next track", p);
+			NextTrack(p);
+		} else {
+			LOG_INFO("[%p] overtime last track", p);
+			p->Duration= 0;
+			AVTBasic(p, "Stop");
 		}
+	}
 
-		if (!p->on || (p->sqState == SQ_STOP && p->State == STOPPED) ||
-			 p->ErrorCount < 0 || p->ErrorCount > MAX_ACTION_ERRORS || p->WaitCookie) goto sleep;
+	/*
+	should not request any status update if we are stopped, off or waiting
+	for an action to be performed
+	*/
+	// exception is to poll extended informations if any for battery
+	if (p->on && (!p->WaitCookie || p->WaitSafe) && p->InfoExPoll >= INFOEX_POLL) {
+		p->InfoExPoll = 0;
+		AVTCallAction(p, "GetInfoEx", p->seqN++);
+	}
 
-		// get track position & CurrentURI
-		if (p->TrackPoll >= TRACK_POLL) {
-			p->TrackPoll = 0;
-			if (p->sqState != SQ_STOP && p->sqState != SQ_PAUSE) {
-				AVTCallAction(p, "GetPositionInfo", p->seqN++);
-			}
-		}
+	if (!p->on || (p->sqState == SQ_STOP && p->State == STOPPED) ||
+		 p->ErrorCount < 0 || p->ErrorCount > MAX_ACTION_ERRORS || (p->WaitCookie && !p->WaitSafe)) return wakeTimer;
 
-		// do polling as event is broken in many uPNP devices
-		if (p->StatePoll >= STATE_POLL) {
-			p->StatePoll = 0;
-			AVTCallAction(p, "GetTransportInfo", p->seqN++);
+	// get track position & CurrentURI
+	if (p->TrackPoll >= TrackInterval) {
+		p->TrackPoll = 0;
+		if (p->sqState != SQ_STOP && p->sqState != SQ_PAUSE) {
+			AVTCallAction(p, "GetPositionInfo", p->seqN++);
 		}
-sleep:
-		pthread_mutex_unlock(&p->Mutex);
-		last = gettime_ms();
 	}
 
+	// do polling as event is broken in many uPNP devices
+	if (p->StatePoll >= StateInterval) {
+		p->StatePoll = 0;
+		AVTCallAction(p, "GetTransportInfo", p->seqN++);
+	}
+
+	return wakeTimer;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _WheelRemove(struct sMR *Device)
+{
+	struct sMR **p;
+
+	/*
+	ASSUMING WHEEL'S MUTEX LOCKED
+	*/
+
+	if (Device->PollSlot == -1) return;
+
+	for (p = &glWheel.Slots[Device->PollSlot]; *p != Device; p = &(*p)->PollNext);
+	*p = Device->PollNext;
+	Device->PollSlot = -1;
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SchedulePoll(struct sMR *Device, uint32_t Delay)
+{
+	uint32_t Tick;
+
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED (lock order is device then wheel)
+	*/
+
+	pthread_mutex_lock(&glWheel.Mutex);
+
+	_WheelRemove(Device);
+	Device->PollDue = gettime_ms() + Delay;
+	Tick = Device->PollDue / WHEEL_TICK;
+
+	// never behind the sweep cursor or it would wait for a full rotation
+	if ((int) (Tick - glWheel.Tick) < 0) Tick = glWheel.Tick;
+	Device->PollSlot = Tick % WHEEL_SIZE;
+	Device->PollNext = glWheel.Slots[Device->PollSlot];
+	glWheel.Slots[Device->PollSlot] = Device;
+
+	// scheduler sleeps beyond that deadline
+	if ((int) (Device->PollDue - glWheel.Wake) < 0) pthread_cond_signal(&glWheel.Cond);
+
+	pthread_mutex_unlock(&glWheel.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _AdvancePoll(struct sMR *Device, uint32_t Delay)
+{
+	bool Later;
+
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
+
+	// only reschedule if not already due sooner
+	pthread_mutex_lock(&glWheel.Mutex);
+	Later = Device->PollSlot == -1 || (int) (Device->PollDue - (gettime_ms() + Delay)) > 0;
+	pthread_mutex_unlock(&glWheel.Mutex);
+
+	if (Later) _SchedulePoll(Device, Delay);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _SendVolume(struct sMR *Device)
+{
+	uint32_t now = gettime_ms();
+	int Wait = Device->VolumeSent + Device->Config.VolumeInterval - now;
+
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
+
+	/*
+	Volume slider sends many steps, so commands are rate-limited per renderer
+	and the scheduler sends the latest value when allowed. All members of a
+	group are due at the same time and actions are asynchronous, so they are
+	updated together.
+	*/
+	if (Wait > 0) {
+		Device->VolumePending = true;
+		_AdvancePoll(Device, Wait);
+		return;
+	}
+
+	Device->VolumePending = false;
+	// own stamp, master's might not be locked
+	Device->VolumeSent = Device->VolumeStampTx = now;
+	CtrlSetVolume(Device, Device->Volume, Device->seqN++);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _BoostPoll(struct sMR *Device)
+{
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
+
+	Device->PollBoost = gettime_ms() + POLL_BOOST;
+	_SchedulePoll(Device, 0);
+}
+
+/*----------------------------------------------------------------------------*/
+void ReleaseMRDevice(struct sMR *p)
+{
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED and device not running anymore
+	*/
+
+	pthread_mutex_lock(&glWheel.Mutex);
+	_WheelRemove(p);
+	pthread_mutex_unlock(&glWheel.Mutex);
 
+	// not running anymore, so this just discards messages
+	_ProcessInbox(p);
 	AVTActionFlush(&p->ActionQueue);
+	_FlushQueuedTracks(p);
 	metadata_free(&p->NextMetaData);
 	NFREE(p->NextProtoInfo);
 	NFREE(p->NextURI);
 	NFREE(p->ExpectedURI);
 	NFREE(p->Sink);
-	return NULL;
+	NFREE(p->Description);
 }
 
+/*----------------------------------------------------------------------------*/
+/*
+ One thread polls all renderers. Each device is hashed in a timer wheel by its
+ next poll deadline; the scheduler walks the ticks that have elapsed, polls
+ devices that are due (AVT actions are asynchronous) and sleeps until the
+ earliest deadline left, so the cost follows the actual polling work.
+ It also owns messages that libupnp callbacks post to devices' inboxes, so that
+ these callbacks never wait for a device's mutex.
+*/
+static void *PollThread(void *args)
+{
+	struct sMR **Due = malloc(glMaxRenderers * sizeof(struct sMR*));
+
+	while (glMainRunning) {
+		struct sMR *Device;
+		uint32_t now = gettime_ms(), Sleep = WHEEL_TICK * WHEEL_SIZE;
+		int i, n = 0;
+
+		pthread_mutex_lock(&glWheel.Mutex);
+
+		/*
+		 collect due devices, including in ticks that were skipped. The cursor
+		 stops on the current tick as it can still hold deadlines to come
+		*/
+		while (1) {
+			struct sMR **p = &glWheel.Slots[glWheel.Tick % WHEEL_SIZE];
+
+			while ((Device = *p) != NULL) {
+				if ((int) (Device->PollDue - now) <= 0 && n < glMaxRenderers) {
+					*p = Device->PollNext;
+					Device->PollSlot = -1;
+					Due[n++] = Device;
+				} else p = &Device->PollNext;
+			}
+
+			if ((int) (glWheel.Tick - now / WHEEL_TICK) >= 0) break;
+			glWheel.Tick++;
+		}
+
+		glWheel.Inbox = false;
+		pthread_mutex_unlock(&glWheel.Mutex);
+
+		// process inboxes first, responses can change what polling will do
+		for (i = 0; i < glMaxRenderers; i++) {
+			Device = glMRDevices + i;
+			if (!Device->Inbox) continue;
+			pthread_mutex_lock(&Device->Mutex);
+			_ProcessInbox(Device);
+			pthread_mutex_unlock(&Device->Mutex);
+		}
+
+		for (i = 0; i < n; i++) {
+			Device = Due[i];
+			pthread_mutex_lock(&Device->Mutex);
+			// someone might have asked for an earlier poll meanwhile
+			if (Device->Running) _AdvancePoll(Device, _PollDevice(Device));
+			pthread_mutex_unlock(&Device->Mutex);
+		}
+
+		pthread_mutex_lock(&glWheel.Mutex);
+
+		// earliest deadline, no need to look past the slot where it was found
+		now = gettime_ms();
+		for (i = 0; i < WHEEL_SIZE && Sleep > (uint32_t) i * WHEEL_TICK; i++) {
+			for (Device = glWheel.Slots[(glWheel.Tick + i) % WHEEL_SIZE]; Device; Device = Device->PollNext) {
+				int Delay = Device->PollDue - now;
+				if (Delay < (int) Sleep) Sleep = Delay > 0 ? Delay : 0;
+			}
+		}
+
+		glWheel.Wake = now + Sleep;
+
+		// posters signal under the mutex, so nothing can slip in before the wait
+		if (Sleep && !glWheel.Inbox && glMainRunning) {
+			struct timespec ts;
+
+			timespec_get(&ts, TIME_UTC);
+			ts.tv_sec += Sleep / 1000;
+			ts.tv_nsec += (Sleep % 1000) * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&glWheel.Cond, &glWheel.Mutex, &ts);
+		}
+
+		pthread_mutex_unlock(&glWheel.Mutex);
+	}
+
+	free(Due);
+	return NULL;
+}
 
 /*----------------------------------------------------------------------------*/
 static void _SyncNotifState(char *State, struct sMR* Device)
@@ -704,11 +1033,12 @@ static bool _ProcessQueue(struct sMR *Device)
 	if ((Action = queue_extract(&Device->ActionQueue)) == NULL) return false;
 
 	Device->WaitCookie = Device->seqN++;
-	rc = UpnpSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
+	Device->WaitSafe = Action->Safe;
+	rc = SOAPSendActionAsync(glControlPointHandle, Service->ControlURL, Service->Type,
 							 NULL, Action->ActionNode, ActionHandler, Device->WaitCookie);
 
 	if (rc != UPNP_E_SUCCESS) {
-		LOG_ERROR("Error in queued UpnpSendActionAsync -- %d", rc);
+		LOG_ERROR("Error in queued SOAPSendActionAsync -- %d", rc);
 	}
 
 	ixmlDocument_free(Action->ActionNode);
@@ -728,7 +1058,7 @@ static void _ProcessVolume(char *Volume, struct sMR* Device)
 	ASSUMING DEVICE'S MUTEX LOCKED
 	*/
 
-	if (UPnPVolume != (int) Device->Volume && now > Master->VolumeStampTx + 1000) {
+	if (UPnPVolume != (int) Device->Volume && now > Master->VolumeStampTx + 1000 && now > Device->VolumeStampTx + 1000) {
 		Device->Volume = UPnPVolume;
 		Master->VolumeStampRx = now;
 		GroupVolume = CalcGroupVolume(Master);
@@ -740,6 +1070,50 @@ static void _ProcessVolume(char *Volume, struct sMR* Device)
 	}
 }
 
+/*----------------------------------------------------------------------------*/
+static void _NextQueuedTrack(struct sMR *Device) {
+	tQueuedTrack *Track = queue_extract(&Device->TrackQueue);
+
+	if (!Track) return;
+	Device->TrackQueued--;
+
+	NFREE(Device->ExpectedURI);
+	Device->ExpectedURI = Track->ExpectedURI;
+
+	if (Device->Config.AcceptNextURI != NEXT_GAPLESS || Device->ShortTrack ||
+		(Track->MetaData.duration && Track->MetaData.duration < SHORT_TRACK)) {
+		LOG_INFO("[%p]: next URI gapped from queue %s", Device, Track->URI);
+		Device->NextURI = Track->URI;
+		Device->NextProtoInfo = Track->ProtoInfo;
+		Device->NextMetaData = Track->MetaData;
+	} else {
+		LOG_INFO("[%p]: next URI gapless from queue %s", Device, Track->URI);
+		AVTSetNextURI(Device, Track->URI, &Track->MetaData, Track->ProtoInfo);
+		free(Track->URI);
+		free(Track->ProtoInfo);
+		metadata_free(&Track->MetaData);
+	}
+
+	free(Track);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _FlushQueuedTracks(struct sMR *Device) {
+	queue_flush(&Device->TrackQueue);
+	Device->TrackQueued = 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static void FreeQueuedTrack(void *_Item) {
+	tQueuedTrack *Item = (tQueuedTrack*) _Item;
+
+	NFREE(Item->URI);
+	NFREE(Item->ExpectedURI);
+	NFREE(Item->ProtoInfo);
+	metadata_free(&Item->MetaData);
+	free(Item);
+}
+
 /*----------------------------------------------------------------------------*/
 static void NextTrack(struct sMR *Device) {
 	if (Device->NextMetaData.duration && Device->NextMetaData.duration < SHORT_TRACK) Device->ShortTrack = true;
@@ -776,17 +1150,30 @@ static void ProcessEvent(Upnp_EventType EventType, const void* _Event, void* Coo
 	UpnpEvent* Event = (UpnpEvent*)_Event;
 	struct sMR* Device = SID2Device(UpnpEvent_get_SID(Event));
 	IXML_Document* VarDoc = UpnpEvent_get_ChangedVariables(Event);
+	tMessage *Message;
+
+	if (!Device || !VarDoc) return;
+
+	// variables belong to libupnp, owner will process a copy
+	Message = calloc(1, sizeof(tMessage));
+	Message->Type = MSG_EVENT;
+	Message->Doc = (IXML_Document*) ixmlNode_cloneNode((IXML_Node*) VarDoc, true);
+	PostMRMessage(Device, Message);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _ProcessEvent(struct sMR *Device, IXML_Document *VarDoc) {
 	char* r = NULL;
 	char* LastChange = NULL;
 
-	// this is async, so need to check context's validity
-	if (!CheckAndLock(Device)) return;
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
 
 	LastChange = XMLGetFirstDocumentItem(VarDoc, "LastChange", true);
 
 	if (((!Device->on || !Device->SqueezeHandle) && !Device->Master) || !LastChange) {
-		LOG_SDEBUG("device off, no squeezebox device (yet) or not change for %s", UpnpString_get_String(UpnpEvent_get_SID(Event)));
-		pthread_mutex_unlock(&Device->Mutex);
+		LOG_SDEBUG("[%p]: device off, no squeezebox device (yet) or no change", Device);
 		NFREE(LastChange);
 		return;
 	}
@@ -798,154 +1185,246 @@ static void ProcessEvent(Upnp_EventType EventType, const void* _Event, void* Coo
 		NFREE(r);
 	}
 
-	pthread_mutex_unlock(&Device->Mutex);
+	/*
+	Transport state from events, when not waiting for an action that changes
+	it (state is re-acquired by polling then). Once this works, state polling can
+	be relaxed, until a poll reveals a change that events have missed
+	*/
+	if (!Device->Master && (!Device->WaitCookie || Device->WaitSafe)) {
+		r = XMLGetChangeItem(VarDoc, "TransportState", NULL, NULL, "val");
+		if (r) {
+			enum eMRstate State = Device->State;
+
+			if (!Device->EventTrusted) LOG_INFO("[%p]: transport state events received", Device);
+			Device->EventTrusted = true;
+			_SyncNotifState(r, Device);
+			if (Device->State != State) _BoostPoll(Device);
+		}
+		NFREE(r);
+	}
+
 	NFREE(LastChange);
 }
 
 /*----------------------------------------------------------------------------*/
-int ActionHandler(Upnp_EventType EventType, const void* Event, void* Cookie) {
-	struct sMR* p = NULL;
-	static int recurse = 0;
+static void _ProcessAction(struct sMR *p, void *Cookie, IXML_Document *Result, int ErrCode)
+{
+	char* r;
+	const char* Resp = NULL;
 
-	LOG_SDEBUG("action: %i [%s] [%p] [%u]", EventType, uPNPEvent2String(EventType), Cookie, recurse);
-	recurse++;
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
 
-	switch (EventType) {
-		case UPNP_CONTROL_ACTION_COMPLETE: {
-			char* r;
-			const char* Resp = NULL;
+	LOG_SDEBUG("[%p]: action complete (cookie %p)", p, Cookie);
 
-			p = CURL2Device(UpnpActionComplete_get_CtrlUrl(Event));
-			if (!CheckAndLock(p)) return 0;
+	/*
+	If waited action has been completed, proceed to next one if any. When
+	it does not change transport state, other responses are processed
+	*/
+	if (p->WaitCookie && (Cookie == p->WaitCookie || !p->WaitSafe)) {
+		Resp = XMLGetLocalName(Result, 1);
 
-			LOG_SDEBUG("[%p]: ac %i %s (cookie %p)", p, EventType, UpnpString_get_String(UpnpActionComplete_get_CtrlUrl(Event)));
+		LOG_DEBUG("[%p]: Waited action %s", p, Resp ? Resp : "<none>");
 
-			// If waited action has been completed, proceed to next one if any
-			if (p->WaitCookie) {
-				Resp = XMLGetLocalName(UpnpActionComplete_get_ActionResult(Event), 1);
+		// discard everything else except waiting action
+		if (Cookie != p->WaitCookie) return;
 
-				LOG_DEBUG("[%p]: Waited action %s", p, Resp ? Resp : "<none>");
+		p->StartCookie = p->WaitCookie;
+		_ProcessQueue(p);
 
-				// discard everything else except waiting action
-				if (Cookie != p->WaitCookie) break;
+		// something is likely to change, poll densely for a while
+		_BoostPoll(p);
 
-				p->StartCookie = p->WaitCookie;
-				_ProcessQueue(p);
+		/*
+		when certain waited action has been completed, the state need
+		to be re-acquired because a 'stop' state might be missed when
+		(eg) repositionning where two consecutive status update will
+		give 'playing', the 'stop' in the middle being unseen
+		*/
+		if (Resp && ((!strcasecmp(Resp, "StopResponse") && p->State == STOPPED) ||
+			(!strcasecmp(Resp, "PlayResponse") && p->State == PLAYING) ||
+			(!strcasecmp(Resp, "PauseResponse") && p->State == PAUSED))) {
+			p->State = UNKNOWN;
+		}
 
-				/*
-				when certain waited action has been completed, the state need
-				to be re-acquired because a 'stop' state might be missed when
-				(eg) repositionning where two consecutive status update will
-				give 'playing', the 'stop' in the middle being unseen
-				*/
-				if (Resp && ((!strcasecmp(Resp, "StopResponse") && p->State == STOPPED) ||
-					(!strcasecmp(Resp, "PlayResponse") && p->State == PLAYING) ||
-					(!strcasecmp(Resp, "PauseResponse") && p->State == PAUSED))) {
-					p->State = UNKNOWN;
-				}
+		return;
+	}
 
-				break;
+	// don't proceed anything that is too old
+	if (Cookie < p->StartCookie) return;
+
+	// extended informations, don't do anything else
+	if (Resp && !strcasecmp(Resp, "GetInfoExResponse")) {
+		// Battery information for devices that have one
+		if (*loglevel == lDEBUG) {
+			char *s = ixmlDocumenttoString(Result);
+			LOG_DEBUG("[%p]: extended info %s", p, s);
+			NFREE(s);
+		}
+		r = XMLGetFirstDocumentItem(Result, "BatteryFlag", true);
+		if (r) {
+			uint32_t Level = atoi(r) << 8;
+			NFREE(r);
+			r = XMLGetFirstDocumentItem(Result, "BatteryPercent", true);
+			if (r) {
+				Level |= (uint8_t) atoi(r);
+				sq_notify(p->SqueezeHandle, SQ_BATTERY, Level);
 			}
+		}
+		NFREE(r);
+		return;
+	}
 
-			// don't proceed anything that is too old
-			if (Cookie < p->StartCookie) break;
+	// transport state response
+	r = XMLGetFirstDocumentItem(Result, "CurrentTransportState", true);
+	if (r) {
+		enum eMRstate State = p->State;
 
-			IXML_Document* Result = UpnpActionComplete_get_ActionResult(Event);
+		_SyncNotifState(r, p);
 
-			// extended informations, don't do anything else
-			if (Resp && !strcasecmp(Resp, "GetInfoExResponse")) {
-				// Battery information for devices that have one
-				if (*loglevel == lDEBUG) {
-					char *s = ixmlDocumenttoString(Result);
-					LOG_DEBUG("[%p]: extended info %s", p, s);
-					NFREE(s);
-				}
-				r = XMLGetFirstDocumentItem(Result, "BatteryFlag", true);
-				if (r) {
-					uint32_t Level = atoi(r) << 8;
-					NFREE(r);
-					r = XMLGetFirstDocumentItem(Result, "BatteryPercent", true);
-					if (r) {
-						Level |= (uint8_t) atoi(r);
-						sq_notify(p->SqueezeHandle, SQ_BATTERY, Level);
-					}
-				}
-				NFREE(r);
-				break;
+		// events have missed that change, don't rely on them anymore
+		if (p->EventTrusted && State != UNKNOWN && p->State != State) {
+			LOG_INFO("[%p]: transport state event missed, polling", p);
+			p->EventTrusted = false;
+		}
+	}
+	NFREE(r);
+
+	if (p->State == PLAYING) {
+		// When not playing, position is not reliable
+		r = XMLGetFirstDocumentItem(Result, "RelTime", true);
+		if (r) {
+			uint32_t Elapsed = ConvertTime(r) * 1000;
+			p->RelTime = Elapsed;
+			p->RelStamp = gettime_ms();
+			if (p->Config.AcceptNextURI == NEXT_FORCE && p->Duration > 0 && p->Duration - Elapsed <= 2000) p->Duration = Elapsed - p->Duration;
+			if (!p->Duration) {
+				if (p->ElapsedLast > Elapsed) p->ElapsedOffset += p->ElapsedLast;
+				p->ElapsedLast = Elapsed;
+				Elapsed += p->ElapsedOffset;
 			}
+			sq_notify(p->SqueezeHandle, SQ_TIME, Elapsed);
+			LOG_DEBUG("[%p]: position %d (cookie %p)", p, Elapsed, Cookie);
+		}
 
-			// transport state response
-			r = XMLGetFirstDocumentItem(Result, "CurrentTransportState", true);
-			if (r) _SyncNotifState(r, p);
-			NFREE(r);
-
-			if (p->State == PLAYING) {
-				// When not playing, position is not reliable
-				r = XMLGetFirstDocumentItem(Result, "RelTime", true);
-				if (r) {
-					uint32_t Elapsed = ConvertTime(r) * 1000;
-					if (p->Config.AcceptNextURI == NEXT_FORCE && p->Duration > 0 && p->Duration - Elapsed <= 2000) p->Duration = Elapsed - p->Duration;
-					if (!p->Duration) {
-						if (p->ElapsedLast > Elapsed) p->ElapsedOffset += p->ElapsedLast;
-						p->ElapsedLast = Elapsed;
-						Elapsed += p->ElapsedOffset;
-					}
-					sq_notify(p->SqueezeHandle, SQ_TIME, Elapsed);
-					LOG_DEBUG("[%p]: position %d (cookie %p)", p, Elapsed, Cookie);
-				}
+		NFREE(r);
 
+		// URI detection response
+		r = XMLGetFirstDocumentItem(Result, "TrackURI", true);
+		if (r) {
+			if (*r == '\0' || !strstr(r, BRIDGE_URL)) {
 				NFREE(r);
+				char* s = XMLGetFirstDocumentItem(Result, "TrackMetaData", true);
+				IXML_Document* doc = ixmlParseBuffer(s);
+				NFREE(s);
 
-				// URI detection response
-				r = XMLGetFirstDocumentItem(Result, "TrackURI", true);
-				if (r) {
-					if (*r == '\0' || !strstr(r, BRIDGE_URL)) {
-						NFREE(r);
-						char* s = XMLGetFirstDocumentItem(Result, "TrackMetaData", true);
-						IXML_Document* doc = ixmlParseBuffer(s);
-						NFREE(s);
-
-						IXML_Node* node = (IXML_Node*)ixmlDocument_getElementById(doc, "res");
-						if (node) node = (IXML_Node*)ixmlNode_getFirstChild(node);
-						if (node) r = strdup(ixmlNode_getNodeValue(node));
-
-						LOG_DEBUG("[%p]: no Current URI, use MetaData %s", p, r);
-						if (doc) ixmlDocument_free(doc);
-					}
+				IXML_Node* node = (IXML_Node*)ixmlDocument_getElementById(doc, "res");
+				if (node) node = (IXML_Node*)ixmlNode_getFirstChild(node);
+				if (node) r = strdup(ixmlNode_getNodeValue(node));
 
-					if (p->ExpectedURI && !strcasecmp(r, p->ExpectedURI)) NFREE(p->ExpectedURI);
-					if (r) sq_notify(p->SqueezeHandle, SQ_TRACK_INFO, r);
-				}
+				LOG_DEBUG("[%p]: no Current URI, use MetaData %s", p, r);
+				if (doc) ixmlDocument_free(doc);
+			}
 
-				NFREE(r);
+			if (p->ExpectedURI && !strcasecmp(r, p->ExpectedURI)) {
+				NFREE(p->ExpectedURI);
+				// player moved to next track, now it can have the one after
+				if (p->TrackQueued && !p->NextURI) _NextQueuedTrack(p);
 			}
+			if (r) sq_notify(p->SqueezeHandle, SQ_TRACK_INFO, r);
+		}
 
-			LOG_SDEBUG("Action complete : %i (cookie %p)", EventType, Cookie);
+		NFREE(r);
+	}
 
-			if (UpnpActionComplete_get_ErrCode(Event) != UPNP_E_SUCCESS) {
-				if (UpnpActionComplete_get_ErrCode(Event) == UPNP_E_SOCKET_CONNECT) p->ErrorCount = -1;
-				else if (p->ErrorCount >= 0) p->ErrorCount++;
-				LOG_ERROR("[%p]: Error %d in action callback (count:%d cookie:%p)", p, UpnpActionComplete_get_ErrCode(Event), p->ErrorCount, Cookie);
-			}
-			else {
-				p->ErrorCount = 0;
-			}
+	LOG_SDEBUG("Action complete (cookie %p)", Cookie);
 
+	if (ErrCode != UPNP_E_SUCCESS) {
+		if (ErrCode == UPNP_E_SOCKET_CONNECT) p->ErrorCount = -1;
+		else if (p->ErrorCount >= 0) p->ErrorCount++;
+		LOG_ERROR("[%p]: Error %d in action callback (count:%d cookie:%p)", p, ErrCode, p->ErrorCount, Cookie);
+	}
+	else {
+		p->ErrorCount = 0;
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+int ActionHandler(Upnp_EventType EventType, const void* Event, void* Cookie) {
+	static int recurse = 0;
+
+	LOG_SDEBUG("action: %i [%s] [%p] [%u]", EventType, uPNPEvent2String(EventType), Cookie, recurse);
+	recurse++;
+
+	switch (EventType) {
+		case UPNP_CONTROL_ACTION_COMPLETE: {
+			struct sMR *p = CURL2Device(UpnpActionComplete_get_CtrlUrl(Event));
+			IXML_Document *Result = UpnpActionComplete_get_ActionResult(Event);
+			tMessage *Message;
+
+			if (!p) break;
+
+			// result belongs to libupnp, owner will process a copy
+			Message = calloc(1, sizeof(tMessage));
+			Message->Type = MSG_ACTION;
+			Message->Cookie = Cookie;
+			Message->ErrCode = UpnpActionComplete_get_ErrCode(Event);
+			if (Result) Message->Doc = (IXML_Document*) ixmlNode_cloneNode((IXML_Node*) Result, true);
+			PostMRMessage(p, Message);
 			break;
 		}
 		default:
 			break;
 	}
 
-	if (p) {
-		pthread_mutex_unlock(&p->Mutex);
-	}
-
 	recurse--;
 
 	return 0;
 }
 
+/*----------------------------------------------------------------------------*/
+static void PostMRMessage(struct sMR *Device, tMessage *Message)
+{
+	// no lock, inbox is a stack that only the scheduler empties
+	do Message->Next = Device->Inbox;
+	while (!ATOMIC_CAS(&Device->Inbox, Message->Next, Message));
+
+	pthread_mutex_lock(&glWheel.Mutex);
+	glWheel.Inbox = true;
+	pthread_cond_signal(&glWheel.Cond);
+	pthread_mutex_unlock(&glWheel.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void _ProcessInbox(struct sMR *Device)
+{
+	tMessage *Message = ATOMIC_XCHG(&Device->Inbox, NULL), *Next, *Ordered = NULL;
+
+	/*
+	ASSUMING DEVICE'S MUTEX LOCKED
+	*/
+
+	// restore arrival order
+	for (; Message; Message = Next) {
+		Next = Message->Next;
+		Message->Next = Ordered;
+		Ordered = Message;
+	}
+
+	for (Message = Ordered; Message; Message = Next) {
+		Next = Message->Next;
+
+		if (Device->Running) {
+			if (Message->Type == MSG_EVENT) _ProcessEvent(Device, Message->Doc);
+			else _ProcessAction(Device, Message->Cookie, Message->Doc, Message->ErrCode);
+		}
+
+		if (Message->Doc) ixmlDocument_free(Message->Doc);
+		free(Message);
+	}
+}
+
 /*----------------------------------------------------------------------------*/
 int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie)
 {
@@ -960,10 +1439,11 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie)
 		// probably not needed now as the search happens often enough and alive comes from many other devices
 		break;
 	case UPNP_DISCOVERY_SEARCH_RESULT: {
-		tUpdate* Update = malloc(sizeof(tUpdate));
+		tUpdate* Update = calloc(1, sizeof(tUpdate));
 
 		Update->Type = DISCOVERY;
 		Update->Data = strdup(UpnpString_get_String(UpnpDiscovery_get_Location(_Event)));
+		Update->MaxAge = UpnpDiscovery_get_Expires(_Event);
 		LOG_DEBUG("received UPnP discover response %s", Update->Data);
 		queue_insert(&glUpdateQueue, Update);
 		pthread_cond_signal(&glUpdateCond);
@@ -971,7 +1451,7 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie)
 		break;
 	}
 	case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE: {
-		tUpdate* Update = malloc(sizeof(tUpdate));
+		tUpdate* Update = calloc(1, sizeof(tUpdate));
 
 		Update->Type = BYE_BYE;
 		Update->Data = strdup(UpnpString_get_String(UpnpDiscovery_get_DeviceID(_Event)));
@@ -981,7 +1461,7 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie)
 		break;
 	}
 	case UPNP_DISCOVERY_SEARCH_TIMEOUT: {
-		tUpdate* Update = malloc(sizeof(tUpdate));
+		tUpdate* Update = calloc(1, sizeof(tUpdate));
 
 		Update->Type = SEARCH_TIMEOUT;
 		Update->Data = NULL;
@@ -1033,7 +1513,9 @@ int MasterHandler(Upnp_EventType EventType, const void *_Event, void *Cookie)
 		if (s != NULL) {
 			if (UpnpEventSubscribe_get_ErrCode(_Event) == UPNP_E_SUCCESS) {
 				s->Failed = 0;
+				UnindexMRKey(KEY_SID, s->SID, Device);
 				strcpy(s->SID, UpnpString_get_String(UpnpEventSubscribe_get_SID(_Event)));
+				IndexMRKey(KEY_SID, s->SID, Device);
 				s->TimeOut = UpnpEventSubscribe_get_TimeOut(_Event);
 				LOG_INFO("[%p]: subscribe success", Device);
 			} else if (s->Failed++ < 3) {
@@ -1065,15 +1547,253 @@ static void FreeUpdate(void *_Item)
 {
 	tUpdate *Item = (tUpdate*) _Item;
 	NFREE(Item->Data);
+	NFREE(Item->Sink);
+	NFREE(Item->ZoneState);
+	if (Item->DescDoc) ixmlDocument_free(Item->DescDoc);
 	free(Item);
 }
 
+/*----------------------------------------------------------------------------*/
+static void FetchDescription(char *Location, int MaxAge)
+{
+	int i, Free = -1;
+
+	pthread_mutex_lock(&glFetch.Mutex);
+
+	// SSDP responses keep coming while the description is being fetched
+	for (i = 0; i < FETCH_PENDING; i++) {
+		if (!glFetch.Pending[i].Location) {
+			if (Free < 0) Free = i;
+		} else if (!strcmp(glFetch.Pending[i].Location, Location)) break;
+	}
+
+	if (i == FETCH_PENDING && Free >= 0) {
+		glFetch.Pending[Free].Location = strdup(Location);
+		glFetch.Pending[Free].MaxAge = MaxAge;
+		glFetch.Pending[Free].Busy = false;
+		pthread_cond_signal(&glFetch.Cond);
+	} else if (i == FETCH_PENDING) {
+		LOG_DEBUG("too many pending descriptions, %s will be fetched later", Location);
+	}
+
+	pthread_mutex_unlock(&glFetch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void FetchRelease(char *Location)
+{
+	pthread_mutex_lock(&glFetch.Mutex);
+
+	for (int i = 0; i < FETCH_PENDING; i++) {
+		if (glFetch.Pending[i].Location && !strcmp(glFetch.Pending[i].Location, Location)) {
+			NFREE(glFetch.Pending[i].Location);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&glFetch.Mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+/*
+Description and AVTransport SCPD of new devices are fetched here so that a slow
+or dead renderer does not hold the update queue. A valid renderer is handed back
+to UpdateThread for registration and its location stays pending until then
+*/
+static void *FetchThread(void *args)
+{
+	while (glMainRunning) {
+		IXML_Document *DescDoc = NULL;
+		char *Location = NULL, *ModelName = NULL, *ServiceURL = NULL;
+		char *ServiceId = NULL, *ServiceType = NULL, *EventURL = NULL, *ControlURL = NULL;
+		bool ValidRenderer = false;
+		tUpdate *Update;
+		int i, rc, MaxAge = 0;
+
+		pthread_mutex_lock(&glFetch.Mutex);
+		for (i = 0; i < FETCH_PENDING; i++) {
+			if (glFetch.Pending[i].Location && !glFetch.Pending[i].Busy) {
+				glFetch.Pending[i].Busy = true;
+				Location = strdup(glFetch.Pending[i].Location);
+				MaxAge = glFetch.Pending[i].MaxAge;
+				break;
+			}
+		}
+		if (!Location && glMainRunning) pthread_cond_wait(&glFetch.Cond, &glFetch.Mutex);
+		pthread_mutex_unlock(&glFetch.Mutex);
+
+		if (!Location) continue;
+
+		if ((rc = UpnpDownloadXmlDoc(Location, &DescDoc)) != UPNP_E_SUCCESS) {
+			LOG_DEBUG("Error obtaining description %s -- error = %d\n", Location, rc);
+			goto cleanup;
+		}
+
+		// not a media renderer but maybe a Sonos group update
+		for (i = 0; !ValidRenderer && glDiscoveryPatterns[i]; i++) {
+			ValidRenderer = XMLMatchDocumentItem(DescDoc, "deviceType", glDiscoveryPatterns[i], false);
+		}
+		if (!ValidRenderer) goto cleanup;
+
+		// excluded device
+		ModelName = XMLGetFirstDocumentItem(DescDoc, "modelName", true);
+		if (ModelName && isExcluded(ModelName)) goto cleanup;
+
+		Update = calloc(1, sizeof(tUpdate));
+		Update->Type = REGISTER;
+		Update->Data = Location;
+		Update->MaxAge = MaxAge;
+		Update->DescDoc = DescDoc;
+		Update->NextURI = true;
+
+		// capabilities requiring another download
+		if (XMLFindAndParseService(DescDoc, Location, AV_TRANSPORT, &ServiceType, &ServiceId, &EventURL, &ControlURL, &ServiceURL) && ServiceURL) {
+			Update->NextURI = XMLFindAction(Location, ServiceURL, "SetNextAVTransportURI");
+			Update->InfoEx = XMLFindAction(Location, ServiceURL, "GetInfoEx");
+		}
+
+		/*
+		 SOAP round-trips are made here as well, so that a renderer that stalls
+		 on them does not hold UpdateThread (and its mutex) while registering
+		*/
+		for (i = 0; i < 2; i++) {
+			NFREE(ServiceId);
+			NFREE(ServiceType);
+			NFREE(EventURL);
+			NFREE(ControlURL);
+			NFREE(ServiceURL);
+
+			if (!XMLFindAndParseService(DescDoc, Location, i ? TOPOLOGY : CONNECTION_MGR, &ServiceType, &ServiceId,
+										&EventURL, &ControlURL, &ServiceURL)) continue;
+
+			if (i) Update->ZoneState = GetZoneGroupState(ControlURL, ServiceType);
+			else Update->Sink = GetProtocolInfo(ControlURL, ServiceType);
+		}
+
+		NFREE(ServiceId);
+		NFREE(ServiceType);
+		NFREE(EventURL);
+		NFREE(ControlURL);
+		NFREE(ServiceURL);
+		NFREE(ModelName);
+
+		// UpdateThread only holds this mutex while it is processing updates
+		pthread_mutex_lock(&glUpdateMutex);
+		queue_insert(&glUpdateQueue, Update);
+		pthread_cond_signal(&glUpdateCond);
+		pthread_mutex_unlock(&glUpdateMutex);
+		continue;
+
+cleanup:
+		FetchRelease(Location);
+		NFREE(Location);
+		NFREE(ModelName);
+		if (DescDoc) ixmlDocument_free(DescDoc);
+	}
+
+	return NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+static struct sMR *RegisterMRDevice(char *UDN, IXML_Document *DescDoc, const char *Location, bool NextURI, bool InfoEx, char *Sink, char *ZoneState)
+{
+	struct sMR *Device;
+
+	/*
+	ASSUMING UPDATE MUTEX LOCKED
+	*/
+
+	// search a free spot - as this function is not called recursively,
+	// no need to lock the device's mutex
+	for (Device = glMRDevices; Device < glMRDevices + glMaxRenderers && Device->Running; Device++);
+
+	// no more room !
+	if (Device == glMRDevices + glMaxRenderers) {
+		LOG_ERROR("Too many uPNP devices (max:%u)", glMaxRenderers);
+		return NULL;
+	}
+
+	if (AddMRDevice(Device, UDN, DescDoc, Location, NextURI, InfoEx, Sink, ZoneState) && !glDiscovery) {
+		char **MimeTypes = ParseProtocolInfo(Device->Sink, Device->Config.ForcedMimeTypes);
+		// create a new slimdevice
+		Device->SqueezeHandle = sq_reserve_device(Device, Device->on, MimeTypes, &sq_callback);
+		if (!*(Device->sq_config.name)) strcpy(Device->sq_config.name, Device->friendlyName);
+		if (!Device->SqueezeHandle || !sq_run_device(Device->SqueezeHandle, &Device->sq_config)) {
+			sq_release_device(Device->SqueezeHandle);
+			Device->SqueezeHandle = 0;
+			LOG_ERROR("[%p]: cannot create squeezelite instance (%s)", Device, Device->friendlyName);
+			DelMRDevice(Device);
+		}
+		for (int i = 0; MimeTypes[i]; i++) free(MimeTypes[i]);
+		free(MimeTypes);
+	}
+
+	return Device->Running ? Device : NULL;
+}
+
+/*----------------------------------------------------------------------------*/
+/*
+Renderers known from the previous run are registered from the cache without any
+network access so that LMS sees them right away. They are validated by the next
+SSDP responses (and description refreshed), otherwise removed after presence timeout
+*/
+static void WarmStart(void)
+{
+	IXML_Document *Cache = ixmlLoadDocument(glCacheName);
+	IXML_NodeList *List;
+	int n = 0;
+
+	if (!Cache) return;
+
+	List = ixmlDocument_getElementsByTagName(Cache, "device");
+
+	for (int i = 0; i < (int) ixmlNodeList_length(List); i++) {
+		IXML_Document *Node = (IXML_Document*) ixmlNodeList_item(List, i);
+		char *UDN = XMLGetFirstDocumentItem(Node, "udn", true);
+		char *Location = XMLGetFirstDocumentItem(Node, "location", true);
+		char *Sink = XMLGetFirstDocumentItem(Node, "sink", true);
+		char *Description = XMLGetFirstDocumentItem(Node, "description", true);
+		char *NextURI = XMLGetFirstDocumentItem(Node, "next_uri", true);
+		char *InfoEx = XMLGetFirstDocumentItem(Node, "info_ex", true);
+		IXML_Document *DescDoc = Description ? ixmlParseBuffer(Description) : NULL;
+		struct sMR *Device;
+
+		if (UDN && Location && Sink && DescDoc && !UDN2Device(UDN) &&
+			(Device = RegisterMRDevice(UDN, DescDoc, Location, NextURI && atoi(NextURI), InfoEx && atoi(InfoEx), Sink, NULL)) != NULL) {
+			// description is re-read on first keep-alive
+			Device->Cached = true;
+			Device->DescExpires = gettime_ms() / 1000;
+			n++;
+		}
+
+		NFREE(UDN);
+		NFREE(Location);
+		NFREE(Sink);
+		NFREE(Description);
+		NFREE(NextURI);
+		NFREE(InfoEx);
+		if (DescDoc) ixmlDocument_free(DescDoc);
+	}
+
+	if (List) ixmlNodeList_free(List);
+	ixmlDocument_free(Cache);
+
+	LOG_INFO("warm started %d renderer(s) from %s", n, glCacheName);
+}
+
 /*----------------------------------------------------------------------------*/
 static void *UpdateThread(void *args)
 {
+	// renderers from previous run before anything is discovered
+	if (!glDiscovery) {
+		pthread_mutex_lock(&glUpdateMutex);
+		WarmStart();
+		pthread_mutex_unlock(&glUpdateMutex);
+	}
+
 	while (glMainRunning) {
 		tUpdate *Update;
-		bool updated = false;
+		bool updated = false, changed = false;
 		pthread_mutex_lock(&glUpdateMutex);
 		pthread_cond_wait(&glUpdateCond, &glUpdateMutex);
 		for (; glMainRunning && (Update = queue_extract(&glUpdateQueue)) != NULL; FreeUpdate(Update)) {
@@ -1084,16 +1804,18 @@ static void *UpdateThread(void *args)
 			if (Update->Type == SEARCH_TIMEOUT) {
 				LOG_DEBUG("Presence checking", NULL);
 
-				for (int i = 0; i < MAX_RENDERERS; i++) {
+				for (int i = 0; i < glMaxRenderers; i++) {
 					Device = glMRDevices + i;
 					if (Device->Running && (((Device->sqState != SQ_PLAY || Device->State != PLAYING) &&
 						((Device->Config.RemoveTimeout != -1 && now - Device->LastSeen > Device->Config.RemoveTimeout) || 
+						 (Device->Cached && now - Device->LastSeen > PRESENCE_TIMEOUT) ||
 						 Device->ErrorCount > MAX_ACTION_ERRORS)) || Device->ErrorCount < 0)) {
 						pthread_mutex_lock(&Device->Mutex);
 						LOG_INFO("[%p]: removing unresponsive player (%s)", Device, Device->friendlyName);
 						sq_delete_device(Device->SqueezeHandle);
 						// device's mutex returns unlocked
 						DelMRDevice(Device);
+						changed = true;
 					}
 				}
 
@@ -1108,132 +1830,132 @@ static void *UpdateThread(void *args)
 				sq_delete_device(Device->SqueezeHandle);
 				// device's mutex returns unlocked
 				DelMRDevice(Device);
+				changed = true;
 			// device keepalive or search response
 			} else if (Update->Type == DISCOVERY) {
 				IXML_Document *DescDoc = NULL;
-				char *UDN = NULL, *ModelName = NULL;
 
 				// it's a Sonos group announce, just do a targeted search and exit
 				if (strstr(Update->Data, "group_description")) {
-					for (int i = 0; i < MAX_RENDERERS; i++) {
+					for (int i = 0; i < glMaxRenderers; i++) {
 						Device = glMRDevices + i;
-						if (Device->Running && *Device->Service[TOPOLOGY_IDX].ControlURL)
+						if (Device->Running && *Device->Service[TOPOLOGY_IDX].ControlURL) {
+							Device->GroupUpdate = true;
 							UpnpSearchAsync(glControlPointHandle, 5, Device->UDN, Device);
+						}
 					}
 					continue;
 				}
 
 				// existing device ?
-				for (int i = 0; i < MAX_RENDERERS; i++) {
-					Device = glMRDevices + i;
-					if (Device->Running && !strcmp(Device->DescDocURL, Update->Data)) {
-						char *friendlyName = NULL;
-						struct sMR *Master = GetMaster(Device, &friendlyName);
-						Device->LastSeen = now;
-						LOG_DEBUG("[%p] UPnP keep alive: %s", Device, Device->friendlyName);
-						// check for name change
+				if ((Device = Location2Device(Update->Data)) != NULL) {
+					char *friendlyName = NULL;
+					struct sMR *Master = NULL;
+					bool GroupUpdate = Device->GroupUpdate;
+
+					Device->LastSeen = now;
+					Device->Cached = false;
+					LOG_DEBUG("[%p] UPnP keep alive: %s", Device, Device->friendlyName);
+
+					/*
+					 topology only changes with a group announce and description only when
+					 expired. Sonos name is the zone name from topology, never from description
+					*/
+					if (GroupUpdate) {
+						Master = GetMaster(Device, &friendlyName);
+						// master not discovered yet, try again next time
+						Device->GroupUpdate = (Master == Device);
+					}
+
+					if (!*Device->Service[TOPOLOGY_IDX].ControlURL && (int) (now - Device->DescExpires) >= 0) {
+						LOG_DEBUG("[%p] refreshing description: %s", Device, Update->Data);
+						Device->DescExpires = now + (Update->MaxAge > 0 ? Update->MaxAge : DESC_MAX_AGE);
 						UpnpDownloadXmlDoc(Update->Data, &DescDoc);
-						if (!friendlyName) friendlyName = XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
-						if (friendlyName && strcmp(friendlyName, Device->friendlyName)) {
-							// only update if LMS has not set its own name
-							if (!strcmp(Device->sq_config.name, Device->friendlyName)) {
-								// by notifying LMS, we'll get an update later
-								sq_notify(Device->SqueezeHandle, SQ_SETNAME, friendlyName);
-							}
-
-							updated = true;
-							LOG_INFO("[%p]: Name update %s => %s (LMS:%s)", Device, Device->friendlyName, friendlyName, Device->sq_config.name);
-							strcpy(Device->friendlyName, friendlyName);
-						}
+						friendlyName = XMLGetFirstDocumentItem(DescDoc, "friendlyName", true);
+					}
 
-						NFREE(friendlyName);
-
-						// we are a master (or not a Sonos)
-						if (!Master && Device->Master) {
-							// leaving a group
-							char **MimeTypes = ParseProtocolInfo(Device->Sink, Device->Config.ForcedMimeTypes);
-							LOG_INFO("[%p]: Sonos %s is now master", Device, Device->friendlyName);
-							pthread_mutex_lock(&Device->Mutex);
-							Device->Master = NULL;
-							Device->SqueezeHandle = sq_reserve_device(Device, Device->on, MimeTypes, &sq_callback);
-							if (!*(Device->sq_config.name)) strcpy(Device->sq_config.name, Device->friendlyName);
-							sq_run_device(Device->SqueezeHandle, &Device->sq_config);
-
-							for (i = 0; MimeTypes[i]; i++) free(MimeTypes[i]);
-							free(MimeTypes);
-							pthread_mutex_unlock(&Device->Mutex);
-						} else if (Master && (!Device->Master || Device->Master == Device)) {
-							// joining a group as slave
-							LOG_INFO("[%p]: Sonos %s is now slave", Device, Device->friendlyName);
-							pthread_mutex_lock(&Device->Mutex);
-							Device->Master = Master;
-							sq_delete_device(Device->SqueezeHandle);
-							Device->SqueezeHandle = 0;
-							pthread_mutex_unlock(&Device->Mutex);
+					// check for name change
+					if (friendlyName && strcmp(friendlyName, Device->friendlyName)) {
+						// only update if LMS has not set its own name
+						if (!strcmp(Device->sq_config.name, Device->friendlyName)) {
+							// by notifying LMS, we'll get an update later
+							sq_notify(Device->SqueezeHandle, SQ_SETNAME, friendlyName);
 						}
-						goto cleanup;
+
+						updated = true;
+						LOG_INFO("[%p]: Name update %s => %s (LMS:%s)", Device, Device->friendlyName, friendlyName, Device->sq_config.name);
+						strcpy(Device->friendlyName, friendlyName);
 					}
-				}
 
-				// this can take a very long time, too bad for the queue...
-				int rc;
-				if ((rc = UpnpDownloadXmlDoc(Update->Data, &DescDoc)) != UPNP_E_SUCCESS) {
-					LOG_DEBUG("Error obtaining description %s -- error = %d\n", Update->Data, rc);
+					NFREE(friendlyName);
+
+					// we are a master (or not a Sonos)
+					if (GroupUpdate && !Master && Device->Master) {
+						// leaving a group
+						char **MimeTypes = ParseProtocolInfo(Device->Sink, Device->Config.ForcedMimeTypes);
+						LOG_INFO("[%p]: Sonos %s is now master", Device, Device->friendlyName);
+						pthread_mutex_lock(&Device->Mutex);
+						Device->Master = NULL;
+						Device->SqueezeHandle = sq_reserve_device(Device, Device->on, MimeTypes, &sq_callback);
+						if (!*(Device->sq_config.name)) strcpy(Device->sq_config.name, Device->friendlyName);
+						sq_run_device(Device->SqueezeHandle, &Device->sq_config);
+
+						for (int i = 0; MimeTypes[i]; i++) free(MimeTypes[i]);
+						free(MimeTypes);
+						pthread_mutex_unlock(&Device->Mutex);
+					} else if (GroupUpdate && Master && (!Device->Master || Device->Master == Device)) {
+						// joining a group as slave
+						LOG_INFO("[%p]: Sonos %s is now slave", Device, Device->friendlyName);
+						pthread_mutex_lock(&Device->Mutex);
+						Device->Master = Master;
+						sq_delete_device(Device->SqueezeHandle);
+						Device->SqueezeHandle = 0;
+						pthread_mutex_unlock(&Device->Mutex);
+					}
 					goto cleanup;
 				}
 
-				// not a media renderer but maybe a Sonos group update
-				bool ValidRenderer = false;
-				for (size_t i = 0; !ValidRenderer && glDiscoveryPatterns[i]; i++) {
-					ValidRenderer = XMLMatchDocumentItem(DescDoc, "deviceType", glDiscoveryPatterns[i], false);
-				}
-				if (!ValidRenderer) goto cleanup;
+				// new device, description is fetched by workers that come back with a REGISTER
+				FetchDescription(Update->Data, Update->MaxAge);
 
-				ModelName = XMLGetFirstDocumentItem(DescDoc, "modelName", true);
-				UDN = XMLGetFirstDocumentItem(DescDoc, "UDN", true);
-				// excluded device
-				if (ModelName && isExcluded(ModelName)) {
-					goto cleanup;
+cleanup:
+				if (updated && (glAutoSaveConfigFile || glDiscovery)) {
+					LOG_DEBUG("Updating configuration %s", glConfigName);
+					SaveConfig(glConfigName, glConfigID, false);
 				}
 
-				// new device so search a free spot - as this function is not called
-				// recursively, no need to lock the device's mutex
-				for (Device = glMRDevices; Device->Running && Device < glMRDevices + MAX_RENDERERS; Device++);
-
-				// no more room !
-				if (Device == glMRDevices + MAX_RENDERERS) {
-					LOG_ERROR("Too many uPNP devices (max:%u)", MAX_RENDERERS);
-					goto cleanup;
+				if (DescDoc) ixmlDocument_free(DescDoc);
+			// new device which description has been fetched
+			} else if (Update->Type == REGISTER) {
+				char *UDN = XMLGetFirstDocumentItem(Update->DescDoc, "UDN", true);
+
+				// same renderer at a new location (DHCP or stale cache)
+				if (UDN && (Device = UDN2Device(UDN)) != NULL && CheckAndLock(Device)) {
+					LOG_INFO("[%p]: renderer has moved to %s: %s", Device, Update->Data, Device->friendlyName);
+					sq_delete_device(Device->SqueezeHandle);
+					// device's mutex returns unlocked
+					DelMRDevice(Device);
 				}
 
-				updated = true;
+				if (UDN && (Device = RegisterMRDevice(UDN, Update->DescDoc, Update->Data, Update->NextURI, Update->InfoEx,
+														Update->Sink ? Update->Sink : "", Update->ZoneState)) != NULL) {
+					Device->DescExpires = now + (Update->MaxAge > 0 ? Update->MaxAge : DESC_MAX_AGE);
+					changed = true;
 
-				if (AddMRDevice(Device, UDN, DescDoc, Update->Data) && !glDiscovery) {
-					char **MimeTypes = ParseProtocolInfo(Device->Sink, Device->Config.ForcedMimeTypes);
-					// create a new slimdevice
-					Device->SqueezeHandle = sq_reserve_device(Device, Device->on, MimeTypes, &sq_callback);
-					if (!*(Device->sq_config.name)) strcpy(Device->sq_config.name, Device->friendlyName);
-					if (!Device->SqueezeHandle || !sq_run_device(Device->SqueezeHandle, &Device->sq_config)) {
-						sq_release_device(Device->SqueezeHandle);
-						Device->SqueezeHandle = 0;
-						LOG_ERROR("[%p]: cannot create squeezelite instance (%s)", Device, Device->friendlyName);
-						DelMRDevice(Device);
+					if (glAutoSaveConfigFile || glDiscovery) {
+						LOG_DEBUG("Updating configuration %s", glConfigName);
+						SaveConfig(glConfigName, glConfigID, false);
 					}
-					for (int i = 0; MimeTypes[i]; i++) free(MimeTypes[i]);
-					free(MimeTypes);
-				}
-
-cleanup:
-				if (updated && (glAutoSaveConfigFile || glDiscovery)) {
-					LOG_DEBUG("Updating configuration %s", glConfigName);
-					SaveConfig(glConfigName, glConfigID, false);
 				}
 
 				NFREE(UDN);
-				NFREE(ModelName);
-				if (DescDoc) ixmlDocument_free(DescDoc);
+				FetchRelease(Update->Data);
 			}
 		}
+
+		// keep what's needed for next warm start
+		if (changed && !glDiscovery) SaveCache(glCacheName);
+
 		// now release the update mutex (will be locked/unlocked)
 		pthread_mutex_unlock(&glUpdateMutex);
 	}
@@ -1247,6 +1969,14 @@ static void *MainThread(void *args) {
 		crossthreads_sleep(30*1000);
 		if (!glMainRunning) break;
 
+		// changes recorded by squeezelite callbacks
+		if (ATOMIC_XCHG_INT(&glConfigDirty, 0)) {
+			pthread_mutex_lock(&glUpdateMutex);
+			LOG_DEBUG("Updating configuration %s", glConfigName);
+			SaveConfig(glConfigName, glConfigID, false);
+			pthread_mutex_unlock(&glUpdateMutex);
+		}
+
 		if (glLogFile && glLogLimit != -1) {
 			uint32_t size = ftell(stderr);
 
@@ -1275,7 +2005,7 @@ static void *MainThread(void *args) {
 }
 
 /*----------------------------------------------------------------------------*/
-static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, const char *location) {
+static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, const char *location, bool NextURI, bool InfoEx, char *Sink, char *ZoneState) {
 	char *friendlyName = NULL;
 	
 	// read parameters from default then config file
@@ -1300,17 +2030,27 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 	Device->InfoExPoll 		= -1;
 	Device->Volume 			= -1;
 	Device->VolumeStampRx 	= Device->VolumeStampTx = gettime_ms() - 2000;
+	Device->VolumeSent		= gettime_ms() - Device->Config.VolumeInterval;
+	Device->VolumePending	= false;
 	Device->LastSeen		= gettime_ms() / 1000;
 	// all this is set to 0 by memset ...
 	Device->SqueezeHandle 	= 0;
 	Device->ErrorCount 		= 0;
 	Device->WaitCookie 		= Device->StartCookie = NULL;
+	Device->WaitSafe		= false;
 	Device->seqN			= NULL;
 	Device->TrackPoll 		= Device->StatePoll = 0;
+	Device->RelStamp		= Device->PollBoost = 0;
+	Device->EventTrusted	= false;
 	Device->Actions 		= NULL;
 	Device->NextURI 		= Device->NextProtoInfo = NULL;
+	Device->TrackQueued		= 0;
 	Device->Master			= NULL;
 	Device->Sink 			= NULL;
+	Device->Cached			= false;
+	Device->HasNextURI		= NextURI;
+	Device->HasInfoEx		= InfoEx;
+	Device->Description		= ixmlDocumenttoString(DescDoc);
 	if (Device->sq_config.roon_mode) {
 		Device->on = true;
 		Device->sq_config.use_cli = false;
@@ -1324,6 +2064,11 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 
 	memset(&Device->NextMetaData, 0, sizeof(metadata_t));
 	memset(&Device->Service, 0, sizeof(struct sService) * NB_SRV);
+	// late messages for the previous renderer in this slot
+	pthread_mutex_lock(&Device->Mutex);
+	_ProcessInbox(Device);
+	pthread_mutex_unlock(&Device->Mutex);
+	queue_init(&Device->TrackQueue, false, FreeQueuedTrack);
 
 	/* find the different services */
 	for (int i = 0; i < NB_SRV; i++) {
@@ -1345,23 +2090,31 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		NFREE(ServiceType);
 		NFREE(EventURL);
 		NFREE(ControlURL);
+		NFREE(ServiceURL);
+	}
 
-		if (ServiceURL && cSearchedSRV[i].idx == AVT_SRV_IDX && !XMLFindAction(location, ServiceURL, "SetNextAVTransportURI") && Device->Config.AcceptNextURI == NEXT_GAPLESS) {
-			LOG_INFO("[%p]: player can't do gapless or gapless disabled by config (%d)", Device, Device->Config.AcceptNextURI);
-			Device->Config.AcceptNextURI = NEXT_GAPPED;
-		}
+	if (!NextURI && Device->Config.AcceptNextURI == NEXT_GAPLESS) {
+		LOG_INFO("[%p]: player can't do gapless or gapless disabled by config (%d)", Device, Device->Config.AcceptNextURI);
+		Device->Config.AcceptNextURI = NEXT_GAPPED;
+	}
 
-		if (ServiceURL && cSearchedSRV[i].idx == AVT_SRV_IDX && XMLFindAction(location, ServiceURL, "GetInfoEx")) {
-			LOG_INFO("[%p]: player has extended information", Device);
-			Device->InfoExPoll = INFOEX_POLL;
-		}
+	if (InfoEx) {
+		LOG_INFO("[%p]: player has extended information", Device);
+		Device->InfoExPoll = INFOEX_POLL;
+	}
 
-		NFREE(ServiceURL);
+	// topology fetched by description workers, otherwise (cache) read on first keep-alive
+	if (ZoneState) {
+		Device->Master = ParseMaster(Device, ZoneState, &friendlyName);
+		Device->GroupUpdate = (Device->Master == Device);
+	} else {
+		Device->Master = NULL;
+		Device->GroupUpdate = *Device->Service[TOPOLOGY_IDX].ControlURL != '\0';
 	}
-	Device->Master = GetMaster(Device, &friendlyName);
 
 	// set remaining items now that we are sure
 	Device->Running = true;
+	IndexMRDevice(Device);
 	strcpy(Device->friendlyName, friendlyName);
 	NFREE(friendlyName);
 		
@@ -1378,7 +2131,7 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 	}
 
 	// virtual players duplicate mac address
-	for (int i = 0; i < MAX_RENDERERS; i++) {
+	for (int i = 0; i < glMaxRenderers; i++) {
 		if (glMRDevices[i].Running && Device != glMRDevices + i && !memcmp(&glMRDevices[i].sq_config.mac, &Device->sq_config.mac, 6)) {
 			memset(Device->sq_config.mac, 0xbb, 2);
 			*(uint32_t*)(Device->sq_config.mac + 2) = hash32(Device->UDN);
@@ -1392,17 +2145,16 @@ static bool AddMRDevice(struct sMR *Device, char *UDN, IXML_Document *DescDoc, c
 		LOG_INFO("[%p]: adding renderer (%s) with mac %hX-%X", Device, Device->friendlyName, *(uint16_t*)Device->sq_config.mac, *(uint32_t*)(Device->sq_config.mac + 2));
 	}
 
-	// get the protocol info
-	if ((Device->Sink = GetProtocolInfo(Device)) == NULL) {
-		LOG_WARN("[%p] unable to get protocol info, set <forced_mimetypes>", Device);
-		Device->Sink = strdup("");
-	}
+	// protocol info is read by description workers or comes from cache
+	if (!*Sink) LOG_WARN("[%p] unable to get protocol info, set <forced_mimetypes>", Device);
+	Device->Sink = strdup(Sink);
 
 	// only check codecs in thru mode
 	if (strcasestr(Device->sq_config.mode, "thru"))
 		CheckCodecs(Device->sq_config.codecs, Device->Sink, Device->Config.ForcedMimeTypes);
 
-	pthread_create(&Device->Thread, NULL, &MRThread, Device);
+	Device->PollLast = gettime_ms();
+	_SchedulePoll(Device, MIN_POLL);
 
 	/* subscribe here, not before */
 	for (int i = 0; i < NB_SRV; i++) if (Device->Service[i].TimeOut)
@@ -1468,11 +2220,20 @@ static bool Start(void) {
 	UpnpSetMaxContentLength(60000);
 
 	// device mutexes are always initialized
-	memset(&glMRDevices, 0, sizeof(glMRDevices));
-	for (int i = 0; i < MAX_RENDERERS; i++) pthread_mutex_init(&glMRDevices[i].Mutex, 0);
+	glMRDevices = calloc(glMaxRenderers, sizeof(struct sMR));
+	for (int i = 0; i < glMaxRenderers; i++) {
+		pthread_mutex_init(&glMRDevices[i].Mutex, 0);
+		glMRDevices[i].PollSlot = -1;
+	}
+
+	memset(&glWheel, 0, sizeof(glWheel));
+	pthread_mutex_init(&glWheel.Mutex, 0);
+	pthread_cond_init(&glWheel.Cond, 0);
+	glWheel.Tick = gettime_ms() / WHEEL_TICK;
+	InitMRIndex();
 	
 	//if (!*glIPaddress) strcpy(glIPaddress, UpnpGetServerIpAddress());
-	sq_init(Host, Port ? UpnpGetServerPort() : 0, glModelName);
+	sq_init(Host, Port ? UpnpGetServerPort() : 0, glModelName, glMaxBandwidth * 1000 / 8, glStreamReactors, glMaxRenderers);
 	rc = UpnpRegisterClient(MasterHandler, NULL, &glControlPointHandle);
 
 	if (rc != UPNP_E_SUCCESS) {
@@ -1485,10 +2246,18 @@ static bool Start(void) {
 	pthread_mutex_init(&glUpdateMutex, 0);
 	pthread_cond_init(&glUpdateCond, 0);
 	queue_init(&glUpdateQueue, true, FreeUpdate);
+	memset(&glFetch, 0, sizeof(glFetch));
+	pthread_mutex_init(&glFetch.Mutex, 0);
+	pthread_cond_init(&glFetch.Cond, 0);
+
+	// keep-alive connections for renderers' actions
+	SOAPInit();
 
 	// start the main thread
 	pthread_create(&glMainThread, NULL, &MainThread, NULL);
 	pthread_create(&glUpdateThread, NULL, &UpdateThread, NULL);
+	pthread_create(&glPollThread, NULL, &PollThread, NULL);
+	for (int i = 0; i < FETCH_WORKERS; i++) pthread_create(&glFetch.Thread[i], NULL, &FetchThread, NULL);
 
 	
 	for (size_t i = 0; glDiscoveryPatterns[i]; i++) {
@@ -1509,12 +2278,26 @@ static bool Stop(void) {
 	pthread_cond_signal(&glUpdateCond);
 	pthread_join(glUpdateThread, NULL);
 
+	// fetch workers might be stuck in a download for a while
+	LOG_INFO("terminate description workers ...", NULL);
+	pthread_mutex_lock(&glFetch.Mutex);
+	pthread_cond_broadcast(&glFetch.Cond);
+	pthread_mutex_unlock(&glFetch.Mutex);
+	for (int i = 0; i < FETCH_WORKERS; i++) pthread_join(glFetch.Thread[i], NULL);
+
 	// simple log size management thread ... should be remove done day
 	LOG_INFO("terminate main thread ...", NULL);
 	crossthreads_wake();
 	pthread_join(glMainThread, NULL);
+	pthread_mutex_lock(&glWheel.Mutex);
+	pthread_cond_signal(&glWheel.Cond);
+	pthread_mutex_unlock(&glWheel.Mutex);
+	pthread_join(glPollThread, NULL);
 	LOG_INFO("stopping UPnP devices ...", NULL);
+	if (!glDiscovery) SaveCache(glCacheName);
+	if (ATOMIC_XCHG_INT(&glConfigDirty, 0)) SaveConfig(glConfigName, glConfigID, false);
 	FlushMRDevices();
+	SOAPEnd();
 	LOG_DEBUG("un-register libupnp callbacks ...", NULL);
 	UpnpUnRegisterClient(glControlPointHandle);
 	LOG_DEBUG("end libupnp ...", NULL);
@@ -1523,9 +2306,17 @@ static bool Stop(void) {
 	// wait for UPnP to terminate to not have callbacks issues
 	pthread_mutex_destroy(&glUpdateMutex);
 	pthread_cond_destroy(&glUpdateCond);
-	for (int i = 0; i < MAX_RENDERERS; i++)	{
+	for (int i = 0; i < glMaxRenderers; i++)	{
+		_ProcessInbox(glMRDevices + i);
 		pthread_mutex_destroy(&glMRDevices[i].Mutex);
 	}
+	pthread_mutex_destroy(&glWheel.Mutex);
+	pthread_cond_destroy(&glWheel.Cond);
+	for (int i = 0; i < FETCH_PENDING; i++) NFREE(glFetch.Pending[i].Location);
+	pthread_mutex_destroy(&glFetch.Mutex);
+	pthread_cond_destroy(&glFetch.Cond);
+	EndMRIndex();
+	NFREE(glMRDevices);
 
 	// remove discovered items
 	queue_flush(&glUpdateQueue);
@@ -1550,7 +2341,7 @@ static void sighandler(int signum) {
 	quit = true;
 	glMainRunning = false;
 	if (!glGracefullShutdown) {
-		for (i = 0; i < MAX_RENDERERS; i++) {
+		for (i = 0; i < glMaxRenderers; i++) {
 			struct sMR *p = &glMRDevices[i];
 			if (p->Running && p->sqState == SQ_PLAY) AVTStop(p);
 		}
@@ -1725,6 +2516,12 @@ int main(int argc, char *argv[])
 
 	// potentially overwrite with some cmdline parameters
 	if (!ParseArgs(argc, argv)) exit(1);
+
+	// renderers cache for warm start lives next to config file
+	snprintf(glCacheName, sizeof(glCacheName) - 6, "%s", glConfigName);
+	if ((token = strrchr(glCacheName, '.')) != NULL && !strpbrk(token, "/\\")) *token = '\0';
+	strcat(glCacheName, ".cache");
+
 	if (glLogFile) {
 		if (!freopen(glLogFile, "a", stderr)) {
 			fprintf(stderr, "error opening logfile %s: %s\n", glLogFile, strerror(errno));
@@ -1808,7 +2605,7 @@ int main(int argc, char *argv[])
 			uint32_t now = gettime_ms() / 1000;
 			bool all = !strcmp(resp, "dumpall");
 
-			for (i = 0; i < MAX_RENDERERS; i++) {
+			for (i = 0; i < glMaxRenderers; i++) {
 				struct sMR *p = &glMRDevices[i];
 				bool Locked = pthread_mutex_trylock(&p->Mutex);
 
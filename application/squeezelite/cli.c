@@ -0,0 +1,758 @@
+/*
+ *  Squeezelite - lightweight headless squeezebox emulator
+ *
+ *  (c) Adrian Smith 2012-2015, triode1@btinternet.com
+ *  (c) Philippe, philippe_44@outlook.com for multi-instance modifications
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// LMS CLI client
+
+/*
+ There is one CLI connection per LMS server, shared by all players using that
+ server. A request is written by the caller as soon as the connection exists
+ and then stays pending until a line echoing its (encoded) command comes back,
+ so replies can arrive in any order and many requests can be in flight. A
+ single thread opens connections, reads replies, expires requests after
+ CLI_TIMEOUT and closes connections that stayed idle for CLI_KEEP_DURATION.
+ While players are attached, the connection is kept open and subscribed to
+ playlist/newmetadata notifications, so a player following live metadata is
+ only told to refresh when LMS reports a change and next track's metadata can
+ be prefetched whenever the playlist moves. Completion callbacks run in that
+ thread, so they must never wait on the CLI themselves. cli_send_cmd is the
+ blocking flavour for callers that need the answer right away.
+*/
+
+#include "squeezelite.h"
+
+#include <ctype.h>
+
+#define LOCK_O	 mutex_lock(ctx->outputbuf->mutex)
+#define UNLOCK_O mutex_unlock(ctx->outputbuf->mutex)
+#define LOCK_P   mutex_lock(ctx->mutex)
+#define UNLOCK_P mutex_unlock(ctx->mutex)
+
+#define CLI_TIMEOUT			500
+#define CLI_CONNECT_TIMEOUT	250
+#define CLI_POLL			50
+#define CLI_KEEP_DURATION 	(15*60*1000)
+#define CLI_PACKET 			4096
+#define CLI_MAX_PACKET		(64*1024)
+#define CLI_RETRY			5000
+#define CLI_SUBSCRIBE		"subscribe playlist,newmetadata"
+
+struct cli_request_s {
+	char 	*cmd, *packet, *rsp;
+	size_t	len;
+	bool	decode, sent;
+	u32_t	deadline;
+	cli_callback_t callback;
+	void	*data;
+	struct thread_ctx_s *ctx;
+	struct cli_request_s *next;
+};
+
+struct cli_server_s {
+	in_addr_t	ip;
+	u16_t		port;
+	sockfd		sock;
+	u32_t		last, retry;
+	bool		listening;		// subscribed to notifications
+	char		*buf;
+	size_t		len, size;
+	struct cli_request_s *pending;
+};
+
+struct cli_wait_s {
+	pthread_cond_t	cond;
+	bool			done;
+	char			*rsp;
+};
+
+static struct {
+	mutex_type	mutex;
+	thread_type	thread;
+	bool		running;
+	struct thread_ctx_s *busy;				// player whose callback is running
+	struct cli_request_s *done;				// completed, callback not yet called
+	struct cli_server_s	*servers;
+} cli;
+
+extern log_level	slimmain_loglevel;
+static log_level	*loglevel = &slimmain_loglevel;
+
+/*---------------------------------------------------------------------------*/
+static char from_hex(char ch) {
+  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+/*---------------------------------------------------------------------------*/
+static char to_hex(char code) {
+  static char hex[] = "0123456789abcdef";
+  return hex[code & 15];
+}
+
+/*---------------------------------------------------------------------------*/
+/* IMPORTANT: be sure to free() the returned string after use */
+static char *cli_encode(char *str) {
+  char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
+  while (*pstr) {
+	if ( isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' ||
+						  *pstr == '~' || *pstr == ' ' || *pstr == ')' ||
+						  *pstr == '(' )
+	  *pbuf++ = *pstr;
+	else if (*pstr == '%') {
+	  *pbuf++ = '%',*pbuf++ = '2', *pbuf++ = '5';
+	}
+	else
+	  *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
+	pstr++;
+  }
+  *pbuf = '\0';
+  return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+/* IMPORTANT: be sure to free() the returned string after use */
+static char *cli_decode(char *str) {
+  char *pstr = str, *buf = malloc(strlen(str) + 1), *pbuf = buf;
+  while (*pstr) {
+	if (*pstr == '%') {
+	  if (pstr[1] && pstr[2]) {
+		*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+		pstr += 2;
+	  }
+	} else {
+	  *pbuf++ = *pstr;
+	}
+	pstr++;
+  }
+  *pbuf = '\0';
+  return buf;
+}
+
+/*---------------------------------------------------------------------------*/
+/* decode in place, result is never longer than source						 */
+static char *cli_unescape(char *str) {
+	char *pstr = str, *pbuf = str;
+
+	while (*pstr) {
+		if (*pstr == '%' && pstr[1] && pstr[2]) {
+			*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+			pstr += 3;
+		} else {
+			*pbuf++ = *pstr++;
+		}
+	}
+
+	*pbuf = '\0';
+	return str;
+}
+
+/*---------------------------------------------------------------------------*/
+/* split a raw (not decoded) response into key:value tags in one pass. The
+   response is decoded in place and tags point into it, so it must outlive
+   them. IMPORTANT: be sure to free() tags after use */
+int cli_tokenize(char *rsp, struct cli_tag_s **tags) {
+	char *p, *token, *sep;
+	int count = 1;
+
+	for (p = rsp; *p; p++) if (*p == ' ') count++;
+	*tags = malloc(count * sizeof(struct cli_tag_s));
+
+	for (count = 0, p = rsp; *p; ) {
+		for (token = p; *p && *p != ' '; p++);
+		if (*p) *p++ = '\0';
+
+		// keys never contain a ':' but values might
+		if ((sep = strcasestr(token, "%3a")) == NULL) continue;
+		*sep = '\0';
+
+		(*tags)[count].key = cli_unescape(token);
+		(*tags)[count].value = cli_unescape(sep + 3);
+		count++;
+	}
+
+	return count;
+}
+
+/*---------------------------------------------------------------------------*/
+static void free_request(struct cli_request_s *request) {
+	NFREE(request->rsp);
+	free(request->cmd);
+	free(request->packet);
+	free(request);
+}
+
+/*---------------------------------------------------------------------------*/
+/* move request to the completion list, keeping order (mutex locked)		 */
+static void _cli_done(struct cli_request_s *request) {
+	struct cli_request_s **p = &cli.done;
+
+	while (*p) p = &(*p)->next;
+	request->next = NULL;
+	*p = request;
+}
+
+/*---------------------------------------------------------------------------*/
+/* remove from pending list, return next one (mutex locked)					 */
+static struct cli_request_s *_cli_unlink(struct cli_server_s *server, struct cli_request_s *request) {
+	struct cli_request_s **p = &server->pending, *next = request->next;
+
+	while (*p != request) p = &(*p)->next;
+	*p = next;
+
+	return next;
+}
+
+/*---------------------------------------------------------------------------*/
+/* fail all pending requests and close socket (mutex locked)					 */
+static void _cli_close(struct cli_server_s *server) {
+	while (server->pending) {
+		struct cli_request_s *request = server->pending;
+		server->pending = request->next;
+		_cli_done(request);
+	}
+
+	if (server->sock != -1) {
+		LOG_INFO("closing CLI socket %d", server->sock);
+		closesocket(server->sock);
+		server->sock = -1;
+	}
+
+	server->len = 0;
+	server->listening = false;
+}
+
+/*---------------------------------------------------------------------------*/
+/* find (or assign) the connection for player's current server (mutex locked)*/
+static struct cli_server_s *_cli_server(struct thread_ctx_s *ctx) {
+	struct cli_server_s *server, *slot = NULL;
+	int i;
+
+	for (i = 0; i < max_players; i++) {
+		server = cli.servers + i;
+		if (server->ip == ctx->slimproto_ip && server->port == ctx->cli_port) return server;
+		if (!server->ip && !slot) slot = server;
+	}
+
+	if (slot) {
+		slot->ip = ctx->slimproto_ip;
+		slot->port = ctx->cli_port;
+		slot->sock = -1;
+		slot->len = 0;
+	}
+
+	return slot;
+}
+
+/*---------------------------------------------------------------------------*/
+/* player wants LMS to push notifications to it								 */
+static bool cli_subscriber(struct thread_ctx_s *ctx) {
+	return ctx->in_use && ctx->running && ctx->config.use_cli && ctx->slimproto_ip;
+}
+
+/*---------------------------------------------------------------------------*/
+/* player is following live metadata										 */
+static bool cli_listener(struct thread_ctx_s *ctx) {
+	return cli_subscriber(ctx) && ctx->output.state == OUTPUT_RUNNING && ctx->output.live_metadata.enabled;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool cli_subscribers(struct cli_server_s *server) {
+	int i;
+
+	for (i = 0; i < max_players; i++) {
+		struct thread_ctx_s *ctx = thread_ctx + i;
+		if (cli_subscriber(ctx) && ctx->slimproto_ip == server->ip && ctx->cli_port == server->port) return true;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+/* playlist notifications that change what the next track is				 */
+static bool cli_playlist_changed(char *cmd) {
+	static char *changes[] = { "newsong", "addtracks", "loadtracks", "load_done", "insert", "delete", 
+							   "move", "clear", "shuffle", "repeat", "zap", NULL };
+	int i;
+
+	if (strncasecmp(cmd, "playlist ", 9)) return false;
+
+	for (i = 0; changes[i]; i++) {
+		size_t len = strlen(changes[i]);
+		if (!strncasecmp(cmd + 9, changes[i], len) && (!cmd[9 + len] || cmd[9 + len] == ' ')) return true;
+	}
+
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+/* notification from LMS: "<playerid> <command> ..." (mutex locked)			 */
+static void _cli_notify(struct cli_server_s *server, char *line) {
+	char *id, *cmd = strchr(line, ' ');
+	int i;
+
+	if (!cmd) return;
+
+	*cmd++ = '\0';
+	id = cli_decode(line);
+
+	for (i = 0; i < max_players; i++) {
+		struct thread_ctx_s *ctx = thread_ctx + i;
+
+		if (!cli_subscriber(ctx) || ctx->slimproto_ip != server->ip || strcasecmp(ctx->cli_id, id)) continue;
+
+		if (cli_playlist_changed(cmd)) {
+			LOG_DEBUG("[%p]: playlist notification %s", ctx, cmd);
+			LOCK_P;
+			ctx->prefetch.gen++;
+			UNLOCK_P;
+			wake_controller(ctx);
+		}
+
+		if (cli_listener(ctx) && (!strncasecmp(cmd, "newmetadata", 11) || !strncasecmp(cmd, "playlist newsong", 16))) {
+			LOG_DEBUG("[%p]: metadata notification %s", ctx, cmd);
+			LOCK_O;
+			ctx->output.live_metadata.update = true;
+			UNLOCK_O;
+			wake_controller(ctx);
+		}
+	}
+
+	free(id);
+}
+
+/*---------------------------------------------------------------------------*/
+static sockfd cli_connect(in_addr_t ip, u16_t port) {
+	struct sockaddr_in addr;
+	sockfd sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	set_nonblock(sock);
+	set_nosigpipe(sock);
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = ip;
+	addr.sin_port = htons(port);
+
+	if (tcp_connect_timeout(sock, addr, CLI_CONNECT_TIMEOUT))  {
+		LOG_ERROR("unable to connect to server with cli %s:%hu", inet_ntoa(addr.sin_addr), port);
+		closesocket(sock);
+		return -1;
+	}
+
+	LOG_INFO("opened CLI socket %d", sock);
+	return sock;
+}
+
+/*---------------------------------------------------------------------------*/
+/* a reply line has been received, find its request (mutex locked)			 */
+static void _cli_dispatch(struct cli_server_s *server, char *line) {
+	struct cli_request_s *request;
+
+	for (request = server->pending; request; request = request->next) {
+		size_t len = strlen(request->cmd);
+		char *rsp = line + len;
+
+		if (!request->sent || strncasecmp(line, request->cmd, len) || (*rsp && *rsp != ' ')) continue;
+
+		while (*rsp == ' ') rsp++;
+		request->rsp = request->decode ? cli_decode(rsp) : strdup(rsp);
+
+		_cli_unlink(server, request);
+		_cli_done(request);
+		return;
+	}
+
+	LOG_SDEBUG("unsolicited CLI message %s", line);
+	_cli_notify(server, line);
+}
+
+/*---------------------------------------------------------------------------*/
+/* accumulate received data and dispatch full lines (mutex locked)			 */
+static bool _cli_receive(struct cli_server_s *server) {
+	char *p, *line;
+	int n;
+
+	if (server->size - server->len < CLI_PACKET) {
+		if (server->size >= CLI_MAX_PACKET) {
+			LOG_WARN("CLI line too long (%zu), dropping", server->len);
+			server->len = 0;
+		} else {
+			server->size += CLI_PACKET;
+			server->buf = realloc(server->buf, server->size + 1);
+		}
+	}
+
+	n = recv(server->sock, server->buf + server->len, server->size - server->len, 0);
+	if (n <= 0) return n < 0 && last_error() == ERROR_WOULDBLOCK;
+
+	server->len += n;
+	server->buf[server->len] = '\0';
+	server->last = gettime_ms();
+
+	for (line = server->buf; (p = strchr(line, '\n')) != NULL; line = p + 1) {
+		*p = '\0';
+		if (p > line && *(p - 1) == '\r') *(p - 1) = '\0';
+		_cli_dispatch(server, line);
+	}
+
+	server->len -= line - server->buf;
+	memmove(server->buf, line, server->len);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/* run completion callbacks, one at a time and without mutex (mutex locked)  */
+static void _cli_complete(void) {
+	while (cli.done) {
+		struct cli_request_s *request = cli.done;
+
+		cli.done = request->next;
+		cli.busy = request->ctx;
+		mutex_unlock(cli.mutex);
+
+		if (!request->rsp) {
+			LOG_WARN("[%p]: no CLI response (%s)", request->ctx, request->cmd);
+		}
+
+		// callback takes ownership of response
+		if (request->callback) {
+			request->callback(request->rsp, request->data, request->ctx);
+			request->rsp = NULL;
+		}
+
+		free_request(request);
+
+		mutex_lock(cli.mutex);
+		cli.busy = NULL;
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+static void *cli_thread(void *arg) {
+	mutex_lock(cli.mutex);
+
+	while (cli.running) {
+		struct timeval timeout = { 0, CLI_POLL * 1000 };
+		u32_t now = gettime_ms();
+		sockfd maxfd = -1;
+		fd_set rfds;
+		int i;
+
+		FD_ZERO(&rfds);
+
+		// make sure players wanting notifications have a connection
+		for (i = 0; i < max_players; i++) {
+			if (cli_subscriber(thread_ctx + i)) _cli_server(thread_ctx + i);
+		}
+
+		for (i = 0; i < max_players; i++) {
+			struct cli_server_s *server = cli.servers + i;
+			struct cli_request_s *request;
+			bool subscribers;
+
+			if (!server->ip) continue;
+
+			subscribers = cli_subscribers(server);
+
+			// open connection on demand, only this thread changes sock
+			if (server->sock == -1 && (server->pending || (subscribers && (int) (now - server->retry) > 0))) {
+				in_addr_t ip = server->ip;
+				u16_t port = server->port;
+				sockfd sock;
+
+				mutex_unlock(cli.mutex);
+				sock = cli_connect(ip, port);
+				mutex_lock(cli.mutex);
+
+				if (sock == -1) {
+					server->retry = gettime_ms() + CLI_RETRY;
+					_cli_close(server);
+					continue;
+				}
+
+				server->sock = sock;
+				server->last = now = gettime_ms();
+
+				for (request = server->pending; request; request = request->next) {
+					send_packet((u8_t*) request->packet, request->len, server->sock);
+					request->sent = true;
+				}
+			}
+
+			// expire requests that did not get a response in time
+			for (request = server->pending; request; ) {
+				if ((int) (now - request->deadline) > 0) {
+					struct cli_request_s *next = _cli_unlink(server, request);
+					LOG_WARN("[%p]: Timeout waiting for CLI reponse (%s)", request->ctx, request->cmd);
+					_cli_done(request);
+					request = next;
+				} else request = request->next;
+			}
+
+			if (server->sock == -1) {
+				if (!server->pending && !subscribers) server->ip = 0;
+				continue;
+			}
+
+			if (!server->pending && !subscribers && now - server->last > CLI_KEEP_DURATION) {
+				_cli_close(server);
+				server->ip = 0;
+				continue;
+			}
+
+			// (re)subscribe and have subscribers catch up with what they missed
+			if (subscribers && !server->listening) {
+				char *packet, *cmd = cli_encode(CLI_SUBSCRIBE);
+				int j;
+
+				(void)! asprintf(&packet, "%s\n", cmd);
+				send_packet((u8_t*) packet, strlen(packet), server->sock);
+				server->listening = true;
+				free(packet);
+				free(cmd);
+
+				for (j = 0; j < max_players; j++) {
+					struct thread_ctx_s *ctx = thread_ctx + j;
+					if (!cli_subscriber(ctx) || ctx->slimproto_ip != server->ip) continue;
+					if (cli_listener(ctx)) {
+						LOCK_O;
+						ctx->output.live_metadata.update = true;
+						UNLOCK_O;
+					}
+					LOCK_P;
+					ctx->prefetch.gen++;
+					UNLOCK_P;
+					wake_controller(ctx);
+				}
+			}
+
+			FD_SET(server->sock, &rfds);
+			if (server->sock > maxfd) maxfd = server->sock;
+		}
+
+		_cli_complete();
+		mutex_unlock(cli.mutex);
+
+		if (maxfd == -1) usleep(CLI_POLL * 1000);
+		else if (select(maxfd + 1, &rfds, NULL, NULL, &timeout) <= 0) FD_ZERO(&rfds);
+
+		mutex_lock(cli.mutex);
+
+		for (i = 0; maxfd != -1 && i < max_players; i++) {
+			struct cli_server_s *server = cli.servers + i;
+
+			if (server->sock == -1 || !FD_ISSET(server->sock, &rfds)) continue;
+
+			if (!_cli_receive(server)) {
+				LOG_WARN("CLI connection lost %d", server->sock);
+				_cli_close(server);
+			}
+		}
+
+		_cli_complete();
+	}
+
+	mutex_unlock(cli.mutex);
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+bool cli_send(struct thread_ctx_s *ctx, char *cmd, bool req, bool decode, cli_callback_t callback, void *data) {
+	struct cli_server_s *server;
+	struct cli_request_s *request, **p;
+
+	if (!ctx->config.use_cli || !ctx->in_use || !ctx->slimproto_ip) return false;
+
+	request = calloc(1, sizeof(struct cli_request_s));
+	request->cmd = cli_encode(cmd);
+	request->packet = malloc(strlen(request->cmd) + 3 + 1);
+	request->len = sprintf(request->packet, req ? "%s ?\n" : "%s\n", request->cmd);
+	request->decode = decode;
+	request->callback = callback;
+	request->data = data;
+	request->ctx = ctx;
+
+	mutex_lock(cli.mutex);
+
+	if (!cli.running || (server = _cli_server(ctx)) == NULL) {
+		mutex_unlock(cli.mutex);
+		LOG_ERROR("[%p]: no CLI connection available", ctx);
+		free_request(request);
+		return false;
+	}
+
+	request->deadline = gettime_ms() + CLI_TIMEOUT;
+	for (p = &server->pending; *p; p = &(*p)->next);
+	*p = request;
+
+	LOG_SDEBUG("[%p]: cmd %s", ctx, request->packet);
+
+	// not connected yet, CLI thread will send it
+	if (server->sock != -1) {
+		send_packet((u8_t*) request->packet, request->len, server->sock);
+		request->sent = true;
+		server->last = gettime_ms();
+	}
+
+	mutex_unlock(cli.mutex);
+
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+static void cli_wait_done(char *rsp, void *data, struct thread_ctx_s *ctx) {
+	struct cli_wait_s *wait = (struct cli_wait_s*) data;
+
+	mutex_lock(cli.mutex);
+	wait->rsp = rsp;
+	wait->done = true;
+	pthread_cond_signal(&wait->cond);
+	mutex_unlock(cli.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+/* IMPORTANT: be sure to free() the returned string after use */
+char *cli_send_cmd(char *cmd, bool req, bool decode, struct thread_ctx_s *ctx) {
+	struct cli_wait_s wait = { .done = false, .rsp = NULL };
+
+	pthread_cond_init(&wait.cond, NULL);
+
+	if (cli_send(ctx, cmd, req, decode, cli_wait_done, &wait)) {
+		mutex_lock(cli.mutex);
+		while (!wait.done) pthread_cond_wait(&wait.cond, &cli.mutex);
+		mutex_unlock(cli.mutex);
+	}
+
+	pthread_cond_destroy(&wait.cond);
+
+	return wait.rsp;
+}
+
+/*---------------------------------------------------------------------------*/
+/* LMS will notify metadata changes, so there is no need to poll				 */
+bool cli_listening(struct thread_ctx_s *ctx) {
+	bool listening = false;
+	int i;
+
+	mutex_lock(cli.mutex);
+
+	for (i = 0; i < max_players; i++) {
+		struct cli_server_s *server = cli.servers + i;
+		if (server->ip == ctx->slimproto_ip && server->port == ctx->cli_port) {
+			listening = server->listening;
+			break;
+		}
+	}
+
+	mutex_unlock(cli.mutex);
+
+	return listening;
+}
+
+/*---------------------------------------------------------------------------*/
+/* cancel player's requests and wait till none of its callbacks is running	 */
+void cli_detach(struct thread_ctx_s *ctx) {
+	struct cli_request_s *request, *list = NULL, **p;
+	int i;
+
+	mutex_lock(cli.mutex);
+
+	for (i = 0; i < max_players; i++) {
+		struct cli_server_s *server = cli.servers + i;
+
+		for (request = server->pending; request; ) {
+			if (request->ctx == ctx) {
+				struct cli_request_s *next = _cli_unlink(server, request);
+				request->next = list;
+				list = request;
+				request = next;
+			} else request = request->next;
+		}
+	}
+
+	for (p = &cli.done; *p; ) {
+		if ((*p)->ctx == ctx) {
+			request = *p;
+			*p = request->next;
+			request->next = list;
+			list = request;
+		} else p = &(*p)->next;
+	}
+
+	while (cli.busy == ctx) {
+		mutex_unlock(cli.mutex);
+		usleep(1000);
+		mutex_lock(cli.mutex);
+	}
+
+	mutex_unlock(cli.mutex);
+
+	// still need to release blocked callers
+	while (list) {
+		request = list;
+		list = request->next;
+		NFREE(request->rsp);
+		if (request->callback) request->callback(NULL, request->data, ctx);
+		free_request(request);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+void cli_init(void) {
+	pthread_attr_t attr;
+	int i;
+
+	mutex_create(cli.mutex);
+	cli.running = true;
+	cli.done = NULL;
+	cli.busy = NULL;
+
+	cli.servers = calloc(max_players, sizeof(struct cli_server_s));
+	for (i = 0; i < max_players; i++) cli.servers[i].sock = -1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + SLIMPROTO_THREAD_STACK_SIZE);
+	pthread_create(&cli.thread, &attr, cli_thread, NULL);
+	pthread_attr_destroy(&attr);
+}
+
+/*---------------------------------------------------------------------------*/
+void cli_end(void) {
+	int i;
+
+	mutex_lock(cli.mutex);
+	cli.running = false;
+	mutex_unlock(cli.mutex);
+
+	pthread_join(cli.thread, NULL);
+
+	mutex_lock(cli.mutex);
+
+	for (i = 0; i < max_players; i++) {
+		_cli_close(cli.servers + i);
+		NFREE(cli.servers[i].buf);
+		cli.servers[i].ip = 0;
+	}
+
+	_cli_complete();
+	NFREE(cli.servers);
+	mutex_unlock(cli.mutex);
+
+	mutex_destroy(cli.mutex);
+}
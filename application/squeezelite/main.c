@@ -39,7 +39,8 @@
 #define LOCK_P   mutex_lock(ctx->mutex)
 #define UNLOCK_P mutex_unlock(ctx->mutex)
 
-struct thread_ctx_s thread_ctx[MAX_PLAYER];
+struct thread_ctx_s *thread_ctx;
+unsigned			max_players;
 struct in_addr		sq_local_host;
 u16_t				sq_local_port;
 char				sq_model_name[STR_LEN];
@@ -60,11 +61,10 @@ static bool lambda(void* caller, sq_action_t action, ...) {
 void sq_wipe_device(struct thread_ctx_s *ctx) {
 	int i;
 
-	mutex_lock(ctx->cli_mutex);
 	ctx->callback = lambda;
 	ctx->in_use = false;
-	mutex_unlock(ctx->cli_mutex);
 
+	cli_detach(ctx);
 	slimproto_close(ctx);
 	output_flush(ctx);
 	output_close(ctx);
@@ -89,186 +89,18 @@ void sq_delete_device(sq_dev_handle_t handle) {
 
 
 /*---------------------------------------------------------------------------*/
-static char from_hex(char ch) {
-  return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
-}
-
-/*---------------------------------------------------------------------------*/
-static char to_hex(char code) {
-  static char hex[] = "0123456789abcdef";
-  return hex[code & 15];
-}
-
-/*---------------------------------------------------------------------------*/
-/* IMPORTANT: be sure to free() the returned string after use */
-static char *cli_encode(char *str) {
-  char *pstr = str, *buf = malloc(strlen(str) * 3 + 1), *pbuf = buf;
-  while (*pstr) {
-	if ( isalnum(*pstr) || *pstr == '-' || *pstr == '_' || *pstr == '.' ||
-						  *pstr == '~' || *pstr == ' ' || *pstr == ')' ||
-						  *pstr == '(' )
-	  *pbuf++ = *pstr;
-	else if (*pstr == '%') {
-	  *pbuf++ = '%',*pbuf++ = '2', *pbuf++ = '5';
-	}
-	else
-	  *pbuf++ = '%', *pbuf++ = to_hex(*pstr >> 4), *pbuf++ = to_hex(*pstr & 15);
-	pstr++;
-  }
-  *pbuf = '\0';
-  return buf;
-}
-
-/*---------------------------------------------------------------------------*/
-/* IMPORTANT: be sure to free() the returned string after use */
-static char *cli_decode(char *str) {
-  char *pstr = str, *buf = malloc(strlen(str) + 1), *pbuf = buf;
-  while (*pstr) {
-	if (*pstr == '%') {
-	  if (pstr[1] && pstr[2]) {
-		*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-		pstr += 2;
-	  }
-	} else {
-	  *pbuf++ = *pstr;
-	}
-	pstr++;
-  }
-  *pbuf = '\0';
-  return buf;
-}
-
-
-/*---------------------------------------------------------------------------*/
-/* IMPORTANT: be sure to free() the returned string after use */
-static char *cli_find_tag(char *str, char *tag) {
-	char *p, *res = NULL;
-	char *buf = malloc(max(strlen(str), strlen(tag)) + 5);
-
-	//FIXME: need a leading space
-	sprintf(buf, "%s%%3a", tag);
-	if ((p = strcasestr(str, buf)) != NULL) {
-		int i = 0;
-		p += strlen(buf);
-		while (*(p+i) != ' ' && *(p+i) != '\n' && *(p+i)) i++;
-		if (i) {
-			strncpy(buf, p, i);
-			buf[i] = '\0';
-			res = url_decode(buf);
-		}
+/* find a tag within a range of tokens, empty value means none				 */
+static char *cli_tag(struct cli_tag_s *tags, int first, int last, char *key) {
+	for (; first < last; first++) {
+		if (!strcasecmp(tags[first].key, key)) return *tags[first].value ? tags[first].value : NULL;
 	}
-	free(buf);
-	return res;
+	return NULL;
 }
 
 /*---------------------------------------------------------------------------*/
-bool cli_open_socket(struct thread_ctx_s *ctx) {
-	struct sockaddr_in addr;
-
-	if (!ctx->config.use_cli) return false;
-	if (ctx->cli_sock > 0) return true;
-
-	ctx->cli_sock = socket(AF_INET, SOCK_STREAM, 0);
-	set_nonblock(ctx->cli_sock);
-	set_nosigpipe(ctx->cli_sock);
-
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = ctx->slimproto_ip;
-	addr.sin_port = htons(ctx->cli_port);
-
-	if (tcp_connect_timeout(ctx->cli_sock, addr, 250))  {
-		LOG_ERROR("[%p] unable to connect to server with cli", ctx);
-		closesocket(ctx->cli_sock);
-		ctx->cli_sock = -1;
-		return false;
-	}
-
-	LOG_INFO("[%p]: opened CLI socket %d", ctx, ctx->cli_sock);
-	return true;
-}
-
-
-/*---------------------------------------------------------------------------*/
-#define CLI_SEND_SLEEP (10000)
-#define CLI_SEND_TO (1*500000)
-#define CLI_KEEP_DURATION (15*60*1000)
-#define CLI_PACKET 4096
-char *cli_send_cmd(char *cmd, bool req, bool decode, struct thread_ctx_s *ctx) {
-	char *packet;
-	int wait;
-	size_t len;
-	char *rsp = NULL;
-
-	mutex_lock(ctx->cli_mutex);
-
-	if (!cli_open_socket(ctx)) {
-		mutex_unlock(ctx->cli_mutex);
-		return NULL;
-	}
-
-	packet = malloc(CLI_PACKET + 1);
-	ctx->cli_timeout = gettime_ms() + CLI_KEEP_DURATION;
-	wait = CLI_SEND_TO / CLI_SEND_SLEEP;
-
-	cmd = cli_encode(cmd);
-
-	if (req) len = sprintf(packet, "%s ?\n", cmd);
-	else len = sprintf(packet, "%s\n", cmd);
-
-	LOG_SDEBUG("[%p]: cmd %s", ctx, packet);
-	send_packet((u8_t*) packet, len, ctx->cli_sock);
-
-	// first receive the tag and then point to the last '\n'
-	len = 0;
-	while (wait)	{
-		int k;
-		fd_set rfds;
-		struct timeval timeout = {0, CLI_SEND_SLEEP};
-
-		FD_ZERO(&rfds);
-		FD_SET(ctx->cli_sock, &rfds);
-
-		k = select(ctx->cli_sock + 1, &rfds, NULL, NULL, &timeout);
-
-		if (!k) {
-			wait--;
-			continue;
-		}
-
-		if (k < 0) break;
-
-		k = recv(ctx->cli_sock, packet + len, CLI_PACKET - len, 0);
-		if (k <= 0) break;
-
-		len += k;
-		packet[len] = '\0';
-		if (strchr(packet, '\n') && strcasestr(packet, cmd)) {
-			rsp = packet;
-			break;
-		}
-	}
-
-	if (!wait) {
-		LOG_WARN("[%p]: Timeout waiting for CLI reponse (%s)", ctx, cmd);
-	}
-
-	LOG_SDEBUG("[%p]: rsp %s", ctx, rsp);
-
-	if (rsp) {
-		rsp = strcasestr(rsp, cmd) + strlen(cmd);
-		while (*rsp && *rsp == ' ') rsp++;
-
-		if (decode) rsp = cli_decode(rsp);
-		else rsp = strdup(rsp);
-		*(strrchr(rsp, '\n')) = '\0';
-	}
-
-	mutex_unlock(ctx->cli_mutex);
-
-	free(cmd);
-	free(packet);
-
-	return rsp;
+static char *cli_dup_tag(struct cli_tag_s *tags, int first, int last, char *key) {
+	char *p = cli_tag(tags, first, last, key);
+	return p ? strdup(p) : NULL;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -305,7 +137,6 @@ bool sq_set_time(sq_dev_handle_t handle, char *pos)
 {
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
 	char cmd[128];
-	char *rsp;
 
 	if (!ctx->config.use_cli) return false;
 
@@ -317,122 +148,101 @@ bool sq_set_time(sq_dev_handle_t handle, char *pos)
 	sprintf(cmd, "%s time %s", ctx->cli_id, pos);
 	LOG_INFO("[%p] time cmd %s", ctx, cmd);
 
-	rsp = cli_send_cmd(cmd, false, true, ctx);
-	if (!rsp) {
-		LOG_ERROR("[%p] cannot settime %d", ctx, time);
+	if (!cli_send(ctx, cmd, false, true, NULL, NULL)) {
+		LOG_ERROR("[%p] cannot settime %s", ctx, pos);
 		return false;
 	}
 
-	NFREE(rsp);
 	return true;
 }
 
 /*--------------------------------------------------------------------------*/
-uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int offset)
+/* build metadata from a raw status response, rsp is consumed				*/
+static uint32_t cli_build_metadata(struct thread_ctx_s *ctx, metadata_t *metadata, char *rsp, int offset, bool seeking)
 {
-	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
-	char cmd[1024];
-	char *rsp, *p, *cur;
-	bool seeking = !offset;
-
-	metadata_init(metadata);
-	
-	if (!handle || !ctx->in_use || !ctx->config.use_cli) {
-		if (ctx->config.use_cli) {
-			LOG_ERROR("[%p]: no handle or CLI socket %d", ctx, handle);
-		}
-		metadata_defaults(metadata);
-		return 0;
-	}
-
-	// use -1 to get what's playing
-	if (offset == -1) offset = 0;
-
-	sprintf(cmd, "%s status - %d tags:xcfldatgrKNoITH", ctx->cli_id, offset + 1);
-	rsp = cli_send_cmd(cmd, false, false, ctx);
+	char *p;
+	struct cli_tag_s *tags;
+	int count, first, last;
 
 	if (!rsp || !*rsp) {
+		NFREE(rsp);
 		metadata_defaults(metadata);
 		LOG_WARN("[%p]: cannot get metadata", ctx);
 		return hash32(metadata->artist) ^ hash32(metadata->title) ^ hash32(metadata->artwork);
 	}
 
+	count = cli_tokenize(rsp, &tags);
+
+	// track entries start with "playlist index", what's before is player status
+	for (first = 0; first < count && strcasecmp(tags[first].key, "playlist index"); first++);
+
 	// the tag means the it's a repeating stream whose length might be known
-	if ((p = cli_find_tag(rsp, "repeating_stream")) != NULL) {
+	if ((p = cli_tag(tags, 0, first, "repeating_stream")) != NULL) {
 		offset = 0;
 		metadata->duration = metadata->repeating = atoi(p) * 1000;
-		free(p);
 	};
 
 	// find the current index
-	if ((p = cli_find_tag(rsp, "playlist_cur_index")) != NULL) {
+	if ((p = cli_tag(tags, 0, first, "playlist_cur_index")) != NULL) {
 		metadata->index = atoi(p) + offset;
-		free(p);
 	}
 
 	// need to make sure we rollover if end of list
-	if ((p = cli_find_tag(rsp, "playlist_tracks")) != NULL) {
+	if ((p = cli_tag(tags, 0, first, "playlist_tracks")) != NULL) {
 		int len = atoi(p);
 		if (len) metadata->index %= len;
-		free(p);
 	}
 
-	sprintf(cmd, "playlist%%20index%%3a%d ", metadata->index);
-	cur = strcasestr(rsp, cmd);
+	// scope to the requested track's entry
+	for (; first < count; first++) {
+		if (!strcasecmp(tags[first].key, "playlist index") && atoi(tags[first].value) == (int) metadata->index) break;
+	}
+	for (last = first + 1; last < count && strcasecmp(tags[last].key, "playlist index"); last++);
 
-	if (cur) {
-		metadata->title = cli_find_tag(cur, "title");
-		metadata->artist = cli_find_tag(cur, "artist");
-		metadata->album = cli_find_tag(cur, "album");
-		metadata->genre = cli_find_tag(cur, "genre");
-		metadata->remote_title = cli_find_tag(cur, "remote_title");
-		metadata->artwork = cli_find_tag(cur, "artwork_url");
+	if (first < count) {
+		metadata->title = cli_dup_tag(tags, first, last, "title");
+		metadata->artist = cli_dup_tag(tags, first, last, "artist");
+		metadata->album = cli_dup_tag(tags, first, last, "album");
+		metadata->genre = cli_dup_tag(tags, first, last, "genre");
+		metadata->remote_title = cli_dup_tag(tags, first, last, "remote_title");
+		metadata->artwork = cli_dup_tag(tags, first, last, "artwork_url");
 
-		if (!metadata->duration && (p = cli_find_tag(cur, "duration")) != NULL) {
+		if (!metadata->duration && (p = cli_tag(tags, first, last, "duration")) != NULL) {
 			metadata->duration = 1000 * atof(p);
-			free(p);
 		}
 
 		// when potentially seeking, need to adjust duration
-		if (seeking && metadata->duration && ((p = cli_find_tag(rsp, "time")) != NULL)) {
+		if (seeking && metadata->duration && ((p = cli_tag(tags, 0, count, "time")) != NULL)) {
 			metadata->duration -= (u32_t) (atof(p) * 1000);
-			free(p);
 		}
 
 		// live_duration always capture duration beofre adjustement to webradio
 		metadata->live_duration = metadata->duration;
 
-		if ((p = cli_find_tag(cur, "bitrate")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "bitrate")) != NULL) {
 			metadata->bitrate = atol(p);
-			free(p);
 		}
 
-		if ((p = cli_find_tag(cur, "samplesize")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "samplesize")) != NULL) {
 			metadata->sample_size = atol(p);
-			free(p);
-		} else if ((p = cli_find_tag(cur, "type")) != NULL) {
+		} else if ((p = cli_tag(tags, first, last, "type")) != NULL) {
 			if (!strcasecmp(p, "mp3")) metadata->sample_size = 16;
-			free(p);
 		} else metadata->sample_size = 0;
 
-		if ((p = cli_find_tag(cur, "samplerate")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "samplerate")) != NULL) {
 			metadata->sample_rate = atol(p);
-			free(p);
 		} else metadata->sample_rate = 0;
 
-		if ((p = cli_find_tag(cur, "channels")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "channels")) != NULL) {
 			metadata->channels = atol(p);
-			free(p);
 		} else metadata->channels = 0;
 
-		if ((p = cli_find_tag(cur, "tracknum")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "tracknum")) != NULL) {
 			metadata->track = atol(p);
-			free(p);
 		}
 
-		if ((p = cli_find_tag(cur, "remote")) != NULL) {
+		if ((p = cli_tag(tags, first, last, "remote")) != NULL) {
 			metadata->remote = (atoi(p) == 1);
-			free(p);
 		}
 
 		// remote_title is present, it's a webradio if not repeating
@@ -440,9 +250,8 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int offse
 
 		if (!metadata->artwork || !strlen(metadata->artwork)) {
 			NFREE(metadata->artwork);
-			if ((p = cli_find_tag(cur, "coverid")) != NULL) {
+			if ((p = cli_tag(tags, first, last, "coverid")) != NULL) {
 				(void)! asprintf(&metadata->artwork, "http://%s:%s/music/%s/cover_%s.jpg", ctx->server_ip, ctx->server_port, p, ctx->config.coverart);
-				free(p);
 			}
 		}
 
@@ -465,9 +274,10 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int offse
 		}
 
 	} else {
-		LOG_ERROR("[%p]: track not found %u %s", ctx, metadata->index, rsp);
+		LOG_ERROR("[%p]: track not found %u (%d tags)", ctx, metadata->index, count);
 	}
 
+	free(tags);
 	NFREE(rsp);
 
 	metadata_defaults(metadata);
@@ -481,6 +291,93 @@ uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int offse
 	return hash32(metadata->artist) ^ hash32(metadata->title) ^ hash32(metadata->artwork);
 }
 
+/*--------------------------------------------------------------------------*/
+uint32_t sq_get_metadata(sq_dev_handle_t handle, metadata_t *metadata, int offset)
+{
+	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
+	char cmd[1024];
+	bool seeking = !offset;
+
+	metadata_init(metadata);
+	
+	if (!handle || !ctx->in_use || !ctx->config.use_cli) {
+		if (ctx->config.use_cli) {
+			LOG_ERROR("[%p]: no handle or CLI socket %d", ctx, handle);
+		}
+		metadata_defaults(metadata);
+		return 0;
+	}
+
+	// use -1 to get what's playing
+	if (offset == -1) offset = 0;
+
+	sprintf(cmd, "%s status - %d tags:xcfldatgrKNoITH", ctx->cli_id, offset + 1);
+
+	return cli_build_metadata(ctx, metadata, cli_send_cmd(cmd, false, false, ctx), offset, seeking);
+}
+
+/*--------------------------------------------------------------------------*/
+static void metadata_prefetched(char *rsp, void *data, struct thread_ctx_s *ctx)
+{
+	struct metadata_s metadata;
+	u32_t gen = (uintptr_t) data, hash;
+	bool valid = rsp && *rsp;
+
+	metadata_init(&metadata);
+	hash = cli_build_metadata(ctx, &metadata, rsp, 1, false);
+
+	LOCK_P;
+	metadata_free(&ctx->prefetch.metadata);
+	if (valid) {
+		ctx->prefetch.metadata = metadata;
+		ctx->prefetch.hash = hash;
+		ctx->prefetch.fetched = gen;
+		LOG_INFO("[%p]: prefetched metadata for index %u (%s)", ctx, metadata.index, metadata.title);
+	} else metadata_free(&metadata);
+	ctx->prefetch.valid = valid;
+	UNLOCK_P;
+}
+
+/*--------------------------------------------------------------------------*/
+/* get next track's metadata ahead of its strm, after LMS playlist changed	*/
+void metadata_prefetch(struct thread_ctx_s *ctx)
+{
+	char cmd[128];
+
+	if (!ctx->config.use_cli || !ctx->in_use) return;
+
+	LOCK_P;
+	ctx->prefetch.valid = false;
+	ctx->prefetch.requested = ctx->prefetch.gen;
+	UNLOCK_P;
+
+	sprintf(cmd, "%s status - 2 tags:xcfldatgrKNoITH", ctx->cli_id);
+	cli_send(ctx, cmd, false, false, metadata_prefetched, (void*) (uintptr_t) ctx->prefetch.requested);
+}
+
+/*--------------------------------------------------------------------------*/
+/* consume prefetched metadata if still valid, otherwise ask LMS			*/
+uint32_t metadata_get(struct thread_ctx_s *ctx, metadata_t *metadata, int offset)
+{
+	// without subscription, playlist changes are not known
+	bool listening = offset == 1 && cli_listening(ctx);
+	uint32_t hash;
+
+	LOCK_P;
+	if (listening && ctx->prefetch.valid && ctx->prefetch.fetched == ctx->prefetch.gen) {
+		*metadata = ctx->prefetch.metadata;
+		hash = ctx->prefetch.hash;
+		ctx->prefetch.valid = false;
+		metadata_init(&ctx->prefetch.metadata);
+		UNLOCK_P;
+		LOG_INFO("[%p]: using prefetched metadata for index %u", ctx, metadata->index);
+		return hash;
+	}
+	UNLOCK_P;
+
+	return sq_get_metadata(ctx->self, metadata, offset);
+}
+
 /*--------------------------------------------------------------------------*/
 u32_t sq_self_time(sq_dev_handle_t handle)
 {
@@ -507,7 +404,7 @@ u32_t sq_self_time(sq_dev_handle_t handle)
 void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 {
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
-	char cmd[128], *rsp;
+	char cmd[128];
 
 	LOG_SDEBUG("[%p] notif %d", ctx, event);
 
@@ -540,8 +437,10 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 				LOCK_O;
 				ctx->render.state = RD_PLAYING;
 				// PLAY event can happen before render index has been captured
-				if (ctx->render.index == ctx->output.index) {
+				if (ctx->render.index == ctx->output.index ||
+					(ctx->render.index != -1 && ctx->render.index != ctx->render.started)) {
 					ctx->output.track_started = true;
+					ctx->render.started = ctx->render.index;
 					ctx->render.track_start_time = gettime_ms();
 					LOG_INFO("[%p] track %u started by play at %u", ctx, ctx->render.index, ctx->render.track_start_time);
             	} else {
@@ -557,8 +456,7 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 				// unsollicited PLAY done on the player direclty
 				LOG_WARN("[%p] unsollicited play", ctx);
 				sprintf(cmd, "%s play", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send(ctx, cmd, false, true, NULL, NULL);
 			}
 			break;
 		}
@@ -573,8 +471,7 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 			if (va_arg(args, int)) {
 				LOG_WARN("[%p] unsollicited pause", ctx);
 				sprintf(cmd, "%s pause", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send(ctx, cmd, false, true, NULL, NULL);
 			}
 			break;
 		}
@@ -583,15 +480,13 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 				// stop if the renderer side is sure or if we had 2 stops in a row
 				LOG_INFO("[%p] forced STOP", ctx);
 				sprintf(cmd, "%s stop", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send(ctx, cmd, false, true, NULL, NULL);
 			/* FIXME: not sure anymore what this tries to cover
 			} else if (ctx->stream.state <= DISCONNECT && !ctx->output.completed) {
 				// happens if streaming fails (spotty)
 				LOG_INFO("[%p] un-managed STOP, re-starting", ctx);
 				sprintf(cmd, "%s time -5.00", ctx->cli_id);
-				rsp = cli_send_cmd(cmd, false, true, ctx);
-				NFREE(rsp);
+				cli_send(ctx, cmd, false, true, NULL, NULL);
 			*/
 			} else {
 				// might be a STMu or a STMo, let slimproto decide
@@ -604,13 +499,11 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 			break;
 		case SQ_VOLUME:
 			sprintf(cmd, "%s mixer volume %d", ctx->cli_id, va_arg(args, int));
-			rsp = cli_send_cmd(cmd, false, true, ctx);
-			NFREE(rsp);
+			cli_send(ctx, cmd, false, true, NULL, NULL);
 			break;
 		case SQ_MUTE:
 			sprintf(cmd, "%s mixer muting %d", ctx->cli_id, va_arg(args, int) ? 1 : 0);
-			rsp = cli_send_cmd(cmd, false, true, ctx);
-			NFREE(rsp);
+			cli_send(ctx, cmd, false, true, NULL, NULL);
 			break;
 		case SQ_TIME: {
 			u32_t now, time = va_arg(args, u32_t);
@@ -631,7 +524,7 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 					ctx->output.offset += ctx->render.duration;
 					ctx->render.ms_played -= ctx->render.duration;
 					ctx->render.duration = ctx->output.duration;
-					ctx->render.index = ctx->output.index;
+					ctx->render.index = ctx->render.started = ctx->output.index;
 					ctx->output.track_started = true;
 					ctx->render.track_start_time = now;
 					ctx->render.ms_paused = ctx->render.track_pause_time = 0;
@@ -646,7 +539,9 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 		}
 		case SQ_TRACK_INFO: {
 			char *uri= va_arg(args, char*);
+			struct output_thread_s *thread = NULL;
 			u32_t index;
+			int i;
 
 			uri = strstr(uri, BRIDGE_URL);
 			if (!uri) break;
@@ -654,16 +549,22 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 			if we detect a change of track then update render context. Still,
 			we have to wait	for PLAY status before claiming track has started.
 			make sure as well that renderer track number is not from an old
-			context
+			context: it is either the latest or one queued after current
 			*/
 			sscanf(uri, BRIDGE_URL "%u", &index);
 			LOCK_O;
-			if (ctx->output.state > OUTPUT_STOPPED && ctx->render.index != index && ctx->output.index == index) {
+			for (i = 0; i < MAX_OUTPUT_THREADS; i++) {
+				if (ctx->output_thread[i].index == (int) index) thread = ctx->output_thread + i;
+			}
+			if (ctx->output.state > OUTPUT_STOPPED && ctx->render.index != index &&
+				(ctx->output.index == index || (thread && ctx->render.index != -1 &&
+				(u16_t) (index - ctx->render.index) < MAX_OUTPUT_THREADS))) {
 				ctx->render.index = index;
 				ctx->render.ms_paused = ctx->render.ms_played = 0;
-				ctx->render.duration = ctx->output.duration;
+				ctx->render.duration = ctx->output.index == index ? ctx->output.duration : thread->duration;
 				if (ctx->render.state == RD_PLAYING) {
 					ctx->output.track_started = true;
+					ctx->render.started = index;
 					ctx->render.track_start_time = gettime_ms();
 					LOG_INFO("[%p] track %u started by info at %u", ctx, index, ctx->render.track_start_time);
 					wake_controller(ctx);
@@ -684,14 +585,12 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 		}
 		case SQ_SETNAME: {
 			sprintf(cmd, "%s name %s", ctx->cli_id, va_arg(args, char*));
-			rsp = cli_send_cmd(cmd, false, false, ctx);
-			NFREE(rsp);
+			cli_send(ctx, cmd, false, false, NULL, NULL);
 			break;
 		}
 		case SQ_NEXT_FAILED: 
 			sprintf(cmd, "%s playlist index +1", ctx->cli_id);
-			rsp = cli_send_cmd(cmd, false, false, ctx);
-			NFREE(rsp);
+			cli_send(ctx, cmd, false, false, NULL, NULL);
 			break;
 		default:
 			LOG_WARN("[%p]: unknown notification %u", event);
@@ -703,13 +602,21 @@ void sq_notify(sq_dev_handle_t handle, sq_event_t event, ...)
 
 
 /*---------------------------------------------------------------------------*/
-void sq_init(struct in_addr host, u16_t port, char *model_name)
+void sq_init(struct in_addr host, u16_t port, char *model_name, u32_t bandwidth, unsigned reactors, unsigned players)
 {
+	// players table is sized once as contexts are referenced by address
+	max_players = players ? players : MAX_PLAYER;
+	thread_ctx = calloc(max_players, sizeof(struct thread_ctx_s));
+
 	sq_local_host = host;
 	sq_local_port = port;
 	strcpy(sq_model_name, model_name);
 
+	cli_init();
+	slimproto_init();
 	output_init();
+	output_share_init(bandwidth);
+	stream_init(reactors);
 	decode_init();
 }
 
@@ -717,7 +624,7 @@ void sq_init(struct in_addr host, u16_t port, char *model_name)
 void sq_stop() {
 	int i;
 
-	for (i = 0; i < MAX_PLAYER; i++) {
+	for (i = 0; i < max_players; i++) {
 		if (thread_ctx[i].in_use) {
 			sq_wipe_device(&thread_ctx[i]);
 		}
@@ -725,6 +632,11 @@ void sq_stop() {
 
 	decode_end();
 	output_end();
+	stream_end();
+	slimproto_end();
+	cli_end();
+
+	NFREE(thread_ctx);
 }
 
 /*---------------------------------------------------------------------------*/
@@ -746,10 +658,10 @@ sq_dev_handle_t sq_reserve_device(void *MR, bool on, char *mimetypes[], sq_callb
 	struct thread_ctx_s *ctx;
 
 	/* find a free thread context - this must be called in a LOCKED context */
-	for  (idx = 0; idx < MAX_PLAYER; idx++)
+	for  (idx = 0; idx < max_players; idx++)
 		if (!thread_ctx[idx].in_use) break;
 
-	if (idx < MAX_PLAYER) 	{
+	if (idx < max_players) 	{
 		// this sets a LOT of data to proper defaults (NULL, false ...)
 		memset(&thread_ctx[idx], 0, sizeof(struct thread_ctx_s));
 		thread_ctx[idx].in_use = true;
@@ -775,6 +687,7 @@ bool sq_run_device(sq_dev_handle_t handle, sq_dev_param_t *param)
 	struct thread_ctx_s *ctx = &thread_ctx[handle - 1];
 
 	memcpy(&ctx->config, param, sizeof(sq_dev_param_t));
+	ctx->output.buffer_notified = ctx->config.learned_buffer;
 
 #if !CODECS
 	strcpy(ctx->config.mode, "thru");
@@ -590,7 +590,7 @@ void output_flush(struct thread_ctx_s *ctx) {
 	*/
 	if (ctx->output.state != OUTPUT_OFF) ctx->output.state = OUTPUT_STOPPED;
 
-	for (i = 0; i < 2; i++) if (ctx->output_thread[i].running) {
+	for (i = 0; i < MAX_OUTPUT_THREADS; i++) if (ctx->output_thread[i].running) {
 		ctx->output_thread[i].running = false;
 		UNLOCK_O;
 		pthread_join(ctx->output_thread[i].thread, NULL);
@@ -613,6 +613,8 @@ void output_flush(struct thread_ctx_s *ctx) {
 
 /*---------------------------------------------------------------------------*/
 bool output_thread_init(struct thread_ctx_s *ctx) {
+	int i;
+
 	LOG_DEBUG("[%p] init output media renderer", ctx);
 
 	if (ctx->config.outputbuf_size <= OUTPUTBUF_IDLE_SIZE) ctx->config.outputbuf_size = OUTPUTBUF_SIZE;
@@ -630,9 +632,12 @@ bool output_thread_init(struct thread_ctx_s *ctx) {
 	ctx->output.fade_writep = NULL;
 	ctx->output.icy.artist = ctx->output.icy.title = ctx->output.icy.artwork = NULL;
 
-	ctx->output_thread[0].running = ctx->output_thread[1].running = false;
-	ctx->output_thread[0].http = ctx->output_thread[1].http = -1;
-	ctx->render.index = -1;
+	for (i = 0; i < MAX_OUTPUT_THREADS; i++) {
+		ctx->output_thread[i].running = false;
+		ctx->output_thread[i].http = -1;
+		ctx->output_thread[i].index = -1;
+	}
+	ctx->render.index = ctx->render.started = -1;
 
 	return true;
 }
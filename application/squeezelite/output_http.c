@@ -37,6 +37,9 @@ static log_level 	*loglevel = &output_loglevel;
 #define TIMEOUT			50
 #define SLEEP			50
 #define DRAIN_MAX		(5000 / TIMEOUT)
+#define SHARE_FLOOR		150				// % of real-time rate always granted
+#define SHARE_BURST		250				// max credit accumulated, in ms of rate
+#define SHARE_REPORT	10000
 
 struct thread_param_s {
 	struct thread_ctx_s *ctx;
@@ -49,27 +52,73 @@ static ssize_t 	handle_http(struct thread_ctx_s *ctx, int sock, int thread_index
 static void 	mirror_header(key_data_t *src, key_data_t *rsp, char *key);
 static ssize_t 	send_with_icy(struct thread_ctx_s *ctx, int sock, const void *buf,
 							 ssize_t *len, int flags);
+static void		share_open(struct output_thread_s *thread, u32_t floor);
+static void		share_close(struct output_thread_s *thread);
+static size_t	share_grant(struct output_thread_s *thread, size_t want);
+static void		share_refund(struct output_thread_s *thread, size_t unused);
+static u32_t	realtime_rate(struct thread_ctx_s *ctx);
+static u32_t	known_rate(struct thread_ctx_s *ctx);
+
+/*
+Outbound bandwidth shared by all output threads of all players. Each thread
+has a guaranteed floor based on the real-time rate of what it sends and the
+rest of the capacity is a common token bucket used for bursts.
+*/
+static struct {
+	mutex_type	mutex;
+	u32_t		rate, floors;	// capacity and sum of all floors (bytes/s)
+	s64_t		spare;			// tokens available to anybody
+	u32_t		last;
+} bucket;
+
+/*---------------------------------------------------------------------------*/
+void output_share_init(u32_t rate) {
+	mutex_create(bucket.mutex);
+	bucket.rate = rate;
+	bucket.last = gettime_ms();
+	if (rate) LOG_INFO("outbound bandwidth limited to %u B/s", rate);
+}
 
 /*---------------------------------------------------------------------------*/
 bool output_start(struct thread_ctx_s *ctx) {
-	struct thread_param_s *param = malloc(sizeof(struct thread_param_s));
-	int i = 0;
+	struct thread_param_s *param;
+	struct output_thread_s *thread = NULL;
+	int i;
+
+	/*
+	Get an available http server thread. Ended ones still hold the index and
+	duration of a track that might be queued in player, so recycle the oldest
+	*/
+	for (i = 0; i < MAX_OUTPUT_THREADS; i++) {
+		struct output_thread_s *p = ctx->output_thread + i;
+		if (p->running) continue;
+		if (!thread || p->index == -1 ||
+			(thread->index != -1 && (u16_t) (ctx->output.index - p->index) > (u16_t) (ctx->output.index - thread->index))) {
+			thread = p;
+		}
+	}
 
-	// start the http server thread (get an available one first)
-	if (ctx->output_thread[0].running) param->thread = ctx->output_thread + 1;
-	else param->thread = ctx->output_thread;
+	if (!thread) {
+		LOG_ERROR("[%p]: no output thread available", ctx);
+		return false;
+	}
 
+	param = malloc(sizeof(struct thread_param_s));
+	param->thread = thread;
 	param->thread->index = ctx->output.index;
+	param->thread->duration = ctx->output.duration;
+	param->thread->delivered = 0;
 	param->thread->running = true;
 	param->ctx = ctx;
 
 	// find a free port
 	ctx->output.port = sq_local_port;
+	i = 0;
 	do {
 		struct in_addr host;
 		host.s_addr = INADDR_ANY;
 		param->thread->http = bind_socket(host, &ctx->output.port, SOCK_STREAM);
-	} while (param->thread->http < 0 && ctx->output.port++ && i++ < 2 * MAX_PLAYER);
+	} while (param->thread->http < 0 && ctx->output.port++ && i++ < 2 * max_players);
 
 	// and listen to it
 	if (param->thread->http <= 0 || listen(param->thread->http, 1)) {
@@ -79,7 +128,7 @@ bool output_start(struct thread_ctx_s *ctx) {
 		return false;
 	}
 
-	LOG_INFO("[%p]: start thread %d", ctx, param->thread == ctx->output_thread ? 0 : 1);
+	LOG_INFO("[%p]: start thread %d", ctx, (int) (param->thread - ctx->output_thread));
 
 	pthread_create(&param->thread->thread, NULL, (void *(*)(void*)) &output_http_thread, param);
 
@@ -90,7 +139,7 @@ bool output_start(struct thread_ctx_s *ctx) {
 bool output_abort(struct thread_ctx_s *ctx, int index) {
 	int i;
 
-	for (i = 0; i < 2; i++) if (ctx->output_thread[i].index == index) {
+	for (i = 0; i < MAX_OUTPUT_THREADS; i++) if (ctx->output_thread[i].running && ctx->output_thread[i].index == index) {
 		LOCK_O;
 		ctx->output_thread[i].running = false;
 		UNLOCK_O;
@@ -119,9 +168,33 @@ static void output_http_thread(struct thread_param_s *param) {
 	unsigned drain_count = DRAIN_MAX;
 	u32_t start = gettime_ms();
 	FILE *store = NULL;
+	// pull rate measurement (only for windows where obuf never ran dry)
+	u32_t window = 0, peak = 0, duration = 0;
+	size_t wbytes = 0;
+	bool wfull = true;
+	encode_mode mode = ENCODE_THRU;
+	u32_t report = start, throttled = 0;
+	size_t rbytes = 0;
+	// how far ahead of playback position player reads
+	u32_t rtrate = realtime_rate(ctx), lead = 0;
+	// rates that are not a guess (0 = unknown), to learn lead and time what player has received
+	u32_t krate = known_rate(ctx), trate = 0;
+	size_t ahead = OBUF_AHEAD_MAX;
 
 	free(param);
-	buf_init(obuf, HTTP_STUB_DEPTH + 512*1024);
+
+	/*
+	Players that buffer a lot on their own don't need us to read ahead on live
+	streams, it only adds latency to pause/skip. Tracks keep the full head start
+	for players that rely on it for gapless
+	*/
+	if (!ctx->output.duration && ctx->config.learned_buffer && krate) {
+		size_t buffered = (u64_t) ctx->config.learned_buffer * krate / 1000;
+		ahead = HTTP_STUB_DEPTH > buffered ? HTTP_STUB_DEPTH - buffered : 0;
+		ahead = max(min(ahead, OBUF_AHEAD_MAX), OBUF_AHEAD_MIN);
+	}
+
+	buf_init(obuf, HTTP_STUB_DEPTH + ahead);
 
 	if (*ctx->config.store_prefix) {
 		char name[STR_LEN];
@@ -182,6 +255,13 @@ static void output_http_thread(struct thread_param_s *param) {
 
 			LOCK_O;
 			_output_new_stream(obuf, store, ctx);
+			// next track might be started before we have finished draining
+			duration = ctx->output.duration;
+			mode = ctx->output.encode.mode;
+			rtrate = realtime_rate(ctx);
+			krate = known_rate(ctx);
+			trate = duration ? krate : 0;
+			share_open(thread, rtrate * SHARE_FLOOR / 100);
 			UNLOCK_O;
 
 			LOG_INFO("[%p]: drain is %u (waited %u)", ctx, obuf->size, gettime_ms() - start);
@@ -307,9 +387,41 @@ static void output_http_thread(struct thread_param_s *param) {
 			LOG_INFO("[%p]: draining (%zu bytes)", ctx, bytes);
 		}
 
+		// a window only counts if player was the only limit (obuf never empty)
+		if (_buf_used(obuf)) {
+			u32_t now = gettime_ms();
+
+			if (!window) window = now;
+			else if (now - window >= ADAPT_WINDOW) {
+				if (wfull) peak = max(peak, (u64_t) wbytes * 1000 / (now - window));
+				window = now;
+				wbytes = 0;
+				wfull = true;
+			}
+		} else wfull = false;
+
+		// player's lead is only bounded by its buffer while we still have data
+		if (drain_count && krate && !ctx->output.encode.flow && thread->index == ctx->render.index &&
+			ctx->render.state == RD_PLAYING) {
+			u32_t sent_ms = (u64_t) bytes * 1000 / krate;
+			if (sent_ms > ctx->render.ms_played) lead = max(lead, sent_ms - ctx->render.ms_played);
+		}
+
+		// report what we sent and how long we have been held back
+		if (gettime_ms() - report >= SHARE_REPORT) {
+			u32_t now = gettime_ms();
+			LOG_DEBUG("[%p]: sending %u B/s (floor %u B/s), throttled %u ms", ctx,
+					  (u32_t) ((u64_t) rbytes * 1000 / (now - report)), thread->share.floor,
+					  thread->share.throttled - throttled);
+			throttled = thread->share.throttled;
+			report = now;
+			rbytes = 0;
+		}
+
 		// now are surely running - socket is non blocking, so this is fast
 		if (_buf_used(obuf)) {
 			ssize_t	sent, space;
+			size_t granted;
 
 			// we cannot write, so don't bother
 			if (!FD_ISSET(sock, &wfds)) {
@@ -330,7 +442,16 @@ static void output_http_thread(struct thread_param_s *param) {
 				continue;
 			}
 
+			// no bandwidth available, let select sleep (wfds is not set)
+			if ((granted = share_grant(thread, space)) == 0) {
+				FD_ZERO(&wfds);
+				UNLOCK_O;
+				continue;
+			}
+
+			space = granted;
 			sent = send_with_icy(ctx, sock, (void*) obuf->readp, &space, 0);
+			share_refund(thread, granted - max(sent, 0));
 
 			if (sent > 0) {
 				if (bytes < HEAD_SIZE) {
@@ -349,6 +470,9 @@ static void output_http_thread(struct thread_param_s *param) {
 
 				_buf_inc_readp(obuf, space);
 				bytes += space;
+				wbytes += space;
+				rbytes += sent;
+				if (trate) thread->delivered = (u64_t) bytes * 1000 / trate;
 
 				LOG_SDEBUG("[%p] sent %u bytes (total: %u)", ctx, space, bytes);
 			}
@@ -370,6 +494,7 @@ static void output_http_thread(struct thread_param_s *param) {
 
 	NFREE(hbuf);
 	buf_destroy(obuf);
+	if (acquired) share_close(thread);
 
 	// in chunked mode, a full chunk might not have been sent (due to TCP)
 	if (sock != -1) shutdown_socket(sock);
@@ -390,11 +515,126 @@ static void output_http_thread(struct thread_param_s *param) {
 		_output_end_stream(NULL, ctx);
 		// need to have slimproto move on in case of stream failure
 		ctx->output.completed = true;
+	} else if (lead) {
+		// smooth it as a single track only gives an approximation
+		u32_t *learned = &ctx->config.learned_buffer;
+		*learned = *learned ? (*learned * 3 + lead) / 4 : lead;
+		LOG_INFO("[%p]: player read %u ms ahead (learned %u ms)", ctx, lead, *learned);
+	}
+
+	if (!ctx->output.encode.flow && done && duration && mode >= ENCODE_PCM) {
+		struct outputstate *out = &ctx->output;
+		int i = out->adapt.count++ % ADAPT_HISTORY;
+
+		// whole track sent within a window, so it's at least that fast
+		if (!peak) peak = (u64_t) bytes * 1000 / (gettime_ms() - start + 1);
+
+		out->adapt.need[mode] = (u64_t) bytes * 1000 / duration;
+		out->adapt.history[i].mode = mode;
+		out->adapt.history[i].peak = peak;
+
+		LOG_INFO("[%p]: pull rate %u B/s for real-time %u B/s (mode %d)", ctx, peak, out->adapt.need[mode], mode);
 	}
 
 	UNLOCK_O;
 
-	LOG_INFO("[%p]: end thread %d (%zu bytes)", ctx, thread == ctx->output_thread ? 0 : 1, bytes);
+	// completion and free slot matter to slimproto
+	wake_controller(ctx);
+
+	LOG_INFO("[%p]: end thread %d (%zu bytes, throttled %u ms)", ctx, (int) (thread - ctx->output_thread),
+			 bytes, thread->share.throttled);
+}
+
+/*----------------------------------------------------------------------------*/
+static u32_t known_rate(struct thread_ctx_s *ctx) {
+	struct outputstate *out = &ctx->output;
+
+	if (out->encode.mode == ENCODE_PCM && out->encode.sample_rate && out->encode.sample_size) {
+		return out->encode.sample_rate * (out->encode.sample_size / 8) * (out->encode.channels ? out->encode.channels : 2);
+	} else if (out->encode.mode >= ENCODE_PCM && out->adapt.need[out->encode.mode]) {
+		return out->adapt.need[out->encode.mode];
+	} else if (out->encode.mode == ENCODE_MP3) {
+		return out->encode.level * 1000 / 8;
+	} else if (out->bitrate) {
+		return out->bitrate / 8;
+	}
+
+	return 0;
+}
+
+/*----------------------------------------------------------------------------*/
+static u32_t realtime_rate(struct thread_ctx_s *ctx) {
+	u32_t rate = known_rate(ctx);
+
+	// no idea, assume CD quality
+	return rate ? rate : 44100 * 2 * 2;
+}
+
+/*----------------------------------------------------------------------------*/
+static void share_open(struct output_thread_s *thread, u32_t floor) {
+	mutex_lock(bucket.mutex);
+	bucket.floors += floor;
+	thread->share.floor = floor;
+	thread->share.credit = 0;
+	thread->share.throttled = 0;
+	thread->share.last = gettime_ms();
+	if (bucket.rate && bucket.floors > bucket.rate) {
+		LOG_WARN("[%p]: guaranteed rates (%u B/s) exceed capacity (%u B/s)", thread, bucket.floors, bucket.rate);
+	}
+	mutex_unlock(bucket.mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static void share_close(struct output_thread_s *thread) {
+	mutex_lock(bucket.mutex);
+	bucket.floors -= thread->share.floor;
+	thread->share.floor = 0;
+	mutex_unlock(bucket.mutex);
+}
+
+/*----------------------------------------------------------------------------*/
+static size_t share_grant(struct output_thread_s *thread, size_t want) {
+	u32_t now = gettime_ms();
+	s64_t granted;
+
+	if (!bucket.rate) return want;
+
+	mutex_lock(bucket.mutex);
+
+	// refill our own floor and then what is left for everybody
+	thread->share.credit += (u64_t) thread->share.floor * (now - thread->share.last) / 1000;
+	thread->share.credit = min(thread->share.credit, (s64_t) thread->share.floor * SHARE_BURST / 1000);
+
+	if (bucket.rate > bucket.floors) {
+		u32_t spare = bucket.rate - bucket.floors;
+		bucket.spare += (u64_t) spare * (now - bucket.last) / 1000;
+		bucket.spare = min(bucket.spare, (s64_t) spare * SHARE_BURST / 1000);
+	}
+
+	// use own credit first and burst only if there is spare capacity
+	granted = min((s64_t) want, max(thread->share.credit, 0) + max(bucket.spare, 0));
+
+	if (granted > thread->share.credit) {
+		bucket.spare -= granted - max(thread->share.credit, 0);
+		thread->share.credit = min(thread->share.credit, 0);
+	} else thread->share.credit -= granted;
+
+	// time between two empty-handed calls is time we have been throttled
+	if (!granted) thread->share.throttled += now - thread->share.last;
+
+	thread->share.last = bucket.last = now;
+	mutex_unlock(bucket.mutex);
+
+	return granted;
+}
+
+/*----------------------------------------------------------------------------*/
+static void share_refund(struct output_thread_s *thread, size_t unused) {
+	if (!bucket.rate || !unused) return;
+
+	mutex_lock(bucket.mutex);
+	thread->share.credit += unused;
+	mutex_unlock(bucket.mutex);
 }
 
 /*----------------------------------------------------------------------------*/
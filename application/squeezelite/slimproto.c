@@ -40,6 +40,11 @@ decoder is running at that time
 #include "slimproto.h"
 
 #define SHORT_TRACK	(2*1000)
+#define NEXT_MARGIN	(5*1000)
+#define SERVER_TIMEOUT	(35*1000)
+#define SLIMPROTO_IDLE	(30*1000)
+#define DISCOVERY_TTL	(10*1000)
+#define DISCOVERY_CACHE	4
 
 #define PORT 3483
 #define MAXBUF 4096
@@ -70,8 +75,27 @@ static u32_t 	pcm_sample_rate[] = { 11025, 22050, 32000, 44100, 48000,
 									  176400, 192000, 352800, 384000 };
 static u8_t		pcm_channels[] = { 1, 2 };
 
+static struct {
+	mutex_type	mutex;
+	sockfd		sock;
+	bool		busy;			// a discovery request is in progress
+	u32_t		gen;			// bumped when a server answers or accepts a player
+	struct discovery_s {
+		in_addr_t	target;		// server asked, 0 for broadcast
+		u32_t		time;
+		struct sockaddr_in addr;
+		char		version[SERVER_VERSION_LEN + 1];
+		char		port[5+1];
+		u16_t		cli_port;
+	} cache[DISCOVERY_CACHE];
+} discovery;
+
 static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels,
 						  u8_t endianness, struct thread_ctx_s *ctx);
+static encode_mode adapt_mode(encode_mode top, struct thread_ctx_s *ctx);
+static u32_t next_delay(struct thread_ctx_s *ctx);
+static u32_t _render_remaining(struct thread_ctx_s *ctx);
+static bool  _output_queue_open(struct thread_ctx_s *ctx);
 
 /*---------------------------------------------------------------------------*/
 void send_packet(u8_t *packet, size_t len, sockfd sock) {
@@ -494,22 +518,33 @@ static void process(u8_t *pack, int len, struct thread_ctx_s *ctx) {
 	}
 }
 
+/*---------------------------------------------------------------------------*/
+/* next status pass must happen no later than this							 */
+static void _slimproto_deadline(struct thread_ctx_s *ctx, u32_t when) {
+	if ((int) (when - ctx->slim_run.next) < 0) ctx->slim_run.next = when;
+}
+
 /*---------------------------------------------------------------------------*/
 static void slimproto_run(struct thread_ctx_s *ctx) {
 	int  expect = 0;
 	int  got    = 0;
-	u32_t now;
+	u32_t now, heard = gettime_ms();
 	event_handle ehandles[2];
-	int timeouts = 0;
 
 	set_readwake_handles(ehandles, ctx->sock, ctx->wake_e);
+	ctx->slim_run.next = heard;
 
 	while (ctx->running && !ctx->new_server) {
 
 		bool wake = false;
 		event_type ev;
+		int timeout;
+
+		// sleep till next status pass is due or server is considered dead
+		now = gettime_ms();
+		timeout = min((int) (ctx->slim_run.next - now), (int) (heard + SERVER_TIMEOUT - now));
 
-		if ((ev = wait_readwake(ehandles, 1000)) != EVENT_TIMEOUT) {
+		if ((ev = wait_readwake(ehandles, max(timeout, 0))) != EVENT_TIMEOUT) {
 
 			if (ev == EVENT_READ) {
 
@@ -527,6 +562,8 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 					if (expect == 0) {
 						process(ctx->slim_run.buffer, got, ctx);
 						got = 0;
+						// a command might have changed state
+						wake = true;
 					}
 				} else if (expect == 0) {
 					int n = recv(ctx->sock, ctx->slim_run.buffer + got, 2 - got, 0);
@@ -553,39 +590,43 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 
 			}
 
-			if (ev == EVENT_WAKE) {
+			if (ev == EVENT_READ) {
+				heard = gettime_ms();
+			} else if (ev == EVENT_WAKE) {
 				wake = true;
 			}
 
-			if (ctx->cli_sock > 0 && (int) (gettime_ms() - ctx->cli_timeout) > 0) {
-				if (!mutex_trylock(ctx->cli_mutex)) {
-					LOG_INFO("[%p] Closing CLI socket %d", ctx, ctx->cli_sock);
-					closesocket(ctx->cli_sock);
-					ctx->cli_sock = -1;
-					mutex_unlock(ctx->cli_mutex);
-				}
-			}
-
-			timeouts = 0;
-
-		} else if (++timeouts > 35) {
+		} else if (gettime_ms() - heard > SERVER_TIMEOUT) {
 
 			// expect message from server every 5 seconds, but 30 seconds on mysb.com so timeout after 35 seconds
 			LOG_WARN("[%p] No messages from server - connection dead", ctx);
 			return;
 		}
 
-		// update playback state when woken or every 100ms
+		// update playback state when woken or when a deadline is reached
 		now = gettime_ms();
 
+		// LMS playlist has changed, get ready for next track
+		LOCK_P;
+		bool prefetch = ctx->prefetch.requested != ctx->prefetch.gen;
+		UNLOCK_P;
+		if (prefetch) metadata_prefetch(ctx);
+
 		// check for metadata update. No LOCK_O might create race condition 
 		if (ctx->output.state == OUTPUT_RUNNING) {
 			// can use a pointer here as object is static
 			struct metadata_s* metadata = &ctx->output.metadata;
-			bool updated = false;
+			bool updated = false, notified;
+
+			// CLI thread sets it under LOCK_O
+			LOCK_O;
+			notified = ctx->output.live_metadata.enabled && ctx->output.live_metadata.update;
+			if (notified) ctx->output.live_metadata.update = false;
+			UNLOCK_O;
 
-			// time to get some updated metadata anyway
-			if (ctx->output.live_metadata.enabled && ctx->output.live_metadata.last + METADATA_UPDATE_TIME - now > METADATA_UPDATE_TIME) {
+			// LMS told us metadata changed or, when not subscribed, time to get some updated metadata anyway
+			if (ctx->output.live_metadata.enabled && (notified ||
+				(!cli_listening(ctx) && (int) (now - ctx->output.live_metadata.last) >= METADATA_UPDATE_TIME))) {
 				struct metadata_s live;
 				ctx->output.live_metadata.last = now;
 				uint32_t hash = sq_get_metadata(ctx->self, &live, -1);
@@ -610,7 +651,7 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			}
 		}
 
-		if (wake || now - ctx->slim_run.last > 100 || ctx->slim_run.last > now) {
+		if (wake || (int) (now - ctx->slim_run.next) >= 0) {
 			bool _sendSTMs = false;
 			bool _sendDSCO = false;
 			bool _sendRESP = false;
@@ -626,6 +667,7 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			size_t header_len = 0;
 
 			ctx->slim_run.last = now;
+			ctx->slim_run.next = now + SLIMPROTO_IDLE;
 
 			LOCK_S;
 
@@ -665,6 +707,8 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			ctx->status.ms_played = ctx->render.ms_played;
 			ctx->status.voltage = ctx->voltage;
 			bool output_ready = ctx->output.completed || ctx->output.encode.flow;
+			u32_t remaining = _render_remaining(ctx);
+			bool queue_open = _output_queue_open(ctx);
 
 			// streaming properly started
 			if (ctx->output.track_started) {
@@ -706,7 +750,7 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 
 			LOCK_D;
 
-			if (ctx->decode.state == DECODE_RUNNING && now - ctx->status.last > 1000) {
+			if (ctx->decode.state == DECODE_RUNNING && now - ctx->status.last >= 1000) {
 				_sendSTMt = true;
 				ctx->status.last = now;
 			}
@@ -738,15 +782,20 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			 Streaming services like Deezer or RP plugin close connection if
 			 stalled for too long (30s), so if STMd is sent too early, once the-
 			 outputbuf is filled, connection will be idle for a while, so need
-			 to wait a bit toward the end of the track before sending STMd.
+			 to wait a bit toward the end of the track before sending STMd. The
+			 end is when the player is expected to run out of data, from its
+			 reported position and the tracks queued after the current one.
 			 But when flow mode is used, the stream is regulated by the player
 			 and thus should be continuous, so there is no need to wait toward
-			 the end of the track
+			 the end of the track.
+			 When the player has already pulled tracks queued after the one
+			 playing, there is no need to wait for their STMs either, as long
+			 as all that is queued ends within next_delay
 			*/
 			if (ctx->decode.state == DECODE_ERROR || 
-			    (ctx->decode.state == DECODE_COMPLETE && ctx->canSTMdu && output_ready && 
+			    (ctx->decode.state == DECODE_COMPLETE && (ctx->canSTMdu || queue_open) && output_ready && 
 				(ctx->output.encode.flow || _sendSTMu || !ctx->config.next_delay || !ctx->status.duration || 
-				 ctx->status.duration - ctx->status.ms_played < ctx->config.next_delay * 1000))) {	
+				 remaining < next_delay(ctx)))) {	
 				if (ctx->decode.state == DECODE_COMPLETE) _sendSTMd = true;
 				if (ctx->decode.state == DECODE_ERROR)    _sendSTMn = true;
 				ctx->decode.state = DECODE_STOPPED;
@@ -761,6 +810,26 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 				}
 			}
 
+			/*
+			 Only what is not signalled by a wake needs a deadline: STMt while
+			 decoding, polled metadata and delayed STMd. Players with something
+			 in flight are still checked every second as renderer's progress
+			 (which gates STMd) is not signalled, but idle players sleep until
+			 server's next message.
+			*/
+			if (ctx->decode.state != DECODE_STOPPED || ctx->output.state == OUTPUT_RUNNING ||
+				ctx->status.stream_state > DISCONNECT) {
+				_slimproto_deadline(ctx, now + 1000);
+			}
+
+			if (ctx->decode.state == DECODE_RUNNING) {
+				_slimproto_deadline(ctx, ctx->status.last + 1000);
+			}
+
+			if (ctx->output.live_metadata.enabled && !cli_listening(ctx)) {
+				_slimproto_deadline(ctx, ctx->output.live_metadata.last + METADATA_UPDATE_TIME);
+			}
+
 			UNLOCK_D;
 
 			if (_stream_disconnect) stream_disconnect(ctx);
@@ -772,10 +841,15 @@ static void slimproto_run(struct thread_ctx_s *ctx) {
 			// delay STMd by one round when STMs is pending as well
 			if (_sendSTMs) {
 				sendSTAT("STMs", 0, ctx);
-				if (_sendSTMd) ctx->sendSTMd = true;
+				if (_sendSTMd) {
+					ctx->sendSTMd = true;
+					_slimproto_deadline(ctx, now + 100);
+				}
 			} else if (_sendSTMd || ctx->sendSTMd) {
 				sendSTAT("STMd", 0, ctx);
 				ctx->sendSTMd = false;
+				// next strm will most likely come from the same server
+				stream_preconnect(ctx);
 			}
 			if (_sendSTMu) sendSTAT("STMu", 0, ctx);
 			if (_sendSTMo) sendSTAT("STMo", 0, ctx);
@@ -792,83 +866,208 @@ void wake_controller(struct thread_ctx_s *ctx) {
 	wake_signal(ctx->wake_e);
 }
 
-void discover_server(struct thread_ctx_s *ctx) {
-	struct sockaddr_in d;
-	struct sockaddr_in s;
-	char buf[32], vers[] = "VERS", port[] = "JSON", clip[] = "CLIP";
+/*---------------------------------------------------------------------------*/
+/* one discovery request/answer, on the socket shared by all players		 */
+static bool discovery_query(in_addr_t target, struct discovery_s *answer) {
+	struct sockaddr_in d, s;
+	char buf[32], readbuf[128], *p, vers[] = "VERS", port[] = "JSON", clip[] = "CLIP";
 	struct pollfd pollinfo;
-	u8_t len;
-	int disc_sock = socket(AF_INET, SOCK_DGRAM, 0);
-	socklen_t enable = 1;
-
-	ctx->cli_port = 9090;
-	setsockopt(disc_sock, SOL_SOCKET, SO_BROADCAST, (const void *)&enable, sizeof(enable));
-	len = sprintf(buf,"e%s%c%s%c%s", vers, '\0', port, '\0', clip) + 1;
+	socklen_t slen = sizeof(s);
+	u8_t len = sprintf(buf,"e%s%c%s%c%s", vers, '\0', port, '\0', clip) + 1;
 
 	memset(&d, 0, sizeof(d));
 	d.sin_family = AF_INET;
 	d.sin_port = htons(PORT);
-	if (!ctx->slimproto_ip) {
-		// some systems refuse to broadcast on unbound socket
-		memset(&s, 0, sizeof(s));
-		s.sin_addr.s_addr = sq_local_host.s_addr;
-		s.sin_family = AF_INET;
-		bind(disc_sock, (struct sockaddr*) &s, sizeof(s));
-		d.sin_addr.s_addr = htonl(INADDR_BROADCAST);
-	} else {
-		d.sin_addr.s_addr = ctx->slimproto_ip;
-	}
+	d.sin_addr.s_addr = target ? target : htonl(INADDR_BROADCAST);
 
-	pollinfo.fd = disc_sock;
+	pollinfo.fd = discovery.sock;
 	pollinfo.events = POLLIN;
 
-	do {
-		LOG_DEBUG("[%p] sending discovery", ctx);
-		memset(&s, 0, sizeof(s));
+	LOG_DEBUG("sending discovery to %s", inet_ntoa(d.sin_addr));
+
+	if (sendto(discovery.sock, buf, len, 0, (struct sockaddr *)&d, sizeof(d)) < 0) {
+		LOG_WARN("error sending discovery");
+	}
+
+	if (poll(&pollinfo, 1, 5000) != 1) return false;
+
+	memset(&s, 0, sizeof(s));
+	memset(readbuf, 0, sizeof(readbuf));
+	recvfrom(discovery.sock, readbuf, sizeof(readbuf) - 1, 0, (struct sockaddr *)&s, &slen);
+
+	// late answer to somebody else's broadcast
+	if (!s.sin_addr.s_addr || (target && s.sin_addr.s_addr != target)) return false;
+
+	memset(answer, 0, sizeof(struct discovery_s));
+	answer->cli_port = 9090;
 
-		if (sendto(disc_sock, buf, len, 0, (struct sockaddr *)&d, sizeof(d)) < 0) {
-			LOG_WARN("[%p] error sending discovery", ctx);
+	if ((p = strstr(readbuf, vers)) != NULL) {
+		p += strlen(vers);
+		strncpy(answer->version, p + 1, min(SERVER_VERSION_LEN, *p));
+	}
+
+	if ((p = strstr(readbuf, port)) != NULL) {
+		p += strlen(port);
+		strncpy(answer->port, p + 1, min(5, *p));
+	}
+
+	if ((p = strstr(readbuf, clip)) != NULL) {
+		p += strlen(clip);
+		answer->cli_port = atoi(p + 1);
+	}
+
+	answer->target = target;
+	answer->addr = s;
+	answer->time = gettime_ms();
+
+	LOG_DEBUG("got response from: %s:%d", inet_ntoa(s.sin_addr), ntohs(s.sin_port));
+	return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/* (mutex locked)																 */
+static struct discovery_s *_discovery_find(in_addr_t target) {
+	int i;
+
+	for (i = 0; i < DISCOVERY_CACHE; i++) {
+		if (discovery.cache[i].time && discovery.cache[i].target == target) return discovery.cache + i;
+	}
+
+	return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* (mutex locked)																 */
+static struct discovery_s *_discovery_store(struct discovery_s *answer) {
+	struct discovery_s *entry = _discovery_find(answer->target);
+	int i;
+
+	// use a free slot or replace the oldest answer
+	for (i = 0; !entry && i < DISCOVERY_CACHE; i++) {
+		if (!discovery.cache[i].time) entry = discovery.cache + i;
+	}
+
+	if (!entry) {
+		for (entry = discovery.cache, i = 1; i < DISCOVERY_CACHE; i++) {
+			if ((int) (discovery.cache[i].time - entry->time) < 0) entry = discovery.cache + i;
 		}
+	}
 
-		if (poll(&pollinfo, 1, 5000) == 1) {
-			char readbuf[128], *p;
+	*entry = *answer;
+	discovery.gen++;
 
-			socklen_t slen = sizeof(s);
-			memset(readbuf, 0, sizeof(readbuf));
-			recvfrom(disc_sock, readbuf, sizeof(readbuf) - 1, 0, (struct sockaddr *)&s, &slen);
+	return entry;
+}
 
-			if ((p = strstr(readbuf, vers)) != NULL) {
-				p += strlen(vers);
-				strncpy(ctx->server_version, p + 1, min(SERVER_VERSION_LEN, *p));
-				ctx->server_version[min(SERVER_VERSION_LEN, *p)] = '\0';
-			}
+/*---------------------------------------------------------------------------*/
+/*
+ Discovery is shared by all players: only one of them sends a request at a
+ time while others wait for its answer, and an answer is reused by everybody
+ asking the same question for DISCOVERY_TTL. So when a server restarts, all
+ its players do not each broadcast and wait on their own.
+*/
+void discover_server(struct thread_ctx_s *ctx) {
+	in_addr_t target = ctx->slimproto_ip;
+	struct discovery_s *entry = NULL, answer;
 
-			 if ((p = strstr(readbuf, port)) != NULL) {
-				p += strlen(port);
-				strncpy(ctx->server_port, p + 1, min(5, *p));
-				ctx->server_port[min(6, *p)] = '\0';
-			}
+	mutex_lock(discovery.mutex);
 
-			 if ((p = strstr(readbuf, clip)) != NULL) {
-				p += strlen(clip);
-				ctx->cli_port = atoi(p + 1);
-			}
+	while (ctx->running) {
+		// somebody got that answer recently
+		if ((entry = _discovery_find(target)) != NULL && gettime_ms() - entry->time < DISCOVERY_TTL) break;
+
+		// somebody is already asking, wait for the answer
+		if (discovery.busy) {
+			mutex_unlock(discovery.mutex);
+			usleep(50*1000);
+			mutex_lock(discovery.mutex);
+			continue;
+		}
+
+		discovery.busy = true;
+		mutex_unlock(discovery.mutex);
+
+		LOG_DEBUG("[%p] sending discovery", ctx);
+		entry = discovery_query(target, &answer) ? &answer : NULL;
+
+		mutex_lock(discovery.mutex);
+		discovery.busy = false;
 
-			strcpy(ctx->server_ip, inet_ntoa(s.sin_addr));
-			LOG_DEBUG("[%p] got response from: %s:%d", ctx, inet_ntoa(s.sin_addr), ntohs(s.sin_port));
+		if (entry) {
+			entry = _discovery_store(&answer);
+			break;
 		}
-	} while (s.sin_addr.s_addr == 0 && ctx->running);
+	}
+
+	ctx->cli_port = 9090;
 
-	closesocket(disc_sock);
+	if (entry && ctx->running) {
+		strcpy(ctx->server_version, entry->version);
+		strcpy(ctx->server_port, entry->port);
+		strcpy(ctx->server_ip, inet_ntoa(entry->addr.sin_addr));
+		ctx->cli_port = entry->cli_port;
+		ctx->serv_addr = entry->addr;
+	} else memset(&ctx->serv_addr, 0, sizeof(ctx->serv_addr));
 
-	ctx->slimproto_ip =  s.sin_addr.s_addr;
-	ctx->slimproto_port = ntohs(s.sin_port);
+	mutex_unlock(discovery.mutex);
 
-	ctx->serv_addr.sin_port = s.sin_port;
-	ctx->serv_addr.sin_addr.s_addr = s.sin_addr.s_addr;
+	ctx->slimproto_ip =  ctx->serv_addr.sin_addr.s_addr;
+	ctx->slimproto_port = ntohs(ctx->serv_addr.sin_port);
 	ctx->serv_addr.sin_family = AF_INET;
 }
 
+/*---------------------------------------------------------------------------*/
+/* wait before retrying a server, but not when another player got through	 */
+static void discovery_wait(struct thread_ctx_s *ctx, u32_t duration) {
+	u32_t gen = discovery.gen, start = gettime_ms();
+
+	while (ctx->running && gen == discovery.gen && gettime_ms() - start < duration) {
+		usleep(100*1000);
+	}
+}
+
+/*---------------------------------------------------------------------------*/
+/* a player is connected, let others waiting to retry that server try now	 */
+static void discovery_connected(struct thread_ctx_s *ctx) {
+	int i;
+
+	mutex_lock(discovery.mutex);
+
+	for (i = 0; i < DISCOVERY_CACHE; i++) {
+		struct discovery_s *entry = discovery.cache + i;
+		if (entry->time && entry->addr.sin_addr.s_addr == ctx->serv_addr.sin_addr.s_addr) entry->time = gettime_ms();
+	}
+
+	discovery.gen++;
+	mutex_unlock(discovery.mutex);
+}
+
+/*---------------------------------------------------------------------------*/
+void slimproto_init(void) {
+	struct sockaddr_in addr;
+	socklen_t enable = 1;
+
+	mutex_create(discovery.mutex);
+	memset(discovery.cache, 0, sizeof(discovery.cache));
+	discovery.busy = false;
+	discovery.gen = 0;
+
+	discovery.sock = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(discovery.sock, SOL_SOCKET, SO_BROADCAST, (const void *)&enable, sizeof(enable));
+
+	// some systems refuse to broadcast on unbound socket
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_addr.s_addr = sq_local_host.s_addr;
+	addr.sin_family = AF_INET;
+	bind(discovery.sock, (struct sockaddr*) &addr, sizeof(addr));
+}
+
+/*---------------------------------------------------------------------------*/
+void slimproto_end(void) {
+	closesocket(discovery.sock);
+	mutex_destroy(discovery.mutex);
+}
+
 /*---------------------------------------------------------------------------*/
 static void slimproto(struct thread_ctx_s *ctx) {
 	bool reconnect = false;
@@ -896,7 +1095,7 @@ static void slimproto(struct thread_ctx_s *ctx) {
 		if (tcp_connect_timeout(ctx->sock, ctx->serv_addr, 5*1000) != 0) {
 
 			LOG_WARN("[%p] unable to connect to server %u", ctx, failed_connect);
-			sleep(5);
+			discovery_wait(ctx, 5*1000);
 
 			// rediscover server if it was not set at startup
 			if (!strcmp(ctx->config.server, "?") && ++failed_connect > 5) {
@@ -907,6 +1106,7 @@ static void slimproto(struct thread_ctx_s *ctx) {
 		} else {
 
 			LOG_INFO("[%p] connected", ctx);
+			discovery_connected(ctx);
 
 			ctx->var_cap[0] = '\0';
 			failed_connect = 0;
@@ -929,12 +1129,6 @@ static void slimproto(struct thread_ctx_s *ctx) {
 			usleep(100000);
 		}
 
-		mutex_lock(ctx->cli_mutex);
-		if (ctx->cli_sock != -1) {
-			closesocket(ctx->cli_sock);
-			ctx->cli_sock = -1;
-		}
-		mutex_unlock(ctx->cli_mutex);
 		closesocket(ctx->sock);
 
 		if (ctx->new_server_cap)	{
@@ -952,7 +1146,7 @@ void slimproto_close(struct thread_ctx_s *ctx) {
 	wake_controller(ctx);
 	pthread_join(ctx->thread, NULL);
 	mutex_destroy(ctx->mutex);
-	mutex_destroy(ctx->cli_mutex);
+	metadata_free(&ctx->prefetch.metadata);
 	metadata_free(&ctx->output.metadata);
 }
 
@@ -963,11 +1157,13 @@ void slimproto_thread_init(struct thread_ctx_s *ctx) {
 
 	wake_create(ctx->wake_e);
 	mutex_create(ctx->mutex);
-	mutex_create(ctx->cli_mutex);
 
 	ctx->slimproto_ip = 0;
 	ctx->slimproto_port = PORT;
-	ctx->cli_sock = ctx->sock = -1;
+	ctx->prefetch.gen = ctx->prefetch.requested = 0;
+	ctx->prefetch.valid = false;
+	metadata_init(&ctx->prefetch.metadata);
+	ctx->sock = -1;
 	ctx->running = true;
 
 	if (strcmp(ctx->config.server, "?")) {
@@ -1023,8 +1219,8 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 	output context
 	*/
 
-	// get metadata - they must be freed by callee whenever he wants
-	uint32_t hash = sq_get_metadata(ctx->self, &info.metadata, info.offset);
+	// get metadata (prefetched if possible) - they must be freed by callee whenever he wants
+	uint32_t hash = metadata_get(ctx, &info.metadata, info.offset);
 
 	// skip tracks that are too short
 	if (info.offset && info.metadata.duration && info.metadata.duration < SHORT_TRACK) {
@@ -1033,6 +1229,12 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 		return false;
 	}
 
+	// let controller persist what we have learnt of player's buffer (when it moved enough)
+	if (abs((int) ctx->config.learned_buffer - (int) out->buffer_notified) > (int) out->buffer_notified / 4) {
+		out->buffer_notified = ctx->config.learned_buffer;
+		ctx->callback(ctx->MR, SQ_SETBUFFER, out->buffer_notified);
+	}
+
 	LOCK_O;
 	// do a deep copy of these metadata for self
 	metadata_clone(&info.metadata, &out->metadata);
@@ -1046,6 +1248,7 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 	// get live metadata when track repeats or have no duration (livestream)
 	out->live_metadata.enabled = !out->duration || info.metadata.repeating != -1;
 	out->live_metadata.last = now;
+	out->live_metadata.update = false;
 	out->live_metadata.hash = out->live_metadata.enabled ? 0 : hash;
 	UNLOCK_O;
 
@@ -1081,6 +1284,14 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 		out->encode.mode = ENCODE_THRU;
 	}	
 
+	// step encoding down/up depending on how fast player pulled previous tracks
+	if (strcasestr(mode, "adapt") && !strcasestr(mode, "flow") && out->encode.mode >= ENCODE_PCM) {
+		// a draining output thread records its pull rate under LOCK_O
+		LOCK_O;
+		out->encode.mode = adapt_mode(out->encode.mode, ctx);
+		UNLOCK_O;
+	}
+
 	// force read of re-encoding parameters
 	if ((p = strcasestr(mode, "r:")) != NULL) sample_rate = atoi(p+2);
 	else sample_rate = 0;
@@ -1254,3 +1465,129 @@ static bool process_start(u8_t format, u32_t rate, u8_t size, u8_t channels, u8_
 
 	return ret;
 }
+
+/*---------------------------------------------------------------------------*/
+static u32_t _render_remaining(struct thread_ctx_s *ctx) {
+	u32_t horizon = ctx->render.duration, queued = 0;
+	int i;
+
+	/*
+	Estimate how much audio is left in player before it runs dry: the rest of
+	current track and all tracks queued after it. What has been delivered is
+	not a bound as the remainder is still in our outputbuf and will be pulled
+	by player, so it only stands for queued tracks of unknown duration
+	*/
+	for (i = 0; i < MAX_OUTPUT_THREADS; i++) {
+		struct output_thread_s *thread = ctx->output_thread + i;
+		if (thread->index == -1 || thread->index == ctx->render.index) continue;
+		if (ctx->render.index != -1 &&
+			(u16_t) (thread->index - ctx->render.index) < MAX_OUTPUT_THREADS &&
+			(u16_t) (ctx->output.index - thread->index) < MAX_OUTPUT_THREADS) {
+			queued += thread->duration ? thread->duration : thread->delivered;
+		}
+	}
+
+	return (horizon > ctx->render.ms_played ? horizon - ctx->render.ms_played : 0) + queued;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _output_queue_open(struct thread_ctx_s *ctx) {
+	u16_t ahead = ctx->output.index - ctx->render.index;
+	int i;
+
+	/*
+	Another track can be requested before the latest has started when the
+	current one has, no more than MAX_OUTPUT_THREADS - 2 are already queued
+	after it and there is a thread to send the new one
+	*/
+	if (ctx->output.encode.flow || ctx->render.index == -1 || ctx->render.state != RD_PLAYING ||
+		ctx->render.started != ctx->render.index || !ahead || ahead > MAX_OUTPUT_THREADS - 2) {
+		return false;
+	}
+
+	for (i = 0; i < MAX_OUTPUT_THREADS && ctx->output_thread[i].running; i++);
+
+	return i < MAX_OUTPUT_THREADS;
+}
+
+/*---------------------------------------------------------------------------*/
+static u32_t next_delay(struct thread_ctx_s *ctx) {
+	// how long before player runs dry, defaults to legacy setting
+	u32_t delay = (ctx->config.next_lead > 0 ? ctx->config.next_lead : ctx->config.next_delay) * 1000;
+
+	/*
+	Players that read far ahead need next track a bit before they would have
+	exhausted the current one, but don't ask too early as LMS streaming might
+	then be stalled for too long
+	*/
+	if (ctx->config.learned_buffer + NEXT_MARGIN > delay) {
+		delay = min(ctx->config.learned_buffer + NEXT_MARGIN, delay * 2);
+	}
+
+	return delay;
+}
+
+#if CODECS
+/*---------------------------------------------------------------------------*/
+static bool adapt_supported(encode_mode mode, struct thread_ctx_s *ctx) {
+	char *mimetype;
+
+	if (mode == ENCODE_PCM) return true;
+
+	mimetype = mimetype_from_codec(mode == ENCODE_FLAC ? 'f' : 'm', ctx->mimetypes, NULL);
+	if (!mimetype) return false;
+
+	free(mimetype);
+	return true;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+// called with O locked, output threads update pull rate history
+static encode_mode adapt_mode(encode_mode top, struct thread_ctx_s *ctx) {
+#if CODECS
+	struct outputstate *out = &ctx->output;
+	encode_mode mode = out->adapt.mode, next;
+	int i, last;
+
+	// configured mode is the best we can do (PCM < FLAC < MP3)
+	if (mode < top) mode = top;
+	if (!out->adapt.count) return out->adapt.mode = mode;
+
+	last = (out->adapt.count - 1) % ADAPT_HISTORY;
+
+	if (out->adapt.history[last].mode == mode &&
+		(u64_t) out->adapt.history[last].peak * 100 < (u64_t) out->adapt.need[mode] * ADAPT_DOWN) {
+		// player could not even pull previous track at real-time rate
+		for (next = mode + 1; next <= ENCODE_MP3 && !adapt_supported(next, ctx); next++);
+		if (next <= ENCODE_MP3) {
+			LOG_WARN("[%p]: pulled %u B/s, need %u B/s, stepping down encoding %d => %d", ctx,
+					  out->adapt.history[last].peak, out->adapt.need[mode], mode, next);
+			out->adapt.count = 0;
+			mode = next;
+		}
+	} else if (mode > top && out->adapt.count >= ADAPT_HISTORY) {
+		u32_t need;
+
+		for (next = mode - 1; next > top && !adapt_supported(next, ctx); next--);
+
+		// rough guess when that mode has never been used (PCM ~ 2xFLAC ~ 8xMP3)
+		if (out->adapt.need[next]) need = out->adapt.need[next];
+		else need = out->adapt.need[mode] * (mode == ENCODE_MP3 ? 4 : 2);
+
+		// all recent tracks could have been pulled with enough margin
+		for (i = 0; i < ADAPT_HISTORY && (u64_t) out->adapt.history[i].peak * 100 > (u64_t) need * ADAPT_UP; i++);
+
+		if (i == ADAPT_HISTORY) {
+			LOG_INFO("[%p]: pulled at least %u B/s, need %u B/s, stepping up encoding %d => %d", ctx,
+					  need * ADAPT_UP / 100, need, mode, next);
+			out->adapt.count = 0;
+			mode = next;
+		}
+	}
+
+	return out->adapt.mode = mode;
+#else
+	return top;
+#endif
+}
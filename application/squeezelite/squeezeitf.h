@@ -21,7 +21,7 @@
 
 typedef enum {SQ_NONE, SQ_SET_TRACK, SQ_PLAY, SQ_TRANSITION, SQ_PAUSE, SQ_UNPAUSE,
 			  SQ_STOP, SQ_VOLUME, SQ_MUTE, SQ_TIME, SQ_TRACK_INFO, SQ_ONOFF, SQ_NEW_METADATA,
-			  SQ_NEXT, SQ_SETNAME, SQ_SETSERVER, SQ_BATTERY, SQ_NEXT_FAILED} sq_action_t;
+			  SQ_NEXT, SQ_SETNAME, SQ_SETSERVER, SQ_BATTERY, SQ_NEXT_FAILED, SQ_SETBUFFER} sq_action_t;
 typedef enum { ICY_NONE, ICY_FULL, ICY_TEXT } sq_icy_e;
 typedef enum { L24_PACKED, L24_PACKED_LPCM, L24_TRUNC16, L24_TRUNC16_PCM, L24_UNPACKED_HIGH, L24_UNPACKED_LOW } sq_L24_pack_t;
 typedef enum { FLAC_NO_HEADER = 0, FLAC_DEFAULT_HEADER = 1, FLAC_MAX_HEADER = 2, FLAC_ADJUST_HEADER } sq_flac_header_t;
@@ -36,6 +36,7 @@ typedef	struct sq_dev_param_s {
 	char		codecs[STR_LEN];
 	char		mode[STR_LEN];
 	int			next_delay;
+	int			next_lead;			// s before player runs dry to get next track, 0 = next_delay
 	char 		raw_audio_format[STR_LEN];
 	char		server[STR_LEN];
 	uint32_t 	sample_rate;
@@ -49,6 +50,7 @@ typedef	struct sq_dev_param_s {
 	bool		roon_mode;
 	char		store_prefix[STR_LEN];
 	char		coverart[STR_LEN];
+	uint32_t	learned_buffer;		// how far ahead player reads (ms), 0 = unknown
 	// set at runtime, not from config
 	struct {
 		bool	 use_cli;
@@ -67,7 +69,7 @@ struct track_param
 
 typedef bool (*sq_callback_t)(void *caller, sq_action_t action, ...);
 
-void				sq_init(struct in_addr host, uint16_t port, char *model_name);
+void				sq_init(struct in_addr host, uint16_t port, char *model_name, uint32_t bandwidth, unsigned reactors, unsigned players);
 void				sq_stop(void);
 
 // only name cannot be NULL
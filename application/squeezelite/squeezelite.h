@@ -259,6 +259,8 @@ void 		buf_destroy(struct buffer *buf);
 bool 		_buf_reset(struct buffer *buf);
 
 // slimproto.c
+void 		slimproto_init(void);
+void 		slimproto_end(void);
 void 		slimproto_close(struct thread_ctx_s *ctx);
 void 		slimproto_reset(struct thread_ctx_s *ctx);
 void 		slimproto_thread_init(struct thread_ctx_s *ctx);
@@ -266,9 +268,27 @@ void 		wake_controller(struct thread_ctx_s *ctx);
 void 		send_packet(u8_t *packet, size_t len, sockfd sock);
 void 		wake_controller(struct thread_ctx_s *ctx);
 
+// cli.c
+struct cli_tag_s {
+	char *key, *value;
+};
+
+typedef void (*cli_callback_t)(char *rsp, void *data, struct thread_ctx_s *ctx);	// rsp may be NULL, callee must free it
+void 		cli_init(void);
+void 		cli_end(void);
+void 		cli_detach(struct thread_ctx_s *ctx);
+bool 		cli_listening(struct thread_ctx_s *ctx);
+bool 		cli_send(struct thread_ctx_s *ctx, char *cmd, bool req, bool decode, cli_callback_t callback, void *data);
+char*		cli_send_cmd(char *cmd, bool req, bool decode, struct thread_ctx_s *ctx);
+int 		cli_tokenize(char *rsp, struct cli_tag_s **tags);
+
+// main.c
+void 		metadata_prefetch(struct thread_ctx_s *ctx);
+uint32_t 	metadata_get(struct thread_ctx_s *ctx, struct metadata_s *metadata, int offset);
+
 // stream.c
 typedef enum { STOPPED = 0, DISCONNECT, STREAMING_WAIT,
-			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, SEND_HEADERS, RECV_HEADERS } stream_state;
+			   STREAMING_BUFFERING, STREAMING_FILE, STREAMING_HTTP, SEND_HEADERS, RECV_HEADERS, CONNECTING } stream_state;
 typedef enum { DISCONNECT_OK = 0, LOCAL_DISCONNECT = 1, REMOTE_DISCONNECT = 2, UNREACHABLE = 3, TIMEOUT = 4 } disconnect_code;
 
 struct streamstate {
@@ -288,6 +308,22 @@ struct streamstate {
 	u32_t meta_left;
 	bool  meta_send;
 	size_t header_mlen;
+	struct {				// received ahead of where it belongs (body after headers ...)
+		u8_t *buf;
+		size_t len, pos;
+	} carry;
+	bool use_ssl;
+	u32_t deadline;			// to complete connection
+	struct {				// connection opened ahead for next stream
+		sockfd fd;
+		struct sockaddr_in addr;
+		u32_t time;
+	} spare;
+	struct {				// when served by a reactor instead of stream thread
+		int id;				// -1 = own stream thread
+		int fd;				// socket watched by reactor
+		u32_t events;
+	} reactor;
 	struct sockaddr_in addr;
 	char host[256];
 	struct {
@@ -299,12 +335,15 @@ struct streamstate {
 	} strm;
 };
 
+void 		stream_init(unsigned reactors);
+void 		stream_end(void);
 bool 		stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx);
 void 		stream_close(struct thread_ctx_s *ctx);
 void 		stream_file(const char *header, size_t header_len, unsigned threshold, struct thread_ctx_s *ctx);
 void 		stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t header_len, unsigned threshold, 
 						bool cont_wait, struct thread_ctx_s *ctx);
 bool 		stream_disconnect(struct thread_ctx_s *ctx);
+void 		stream_preconnect(struct thread_ctx_s *ctx);
 
 // decode.c
 typedef enum { DECODE_STOPPED = 0, DECODE_READY, DECODE_RUNNING, DECODE_COMPLETE, DECODE_ERROR } decode_state;
@@ -389,6 +428,16 @@ void 		resample_end(struct thread_ctx_s *ctx);
 // real value is 576x2=1152 samples@44100kHz = 26.122 ms but we want a bit more blocks
 #define MP3_SILENCE_DURATION 26
 
+// bandwidth adaptation (pull rate measured by windows, in % of real-time rate)
+#define ADAPT_HISTORY	4
+#define ADAPT_WINDOW	1000
+#define ADAPT_DOWN		100
+#define ADAPT_UP		300
+
+// learned player's buffer: min read-ahead kept in obuf for live streams
+#define OBUF_AHEAD_MIN	(64*1024)
+#define OBUF_AHEAD_MAX	(512*1024)
+
 typedef enum { OUTPUT_OFF = -1, OUTPUT_STOPPED = 0, OUTPUT_WAITING,
 			   OUTPUT_RUNNING } output_state;
 
@@ -399,11 +448,21 @@ typedef enum { FADE_NONE = 0, FADE_CROSSFADE, FADE_IN, FADE_OUT, FADE_INOUT } fa
 typedef enum { ENCODE_THRU, ENCODE_NULL, ENCODE_PCM, ENCODE_FLAC, ENCODE_MP3 } encode_mode;
 
 // parameters for the output management thread
+#define MAX_OUTPUT_THREADS	4		// current track + queued ones in player
+
 struct output_thread_s {
 		bool			running;
 		thread_type 	thread;
 		int				http;			// listening socket of http server
 		int 			index;
+		u32_t			duration;		// of the track it sends (0 = unknown)
+		u32_t			delivered;		// ms of audio sent to player (0 = unknown)
+		struct {						// share of outbound bandwidth
+			u32_t		floor;			// guaranteed rate (bytes/s)
+			s64_t		credit;			// bytes that can be sent from floor
+			u32_t		last;			// last refill of credit
+			u32_t		throttled;		// total time waiting for credit (ms)
+		} share;
 };
 
 // info for the track being sent to the http renderer (not played)
@@ -432,6 +491,7 @@ struct outputstate {
 	struct {
 		u32_t hash, last;
 		bool enabled;
+		bool update;		// LMS notified a change (set by CLI thread)
 	} live_metadata;
 	// for icy data
 	struct {
@@ -469,6 +529,17 @@ struct outputstate {
 		u8_t	*buffer;	// interim codec buffer (optional)
 		size_t	count;		// # of *frames* in buffer or # of silence blocks to send (null mode)
 	} encode;				// format of what being sent to player
+	u32_t	buffer_notified;	// learned player buffer last sent to controller
+	// renderer's pull rate history, when "adapt" is set in mode
+	struct {
+		encode_mode mode;	// mode used for next track (thru = not set)
+		u32_t	need[ENCODE_MP3 + 1];	// last real-time rate for each mode (bytes/s)
+		struct {
+			encode_mode mode;
+			u32_t	peak;	// best pull rate over a window (bytes/s)
+		} history[ADAPT_HISTORY];
+		int		count;
+	} adapt;
 };
 
 // http renderer state (track being played)
@@ -480,6 +551,7 @@ struct renderstate {
 	u32_t 	track_pause_time; // timestamp when the track was paused
 	u32_t	track_start_time; // timestamp when the track started
 	int     index;    		// current track index in player (-1 = unknown)
+	int		started;		// last track index signaled as started
 };
 
 // function starting with _ must be called with mutex locked
@@ -501,6 +573,7 @@ void 		output_flush(struct thread_ctx_s *ctx);
 bool		output_start(struct thread_ctx_s *ctx);
 bool 		output_abort(struct thread_ctx_s *ctx, int index);
 void 		wake_output(struct thread_ctx_s *ctx);
+void		output_share_init(u32_t rate);
 
 /***************** main thread context**************/
 typedef struct {
@@ -522,7 +595,7 @@ typedef enum {TRACK_STOPPED = 0, TRACK_STARTED, TRACK_PAUSED} track_status_t;
 
 #define PLAYER_NAME_LEN 64
 #define SERVER_VERSION_LEN	32
-#define MAX_PLAYER		32
+#define MAX_PLAYER		32			// default, actual count is given to sq_init
 #define MAX_MIMETYPES	128
 
 struct thread_ctx_s {
@@ -558,16 +631,16 @@ struct thread_ctx_s {
 	char		server_port[5+1];
 	char		server_ip[4*(3+1)+1];
 	u16_t		cli_port;
-	sockfd 		sock, fd, cli_sock;
+	sockfd 		sock, fd;
 #if USE_SSL
 	void		*ssl;  			// void to no include openssl headers
 	bool		ssl_error;
+	short		ssl_want;		// poll events needed to move handshake forward
+	bool		ssl_optional;	// handshake can fail back to plain socket
 #endif
 	u16_t		voltage;
 	char		cli_id[18];		// (6*2)+(5*':')+NULL
-	mutex_type	cli_mutex;
-	u32_t		cli_timeout;
-	struct output_thread_s output_thread[2];
+	struct output_thread_s output_thread[MAX_OUTPUT_THREADS];
 	bool 		decode_running, stream_running;
 	thread_type	decode_thread, stream_thread;
 	struct sockaddr_in serv_addr;
@@ -575,15 +648,23 @@ struct thread_ctx_s {
 	event_event	wake_e;
 	struct 	{				// scratch memory for slimprot_run (was static)
 		 u8_t 	buffer[MAXBUF];
-		 u32_t	last;
+		 u32_t	last, next;		// last status pass and when next one is due
 		 char	header[MAX_HEADER];
 	} slim_run;
+	struct {				// next track's metadata, fetched when LMS playlist changes
+		u32_t	gen;		// playlist change notifications (set by CLI thread)
+		u32_t	requested, fetched;
+		bool	valid;
+		u32_t	hash;
+		struct metadata_s metadata;
+	} prefetch;
 	sq_callback_t	callback;
 	void			*MR;
 	u8_t 	last_command;
 };
 
-extern struct thread_ctx_s 	thread_ctx[MAX_PLAYER];
+extern struct thread_ctx_s 	*thread_ctx;
+extern unsigned				max_players;
 extern struct in_addr		sq_local_host;
 extern u16_t 				sq_local_port;
 extern char  				sq_model_name[];
@@ -620,8 +701,8 @@ void deregister_soxr(void);
 The whole process includes receiving from LMS into streambuf, then either
 passthrough to outputbuf when no decoding is involved or decoding into outpufbuf
 in 32 bits 2 channels samples in platform's native endianness
-There a single outputbuf and state, but up to two thread to send it to the
-player due UPnP gapless feature ( two track in semi-parallel)
+There a single outputbuf and state, but up to MAX_OUTPUT_THREADS threads to send
+it to the player due UPnP gapless feature (tracks in semi-parallel)
 The outputbuf is transferred to a local small http buffer before it's actually
 send to the player. When decoder / re-encoding is used, that buffer contains
 the reformated audio (truncation, coding, swapping, gain ...)
@@ -654,5 +735,12 @@ will, at some point (unknown, depends on the implementation) get the data using
 http. Depending how fast the UPnP player implements gapless, then there might be
 a small period of time where both thread will work in parallel, once doing full
 processing, the other one just sending what's left (draining) in http buffer.
+With short tracks, the player may have pulled the whole next track before the
+current one has finished. As long as all that is queued in the player ends
+within next_delay, STMd can be sent again without waiting for STMs, so that LMS
+is requested for tracks N+2 and beyond while N is still playing. Only one thread
+is ever in running state, the others are draining or done and keep the index
+and duration of their track so that the renderer can be tracked when it moves
+to one of these.
 */
 
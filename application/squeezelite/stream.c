@@ -30,6 +30,11 @@
 #include "openssl/err.h"
 #endif
 
+#if LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 extern log_level	stream_loglevel;
 static log_level 	*loglevel = &stream_loglevel;
 
@@ -38,9 +43,99 @@ static log_level 	*loglevel = &stream_loglevel;
 
 #if USE_SSL
 
+#define SSL_SESSIONS	16
+
 static SSL_CTX *SSLctx = NULL;
 static int SSLcount = 0;
 
+/*
+Client sessions are kept by host so that next tracks from the same service
+resume instead of doing a full handshake
+*/
+static struct {
+	mutex_type	mutex;
+	unsigned	next;
+	struct {
+		char		host[256];
+		SSL_SESSION *session;
+	} items[SSL_SESSIONS];
+} SSLsessions;
+
+static char *ssl_host(struct thread_ctx_s *ctx) {
+	return *ctx->stream.host ? ctx->stream.host : inet_ntoa(ctx->stream.addr.sin_addr);
+}
+
+static int ssl_new_session(SSL *ssl, SSL_SESSION *session) {
+	struct thread_ctx_s *ctx = SSL_get_app_data(ssl);
+	char *host = ssl_host(ctx);
+	int i;
+
+	mutex_lock(SSLsessions.mutex);
+
+	for (i = 0; i < SSL_SESSIONS && strcmp(SSLsessions.items[i].host, host); i++);
+
+	// replace session of that host or the oldest one
+	if (i == SSL_SESSIONS) {
+		i = SSLsessions.next;
+		SSLsessions.next = (SSLsessions.next + 1) % SSL_SESSIONS;
+		strncpy(SSLsessions.items[i].host, host, sizeof(SSLsessions.items[i].host) - 1);
+	}
+
+	if (SSLsessions.items[i].session) SSL_SESSION_free(SSLsessions.items[i].session);
+	SSLsessions.items[i].session = session;
+
+	mutex_unlock(SSLsessions.mutex);
+
+	// we keep the reference
+	return 1;
+}
+
+static void ssl_resume(struct thread_ctx_s *ctx) {
+	char *host = ssl_host(ctx);
+	int i;
+
+	mutex_lock(SSLsessions.mutex);
+
+	for (i = 0; i < SSL_SESSIONS; i++) {
+		if (SSLsessions.items[i].session && !strcmp(SSLsessions.items[i].host, host)) {
+			SSL_set_session(ctx->ssl, SSLsessions.items[i].session);
+			break;
+		}
+	}
+
+	mutex_unlock(SSLsessions.mutex);
+}
+
+static void ssl_acquire(void) {
+	if (!SSLctx) {
+		SSLctx = SSL_CTX_new(SSLv23_client_method());
+		if (SSLctx) {
+			SSL_CTX_set_options(SSLctx, SSL_OP_NO_SSLv2);
+			SSL_CTX_set_session_cache_mode(SSLctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(SSLctx, ssl_new_session);
+		}
+		mutex_create(SSLsessions.mutex);
+	}
+	SSLcount++;
+}
+
+static void ssl_release(void) {
+	int i;
+
+	if (--SSLcount) return;
+
+	SSL_CTX_free(SSLctx);
+	SSLctx = NULL;
+
+	for (i = 0; i < SSL_SESSIONS; i++) {
+		if (SSLsessions.items[i].session) SSL_SESSION_free(SSLsessions.items[i].session);
+		SSLsessions.items[i].session = NULL;
+		*SSLsessions.items[i].host = '\0';
+	}
+
+	mutex_destroy(SSLsessions.mutex);
+}
+
 static int _last_error(struct thread_ctx_s* ctx) {
 	if (!ctx->ssl) return last_error();
 	return ctx->ssl_error ? ECONNABORTED : ERROR_WOULDBLOCK;
@@ -91,6 +186,86 @@ static int _poll(struct thread_ctx_s *ctx, struct pollfd *pollinfo, int timeout)
 #define _last_error(x) last_error()
 #endif
 
+/*
+Headers and icy metadata are read in bulk, so what is received beyond them is
+kept aside and served first to whoever reads the stream next
+*/
+static int _recv_carry(struct thread_ctx_s *ctx, void *buffer, size_t bytes) {
+	size_t n = ctx->stream.carry.len - ctx->stream.carry.pos;
+
+	if (!n) return _recv(ctx, buffer, bytes, 0);
+
+	n = min(n, bytes);
+	memcpy(buffer, ctx->stream.carry.buf + ctx->stream.carry.pos, n);
+	ctx->stream.carry.pos += n;
+	if (ctx->stream.carry.pos == ctx->stream.carry.len) ctx->stream.carry.pos = ctx->stream.carry.len = 0;
+
+	return n;
+}
+
+static void _unrecv(struct thread_ctx_s *ctx, void *buffer, size_t bytes) {
+	// what was just served from carry is still there, otherwise carry is empty
+	if (ctx->stream.carry.pos >= bytes) {
+		ctx->stream.carry.pos -= bytes;
+	} else {
+		memcpy(ctx->stream.carry.buf, buffer, bytes);
+		ctx->stream.carry.pos = 0;
+		ctx->stream.carry.len = bytes;
+	}
+}
+
+#if LINUX
+/*
+Optional reactors serving the LMS stream sockets of all players with epoll
+instead of one stream thread per player. A reactor sleeps as long as none of
+its players streams, is woken up by new streams and only checks every 100ms
+the ones that can't take data for now (full buffer, waiting for cont)
+*/
+#define MAX_REACTORS	4
+
+static struct reactor_s {
+	thread_type	thread;
+	mutex_type	mutex;
+	int			efd, wake;
+	bool		running;
+	struct thread_ctx_s **ctx;
+} reactors[MAX_REACTORS];
+
+static unsigned reactor_count;
+
+static void _reactor_watch(struct thread_ctx_s *ctx, int fd, u32_t events) {
+	struct reactor_s *reactor;
+	struct epoll_event event;
+
+	if (ctx->stream.reactor.id < 0 || (fd == ctx->stream.reactor.fd && events == ctx->stream.reactor.events)) return;
+
+	reactor = reactors + ctx->stream.reactor.id;
+
+	if (ctx->stream.reactor.fd >= 0 && ctx->stream.reactor.fd != fd) {
+		epoll_ctl(reactor->efd, EPOLL_CTL_DEL, ctx->stream.reactor.fd, NULL);
+	}
+
+	if (fd >= 0) {
+		event.events = events;
+		event.data.ptr = ctx;
+		epoll_ctl(reactor->efd, fd == ctx->stream.reactor.fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+	}
+
+	ctx->stream.reactor.fd = fd;
+	ctx->stream.reactor.events = events;
+}
+
+static void reactor_wake(struct thread_ctx_s *ctx) {
+	if (ctx->stream.reactor.id >= 0) eventfd_write(reactors[ctx->stream.reactor.id].wake, 1);
+}
+
+// must be called before socket is closed, so that it's never watched twice
+#define _reactor_unwatch(ctx) _reactor_watch(ctx, -1, 0)
+#else
+#define _reactor_unwatch(ctx)
+#define reactor_wake(ctx)
+#endif
+
 static bool send_header(struct thread_ctx_s *ctx) {
 	char *ptr = ctx->stream.header;
 	int len = ctx->stream.header_len;
@@ -131,6 +306,7 @@ bool stream_disconnect(struct thread_ctx_s *ctx) {
 	}
 #endif
 	if (ctx->fd != -1) {
+		_reactor_unwatch(ctx);
 		closesocket(ctx->fd);
 		ctx->fd = -1;
 		disc = true;
@@ -151,13 +327,17 @@ static void _disconnect(stream_state state, disconnect_code disconnect, struct t
 		ctx->ssl = NULL;
 	}
 #endif
+	_reactor_unwatch(ctx);
 	closesocket(ctx->fd);
 	ctx->fd = -1;
 	if (ctx->stream.store) fclose(ctx->stream.store);
 	wake_controller(ctx);
 }
 
-static int connect_socket(bool use_ssl, struct thread_ctx_s *ctx) {
+#define CONNECT_TIMEOUT	10000
+#define SPARE_AGE		5000
+
+static int connect_socket(struct thread_ctx_s *ctx) {
 	int sock = socket(AF_INET, SOCK_STREAM, 0);
 
 	LOG_INFO("[%p] connecting to %s:%d", ctx, inet_ntoa(ctx->stream.addr.sin_addr), ntohs(ctx->stream.addr.sin_port));
@@ -179,298 +359,507 @@ static int connect_socket(bool use_ssl, struct thread_ctx_s *ctx) {
 	set_nonblock(sock);
 	set_nosigpipe(sock);
 
-	if (tcp_connect_timeout(sock, ctx->stream.addr, 10*1000) < 0) {
+	// connection is completed by stream thread, don't wait for it here
+	if (connect(sock, (struct sockaddr*) &ctx->stream.addr, sizeof(ctx->stream.addr)) < 0 &&
+		last_error() != EINPROGRESS && last_error() != ERROR_WOULDBLOCK) {
 		LOG_WARN("[%p] unable to connect to server", ctx);
 		closesocket(sock);
 		return -1;
 	}
 
+	return sock;
+}
+
+static bool _stream_connect(bool use_ssl, struct thread_ctx_s *ctx) {
+	int sock = connect_socket(ctx);
+
+	if (sock < 0) return false;
+
+	ctx->fd = sock;
+	ctx->stream.use_ssl = use_ssl;
+	ctx->stream.deadline = gettime_ms() + CONNECT_TIMEOUT;
+	ctx->stream.state = CONNECTING;
+
+	return true;
+}
+
+static void _connect_failed(struct thread_ctx_s *ctx) {
+#if USE_SSL
+	// SSL was only a guess, try one more time with plain socket
+	if (ctx->ssl_optional) {
+		ctx->ssl_optional = false;
+		_reactor_unwatch(ctx);
+		closesocket(ctx->fd);
+		ctx->fd = -1;
+		if (_stream_connect(false, ctx)) return;
+	}
+#endif
+	_disconnect(DISCONNECT, UNREACHABLE, ctx);
+}
+
+static void _stream_connected(struct thread_ctx_s *ctx) {
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	getsockopt(ctx->fd, SOL_SOCKET, SO_ERROR, (void*) &error, &len);
+
+	if (error) {
+		LOG_WARN("[%p] unable to connect to server (%d)", ctx, error);
+		_connect_failed(ctx);
+		return;
+	}
+
+	ctx->stream.state = SEND_HEADERS;
+
 #if USE_SSL
-	if (use_ssl) {
+	if (ctx->stream.use_ssl) {
 		ctx->ssl = SSL_new(SSLctx);
-		SSL_set_fd(ctx->ssl, sock);
+		SSL_set_fd(ctx->ssl, ctx->fd);
+		SSL_set_app_data(ctx->ssl, ctx);
+		SSL_set_connect_state(ctx->ssl);
 
 		// add SNI
 		if (*ctx->stream.host) SSL_set_tlsext_host_name(ctx->ssl, ctx->stream.host);
 
-		// try to connect (socket is non-blocking)
-		while (1) {
-			int status, err = 0;
-
-			ERR_clear_error();
-			status = SSL_connect(ctx->ssl);
+		// handshake is done by stream thread, starting with ClientHello
+		ssl_resume(ctx);
+		ctx->ssl_want = POLLOUT;
+	} else ctx->ssl = NULL;
+#endif
+}
 
-			// successful negotiation
-			if (status == 1) break;
+static void _stream_check(struct thread_ctx_s *ctx) {
+	if (ctx->stream.state == CONNECTING && ctx->fd >= 0 && (s32_t) (gettime_ms() - ctx->stream.deadline) > 0) {
+		LOG_WARN("[%p] unable to connect to server (timeout)", ctx);
+		_connect_failed(ctx);
+	}
+}
 
-			// error or non-blocking requires more time
-			if (status < 0) {
-				err = SSL_get_error(ctx->ssl, status);
-				if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) continue;
-			}
+#if USE_SSL
+/*---------------------------------------------------------------------------*/
+static void _ssl_handshake(struct thread_ctx_s *ctx) {
+	int status, err = 0;
 
-			LOG_WARN("[%p]: unable to open SSL socket %d (%d)", ctx, status, err);
+	ERR_clear_error();
+	status = SSL_connect(ctx->ssl);
 
-			closesocket(sock);
-			SSL_free(ctx->ssl);
-			ctx->ssl = NULL;
+	// successful negotiation
+	if (status == 1) {
+		LOG_INFO("[%p]: streaming with SSL%s", ctx, SSL_session_reused(ctx->ssl) ? " (resumed)" : "");
+		return;
+	}
 
-			return -1;
+	// non-blocking requires more time, wait for socket
+	if (status < 0) {
+		err = SSL_get_error(ctx->ssl, status);
+		if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+			ctx->ssl_want = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+			return;
 		}
-		LOG_INFO("[%p]: streaming with SSL", ctx);
-	} else ctx->ssl = NULL;
-#endif
+	}
 
-	return sock;
+	LOG_WARN("[%p]: unable to open SSL socket %d (%d)", ctx, status, err);
+
+	SSL_free(ctx->ssl);
+	ctx->ssl = NULL;
+
+	_connect_failed(ctx);
 }
+#endif
 
-static void *stream_thread(struct thread_ctx_s *ctx) {
-	while (ctx->stream_running) {
+/*---------------------------------------------------------------------------*/
+static short _stream_events(struct thread_ctx_s *ctx) {
+	/*
+	It is required to use min with buf_space as it is the full space - 1,
+	otherwise, a write to full would be authorized and the write pointer
+	would wrap to the read pointer, making impossible to know if the buffer
+	is full or empty. This has the consequence, though, that the buffer can
+	never be totally full and can only wrap once the read pointer has moved
+	so it is impossible to count on having a proper multiply of any number
+	of bytes in the buffer
+	*/
+	size_t space = min(_buf_space(ctx->streambuf), _buf_cont_write(ctx->streambuf));
+
+	if (ctx->fd < 0 || !space || ctx->stream.state <= STREAMING_WAIT) return 0;
+
+	if (ctx->stream.state == CONNECTING) return POLLOUT;
 
-		struct pollfd pollinfo;
-		size_t space;
+#if USE_SSL
+	if (ctx->stream.state == SEND_HEADERS && ctx->ssl && !SSL_is_init_finished(ctx->ssl)) return ctx->ssl_want;
+#endif
 
-		LOCK_S;
+	return ctx->stream.state == SEND_HEADERS ? POLLIN | POLLOUT : POLLIN;
+}
+
+/*---------------------------------------------------------------------------*/
+static bool _stream_ready(struct thread_ctx_s *ctx) {
+	// data can be read without waiting for socket
+	if (ctx->stream.state == STREAMING_FILE || ctx->stream.carry.len) return true;
+#if USE_SSL
+	if (ctx->ssl && SSL_pending(ctx->ssl)) return true;
+#endif
+	return false;
+}
+
+/*---------------------------------------------------------------------------*/
+static void _stream_process(struct thread_ctx_s *ctx, short revents) {
+	size_t space;
 
-		/*
-		It is required to use min with buf_space as it is the full space - 1,
-		otherwise, a write to full would be authorized and the write pointer
-		would wrap to the read pointer, making impossible to know if the buffer
-		is full or empty. This has the consequence, though, that the buffer can
-		never be totally full and can only wrap once the read pointer has moved
-		so it is impossible to count on having a proper multiply of any number
-		of bytes in the buffer
-		*/
+	if (ctx->stream.state == STREAMING_FILE) {
 		space = min(_buf_space(ctx->streambuf), _buf_cont_write(ctx->streambuf));
 
-		if (ctx->fd < 0 || !space || ctx->stream.state <= STREAMING_WAIT) {
-			UNLOCK_S;
-			usleep(100 * 1000);
-			continue;
+		int n = read(ctx->fd, ctx->streambuf->writep, space);
+		if (n == 0) {
+			LOG_INFO("[%p] end of stream", ctx);
+			_disconnect(DISCONNECT, DISCONNECT_OK, ctx);
+		}
+		if (n > 0) {
+			_buf_inc_writep(ctx->streambuf, n);
+			ctx->stream.bytes += n;
+			LOG_SDEBUG("[%p] ctx->streambuf read %d bytes", ctx, n);
+		}
+		if (n < 0) {
+			LOG_WARN("[%p] error reading: %s", ctx, strerror(_last_error(ctx)));
+			_disconnect(DISCONNECT, REMOTE_DISCONNECT, ctx);
 		}
 
-		if (ctx->stream.state == STREAMING_FILE) {
+		return;
+	}
+
+	if (ctx->stream.state == CONNECTING) {
+		if (revents & (POLLOUT | POLLHUP)) _stream_connected(ctx);
+		return;
+	}
+
+#if USE_SSL
+	// handshake is driven by socket readiness instead of spinning on it
+	if (ctx->stream.state == SEND_HEADERS && ctx->ssl && !SSL_is_init_finished(ctx->ssl)) {
+		_ssl_handshake(ctx);
+		return;
+	}
+#endif
+
+	if ((revents & POLLOUT) && ctx->stream.state == SEND_HEADERS) {
+		if (send_header(ctx)) ctx->stream.state = RECV_HEADERS;
+		ctx->stream.header_mlen = ctx->stream.header_len;
+		ctx->stream.header_len = 0;
+		ctx->stream.endtok = 0;
+		return;
+	}
+
+	if (revents & (POLLIN | POLLHUP)) {
+
+		// get response headers
+		if (ctx->stream.state == RECV_HEADERS) {
+
+			// read as much as possible and keep what is after end of headers
+			char *p = ctx->stream.header + ctx->stream.header_len;
+			int i;
+
+			int n = _recv(ctx, p, MAX_HEADER - 1 - ctx->stream.header_len, 0);
+			if (n <= 0) {
+				if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
+					return;
+				}
+				LOG_WARN("[%p] error reading headers: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
+#if USE_SSL
+				if (!ctx->ssl && !ctx->stream.header_len) {
+					// let's restart with SSL this time
+					ctx->stream.header_len = ctx->stream.header_mlen;
+					_reactor_unwatch(ctx);
+					closesocket(ctx->fd);
+					ctx->fd = -1;
+					LOG_INFO("[%p] now attempting with SSL", ctx);
+					ctx->ssl_optional = false;
+
+					if (_stream_connect(true, ctx)) return;
+				}
+#endif
+				_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
+				return;
+			}
 
-			int n = read(ctx->fd, ctx->streambuf->writep, space);
+			for (i = 0; i < n && ctx->stream.endtok < 4; i++) {
+				ctx->stream.header_len++;
+				if (ctx->stream.header_len > 1 && (p[i] == '\r' || p[i] == '\n')) ctx->stream.endtok++;
+				else ctx->stream.endtok = 0;
+			}
+
+			if (ctx->stream.endtok == 4) {
+				if (i < n) _unrecv(ctx, p + i, n - i);
+				*(ctx->stream.header + ctx->stream.header_len) = '\0';
+				LOG_INFO("[%p] headers: len: %d\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
+				ctx->stream.state = ctx->stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
+				wake_controller(ctx);
+			} else if (ctx->stream.header_len >= MAX_HEADER - 1) {
+				LOG_ERROR("[%p] received headers too long: %u", ctx, ctx->stream.header_len);
+				_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
+			}
+
+			return;
+		}
+
+		// receive icy meta data
+
+		if (ctx->stream.meta_interval && ctx->stream.meta_next == 0) {
+			if (ctx->stream.meta_left == 0) {
+				// read meta length and as much of meta as possible at once
+				u8_t *p = (u8_t*) ctx->stream.header;
+				int n = _recv_carry(ctx, p, MAX_HEADER - 1);
+				if (n <= 0) {
+					if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
+						return;
+					}
+					LOG_WARN("[%p] error reading icy meta: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
+					_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
+					return;
+				}
+				// MAX_HEADER must be more than meta max of 16 * 255
+				ctx->stream.meta_left = 16 * *p;
+				// amount of received meta data, what's beyond is body
+				ctx->stream.header_len = min((u32_t) n - 1, ctx->stream.meta_left);
+				memmove(p, p + 1, ctx->stream.header_len);
+				if (n - 1 > ctx->stream.header_len) _unrecv(ctx, p + 1 + ctx->stream.header_len, n - 1 - ctx->stream.header_len);
+				ctx->stream.meta_left -= ctx->stream.header_len;
+			}
+
+			if (ctx->stream.meta_left) {
+				int n = _recv_carry(ctx, ctx->stream.header + ctx->stream.header_len, ctx->stream.meta_left);
+				if (n <= 0) {
+					if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
+						return;
+					}
+					LOG_WARN("[%p] error reading icy meta: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
+					_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
+					return;
+				}
+				ctx->stream.meta_left -= n;
+				ctx->stream.header_len += n;
+			}
+
+			if (ctx->stream.meta_left == 0) {
+				if (ctx->stream.header_len) {
+					*(ctx->stream.header + ctx->stream.header_len) = '\0';
+					LOG_INFO("[%p] icy meta: len: %u\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
+					ctx->stream.meta_send = true;
+					wake_controller(ctx);
+				}
+				ctx->stream.meta_next = ctx->stream.meta_interval;
+				return;
+			}
+
+		// stream body into streambuf
+		} else {
+			space = min(_buf_space(ctx->streambuf), _buf_cont_write(ctx->streambuf));
+
+			if (ctx->stream.meta_interval) {
+				space = min(space, ctx->stream.meta_next);
+			}
+
+			int n = _recv_carry(ctx, ctx->streambuf->writep, space);
 			if (n == 0) {
-				LOG_INFO("[%p] end of stream", ctx);
+				LOG_INFO("[%p] end of stream (t:%lld)", ctx, ctx->stream.bytes);
 				_disconnect(DISCONNECT, DISCONNECT_OK, ctx);
 			}
+			if (n < 0 && _last_error(ctx) != ERROR_WOULDBLOCK) {
+				LOG_WARN("[%p] error reading: %s (%d)", ctx, strerror(_last_error(ctx)), _last_error(ctx));
+				_disconnect(DISCONNECT, REMOTE_DISCONNECT, ctx);
+			}
+
 			if (n > 0) {
+				if (ctx->stream.store) fwrite(ctx->streambuf->writep, 1, n, ctx->stream.store);
 				_buf_inc_writep(ctx->streambuf, n);
 				ctx->stream.bytes += n;
-				LOG_SDEBUG("[%p] ctx->streambuf read %d bytes", ctx, n);
+				wake_output(ctx);
+				if (ctx->stream.meta_interval) {
+					ctx->stream.meta_next -= n;
+				}
+			} else {
+				return;
 			}
-			if (n < 0) {
-				LOG_WARN("[%p] error reading: %s", ctx, strerror(_last_error(ctx)));
-				_disconnect(DISCONNECT, REMOTE_DISCONNECT, ctx);
+
+			if (ctx->stream.state == STREAMING_BUFFERING && ctx->stream.bytes > ctx->stream.threshold) {
+				ctx->stream.state = STREAMING_HTTP;
+				wake_controller(ctx);
 			}
 
+			LOG_DEBUG("[%p] streambuf read %d bytes", ctx, n);
+		}
+	}
+
+}
+
+/*---------------------------------------------------------------------------*/
+static void *stream_thread(struct thread_ctx_s *ctx) {
+	while (ctx->stream_running) {
+
+		struct pollfd pollinfo;
+		bool carried;
+
+		LOCK_S;
+
+		_stream_check(ctx);
+		pollinfo.events = _stream_events(ctx);
+
+		if (!pollinfo.events) {
 			UNLOCK_S;
+			usleep(100 * 1000);
 			continue;
+		}
 
-		} else {
-
-			pollinfo.fd = ctx->fd;
-			pollinfo.events = POLLIN;
-			if (ctx->stream.state == SEND_HEADERS) {
-				pollinfo.events |= POLLOUT;
-			}
+		if (ctx->stream.state == STREAMING_FILE) {
+			_stream_process(ctx, POLLIN);
+			UNLOCK_S;
+			continue;
 		}
 
+		pollinfo.fd = ctx->fd;
+
+		// no need to wait for socket if data has already been read ahead
+		carried = ctx->stream.carry.len != 0;
+
 		UNLOCK_S;
 
-		if (_poll(ctx, &pollinfo, 100)) {
+		if (carried || _poll(ctx, &pollinfo, 100)) {
 
 			LOCK_S;
 
 			// check socket has not been closed while in poll
-			if (ctx->fd < 0) {
-				UNLOCK_S;
-				continue;
-			}
-
-			if ((pollinfo.revents & POLLOUT) && ctx->stream.state == SEND_HEADERS) {
-				if (send_header(ctx)) ctx->stream.state = RECV_HEADERS;
-				ctx->stream.header_mlen = ctx->stream.header_len;
-				ctx->stream.header_len = 0;
-				UNLOCK_S;
-				continue;
-			}
-
-			if (pollinfo.revents & (POLLIN | POLLHUP)) {
+			if (ctx->fd >= 0) _stream_process(ctx, carried ? POLLIN : pollinfo.revents);
 
-				// get response headers
-				if (ctx->stream.state == RECV_HEADERS) {
+			UNLOCK_S;
 
-					// read one byte at a time to catch end of header
-					char c;
+		}
+		else {
+			LOG_SDEBUG("[%p] poll timeout", ctx);
+		}
+	}
 
-					int n = _recv(ctx, &c, 1, 0);
-					if (n <= 0) {
-						if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
-							UNLOCK_S;
-							continue;
-						}
-						LOG_WARN("[%p] error reading headers: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
 #if USE_SSL
-						if (!ctx->ssl && !ctx->stream.header_len) {
-							int sock;
-
-							// let's restart with SSL this time
-							ctx->stream.header_len = ctx->stream.header_mlen;
-							closesocket(ctx->fd);
-							ctx->fd = -1;
-							LOG_INFO("[%p] now attempting with SSL", ctx);
-
-							// stay locked for slimproto (I know it can be long)
-							sock = connect_socket(true, ctx);
-
-							if (sock >= 0) {
-								ctx->fd = sock;
-								ctx->stream.state = SEND_HEADERS;
-								UNLOCK_S;
-								continue;
-							}
-						}
+	ssl_release();
 #endif
-						_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
-						UNLOCK_S;
-						continue;
-					}
-
-					*(ctx->stream.header + ctx->stream.header_len) = c;
-					ctx->stream.header_len++;
 
-					if (ctx->stream.header_len > MAX_HEADER - 1) {
-						LOG_ERROR("[%p] received headers too long: %u", ctx, ctx->stream.header_len);
-						_disconnect(DISCONNECT, LOCAL_DISCONNECT, ctx);
-					}
+	return 0;
+}
 
-					if (ctx->stream.header_len > 1 && (c == '\r' || c == '\n')) {
-						ctx->stream.endtok++;
-						if (ctx->stream.endtok == 4) {
-							*(ctx->stream.header + ctx->stream.header_len) = '\0';
-							LOG_INFO("[%p] headers: len: %d\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
-							ctx->stream.state = ctx->stream.cont_wait ? STREAMING_WAIT : STREAMING_BUFFERING;
-							wake_controller(ctx);
-						}
-					} else {
-						ctx->stream.endtok = 0;
-					}
+#if LINUX
+/*---------------------------------------------------------------------------*/
+static void *reactor_thread(struct reactor_s *reactor) {
+	struct epoll_event *events = malloc((max_players + 1) * sizeof(struct epoll_event));
 
-					UNLOCK_S;
-					continue;
-				}
+	while (reactor->running) {
+		int i, n, timeout = -1;
 
-				// receive icy meta data
-
-				if (ctx->stream.meta_interval && ctx->stream.meta_next == 0) {
-					if (ctx->stream.meta_left == 0) {
-						// read meta length
-						u8_t c;
-						int n = _recv(ctx, &c, 1, 0);
-						if (n <= 0) {
-							if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
-								UNLOCK_S;
-								continue;
-							}
-							LOG_WARN("[%p] error reading icy meta: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
-							_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
-							UNLOCK_S;
-							continue;
-						}
-						ctx->stream.meta_left = 16 * c;
-						ctx->stream.header_len = 0; // amount of received meta data
-						// MAX_HEADER must be more than meta max of 16 * 255
-					}
+		mutex_lock(reactor->mutex);
 
-					if (ctx->stream.meta_left) {
-						int n = _recv(ctx, ctx->stream.header + ctx->stream.header_len, ctx->stream.meta_left, 0);
-						if (n <= 0) {
-							if (n < 0 && _last_error(ctx) == ERROR_WOULDBLOCK) {
-								UNLOCK_S;
-								continue;
-							}
-							LOG_WARN("[%p] error reading icy meta: %s", ctx, n ? strerror(_last_error(ctx)) : "closed");
-							_disconnect(STOPPED, LOCAL_DISCONNECT, ctx);
-							UNLOCK_S;
-							continue;
-						}
-						ctx->stream.meta_left -= n;
-						ctx->stream.header_len += n;
-					}
+		// update what players are waiting for and serve those who don't need to
+		for (i = 0; i < max_players; i++) {
+			struct thread_ctx_s *ctx = reactor->ctx[i];
+			short wanted;
 
-					if (ctx->stream.meta_left == 0) {
-						if (ctx->stream.header_len) {
-							*(ctx->stream.header + ctx->stream.header_len) = '\0';
-							LOG_INFO("[%p] icy meta: len: %u\n%s", ctx, ctx->stream.header_len, ctx->stream.header);
-							ctx->stream.meta_send = true;
-							wake_controller(ctx);
-						}
-						ctx->stream.meta_next = ctx->stream.meta_interval;
-						UNLOCK_S;
-						continue;
-					}
+			if (!ctx) continue;
 
-				// stream body into streambuf
-				} else {
-					space = min(_buf_space(ctx->streambuf), _buf_cont_write(ctx->streambuf));
+			LOCK_S;
+			_stream_check(ctx);
+			wanted = _stream_events(ctx);
+			if (wanted && _stream_ready(ctx)) {
+				_stream_process(ctx, POLLIN);
+				timeout = 0;
+			} else {
+				_reactor_watch(ctx, wanted ? ctx->fd : -1, wanted);
+				// can't take data now but will later, or connection might time out
+				if ((!wanted || ctx->stream.state == CONNECTING) && ctx->fd >= 0 && timeout) timeout = 100;
+			}
+			UNLOCK_S;
+		}
 
-					if (ctx->stream.meta_interval) {
-						space = min(space, ctx->stream.meta_next);
-					}
+		mutex_unlock(reactor->mutex);
 
-					int n = _recv(ctx, ctx->streambuf->writep, space, 0);
-					if (n == 0) {
-						LOG_INFO("[%p] end of stream (t:%lld)", ctx, ctx->stream.bytes);
-						_disconnect(DISCONNECT, DISCONNECT_OK, ctx);
-					}
-					if (n < 0 && _last_error(ctx) != ERROR_WOULDBLOCK) {
-						LOG_WARN("[%p] error reading: %s (%d)", ctx, strerror(_last_error(ctx)), _last_error(ctx));
-						_disconnect(DISCONNECT, REMOTE_DISCONNECT, ctx);
-					}
+		n = epoll_wait(reactor->efd, events, max_players + 1, timeout);
 
-					if (n > 0) {
-						if (ctx->stream.store) fwrite(ctx->streambuf->writep, 1, n, ctx->stream.store);
-						_buf_inc_writep(ctx->streambuf, n);
-						ctx->stream.bytes += n;
-						wake_output(ctx);
-						if (ctx->stream.meta_interval) {
-							ctx->stream.meta_next -= n;
-						}
-					} else {
-						UNLOCK_S;
-						continue;
-					}
+		mutex_lock(reactor->mutex);
 
-					if (ctx->stream.state == STREAMING_BUFFERING && ctx->stream.bytes > ctx->stream.threshold) {
-						ctx->stream.state = STREAMING_HTTP;
-						wake_controller(ctx);
-					}
+		for (i = 0; i < n; i++) {
+			struct thread_ctx_s *ctx = events[i].data.ptr;
+			short revents = 0;
 
-					LOG_DEBUG("[%p] streambuf read %d bytes", ctx, n);
-				}
+			if (!ctx) {
+				eventfd_t count;
+				eventfd_read(reactor->wake, &count);
+				continue;
 			}
 
-			UNLOCK_S;
+			// player might have been closed while waiting
+			if (reactor->ctx[ctx - thread_ctx] != ctx) continue;
 
+			if (events[i].events & EPOLLIN) revents |= POLLIN;
+			if (events[i].events & EPOLLOUT) revents |= POLLOUT;
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) revents |= POLLHUP;
+
+			LOCK_S;
+			if (ctx->fd >= 0 && ctx->fd == ctx->stream.reactor.fd) _stream_process(ctx, revents);
+			UNLOCK_S;
 		}
-		else {
-			LOG_SDEBUG("[%p] poll timeout", ctx);
-		}
-	}
 
-#if USE_SSL
-	if (!--SSLcount) {
-		SSL_CTX_free(SSLctx);
-		SSLctx = NULL;
+		mutex_unlock(reactor->mutex);
 	}
+
+	free(events);
+	return NULL;
+}
 #endif
 
-	return 0;
+/*---------------------------------------------------------------------------*/
+void stream_init(unsigned count) {
+#if LINUX
+	unsigned i;
+
+	reactor_count = min(count, MAX_REACTORS);
+
+	for (i = 0; i < reactor_count; i++) {
+		struct reactor_s *reactor = reactors + i;
+		struct epoll_event event = { EPOLLIN, { NULL } };
+		pthread_attr_t attr;
+
+		mutex_create(reactor->mutex);
+		reactor->ctx = calloc(max_players, sizeof(struct thread_ctx_s*));
+		reactor->efd = epoll_create1(0);
+		reactor->wake = eventfd(0, EFD_NONBLOCK);
+		epoll_ctl(reactor->efd, EPOLL_CTL_ADD, reactor->wake, &event);
+		reactor->running = true;
+
+		pthread_attr_init(&attr);
+		pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + STREAM_THREAD_STACK_SIZE);
+		pthread_create(&reactor->thread, &attr, (void *(*)(void*)) reactor_thread, reactor);
+		pthread_attr_destroy(&attr);
+	}
+
+	if (reactor_count) LOG_INFO("streaming with %u reactor(s)", reactor_count);
+#else
+	if (count) LOG_WARN("stream reactors not available on this platform", NULL);
+#endif
 }
 
+/*---------------------------------------------------------------------------*/
+void stream_end(void) {
+#if LINUX
+	unsigned i;
+
+	for (i = 0; i < reactor_count; i++) {
+		struct reactor_s *reactor = reactors + i;
+
+		reactor->running = false;
+		eventfd_write(reactor->wake, 1);
+		pthread_join(reactor->thread, NULL);
+		close(reactor->efd);
+		close(reactor->wake);
+		mutex_destroy(reactor->mutex);
+		free(reactor->ctx);
+	}
+
+	reactor_count = 0;
+#endif
+}
 
 /*---------------------------------------------------------------------------*/
 bool stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx) {
@@ -488,11 +877,7 @@ bool stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx) {
 	}
 
 #if USE_SSL
-	if (!SSLctx) {
-		SSLctx = SSL_CTX_new(SSLv23_client_method());
-		if (SSLctx) SSL_CTX_set_options(SSLctx, SSL_OP_NO_SSLv2);
-	}
-	SSLcount++;
+	ssl_acquire();
 	ctx->ssl = NULL;
 #endif
 
@@ -500,10 +885,32 @@ bool stream_thread_init(unsigned streambuf_size, struct thread_ctx_s *ctx) {
 	ctx->stream.state = STOPPED;
 	ctx->stream.header = malloc(MAX_HEADER);
 	ctx->stream.header[0] = '\0';
+	ctx->stream.carry.buf = malloc(MAX_HEADER);
+	ctx->stream.carry.len = ctx->stream.carry.pos = 0;
+	ctx->stream.reactor.id = ctx->stream.reactor.fd = -1;
+	ctx->stream.spare.fd = -1;
+	ctx->stream.use_ssl = false;
+	memset(&ctx->stream.addr, 0, sizeof(ctx->stream.addr));
 	ctx->fd = -1;
 
 	touch_memory(ctx->streambuf->buf, ctx->streambuf->size);
 
+#if LINUX
+	// let a reactor serve that player
+	if (reactor_count) {
+		struct reactor_s *reactor = reactors + (ctx - thread_ctx) % reactor_count;
+
+		ctx->stream.reactor.id = reactor - reactors;
+		ctx->stream.reactor.events = 0;
+		mutex_lock(reactor->mutex);
+		reactor->ctx[ctx - thread_ctx] = ctx;
+		mutex_unlock(reactor->mutex);
+		reactor_wake(ctx);
+
+		return true;
+	}
+#endif
+
 	pthread_attr_init(&attr);
 	pthread_attr_setstacksize(&attr, PTHREAD_STACK_MIN + STREAM_THREAD_STACK_SIZE);
 	pthread_create(&ctx->stream_thread, &attr, (void *(*)(void*)) stream_thread, ctx);
@@ -517,8 +924,27 @@ void stream_close(struct thread_ctx_s *ctx) {
 	LOCK_S;
 	ctx->stream_running = false;
 	UNLOCK_S;
+#if LINUX
+	if (ctx->stream.reactor.id >= 0) {
+		struct reactor_s *reactor = reactors + ctx->stream.reactor.id;
+
+		// once removed, reactor does not touch that player anymore
+		mutex_lock(reactor->mutex);
+		reactor->ctx[ctx - thread_ctx] = NULL;
+		mutex_unlock(reactor->mutex);
+
+		LOCK_S;
+		_reactor_unwatch(ctx);
+		UNLOCK_S;
+#if USE_SSL
+		ssl_release();
+#endif
+	} else
+#endif
 	pthread_join(ctx->stream_thread, NULL);
+	if (ctx->stream.spare.fd >= 0) closesocket(ctx->stream.spare.fd);
 	free(ctx->stream.header);
+	free(ctx->stream.carry.buf);
 	buf_destroy(ctx->streambuf);
 }
 
@@ -551,13 +977,50 @@ void stream_file(const char *header, size_t header_len, unsigned threshold, stru
 	ctx->stream.meta_next = 0;
 	ctx->stream.meta_left = 0;
 	ctx->stream.meta_send = false;
+	ctx->stream.carry.len = ctx->stream.carry.pos = 0;
 	ctx->stream.sent_headers = false;
 	ctx->stream.bytes = 0;
 	ctx->stream.threshold = threshold;
 
+	reactor_wake(ctx);
 	UNLOCK_S;
 }
 
+/*
+Open a connection to where last stream came from, as next one most likely
+comes from there as well, so that it's ready when LMS requests next track
+*/
+void stream_preconnect(struct thread_ctx_s *ctx) {
+	LOCK_S;
+
+	if (ctx->stream.spare.fd < 0 && ctx->stream.addr.sin_port && !ctx->stream.use_ssl) {
+		ctx->stream.spare.fd = connect_socket(ctx);
+		ctx->stream.spare.addr = ctx->stream.addr;
+		ctx->stream.spare.time = gettime_ms();
+	}
+
+	UNLOCK_S;
+}
+
+static int stream_spare(bool use_ssl, struct thread_ctx_s *ctx) {
+	struct pollfd pollinfo = { ctx->stream.spare.fd, POLLIN, 0 };
+	int sock = ctx->stream.spare.fd;
+
+	if (sock < 0) return -1;
+	ctx->stream.spare.fd = -1;
+
+	// must be plain, to the same server, recent and not closed by server
+	if (!use_ssl && ctx->stream.spare.addr.sin_addr.s_addr == ctx->stream.addr.sin_addr.s_addr &&
+		ctx->stream.spare.addr.sin_port == ctx->stream.addr.sin_port &&
+		gettime_ms() - ctx->stream.spare.time < SPARE_AGE && poll(&pollinfo, 1, 0) == 0) {
+		LOG_INFO("[%p] using connection opened ahead", ctx);
+		return sock;
+	}
+
+	closesocket(sock);
+	return -1;
+}
+
 void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t header_len, unsigned threshold, bool cont_wait, struct thread_ctx_s *ctx) {
 	int sock;
 	char *p;
@@ -574,30 +1037,34 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t
 	}
 
 	port = ntohs(port);
-	sock = connect_socket(use_ssl || port == 443, ctx);
+	sock = stream_spare(use_ssl || port == 443, ctx);
 
-	// try one more time with plain socket
-	if (sock < 0 && port == 443 && !use_ssl) sock = connect_socket(false, ctx);
+	buf_flush(ctx->streambuf);
 
-	if (sock < 0) {
-		LOCK_S;
+	LOCK_S;
+
+	// connection is completed by stream thread, so this does not wait
+	if (sock >= 0) {
+		ctx->fd = sock;
+		ctx->stream.use_ssl = false;
+		ctx->stream.deadline = gettime_ms() + CONNECT_TIMEOUT;
+		ctx->stream.state = CONNECTING;
+	} else if (!_stream_connect(use_ssl || port == 443, ctx) && !(port == 443 && !use_ssl && _stream_connect(false, ctx))) {
 		ctx->stream.state = DISCONNECT;
 		ctx->stream.disconnect = UNREACHABLE;
 		UNLOCK_S;
 		return;
 	}
 
-	buf_flush(ctx->streambuf);
-
-	LOCK_S;
-
-	ctx->fd = sock;
-	ctx->stream.state = SEND_HEADERS;
+#if USE_SSL
+	ctx->ssl_optional = port == 443 && !use_ssl && ctx->stream.use_ssl;
+#endif
 	ctx->stream.cont_wait = cont_wait;
 	ctx->stream.meta_interval = 0;
 	ctx->stream.meta_next = 0;
 	ctx->stream.meta_left = 0;
 	ctx->stream.meta_send = false;
+	ctx->stream.carry.len = ctx->stream.carry.pos = 0;
 	ctx->stream.header_len = header_len;
 	memcpy(ctx->stream.header, header, header_len);
 	*(ctx->stream.header+header_len) = '\0';
@@ -610,12 +1077,13 @@ void stream_sock(u32_t ip, u16_t port, bool use_ssl, const char *header, size_t
 
 	if (*ctx->config.store_prefix) {
 		char name[STR_LEN];
-		snprintf(name, sizeof(name), "%s/" BRIDGE_URL "%u-in#%u#.%s", ctx->config.store_prefix, ctx->output.index, sock, ctx->codec->types);
+		snprintf(name, sizeof(name), "%s/" BRIDGE_URL "%u-in#%u#.%s", ctx->config.store_prefix, ctx->output.index, ctx->fd, ctx->codec->types);
 		ctx->stream.store = fopen(name, "wb");
 	} else {
 		ctx->stream.store = NULL;
 	}
 
+	reactor_wake(ctx);
 	UNLOCK_S;
 }
 